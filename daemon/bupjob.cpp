@@ -9,6 +9,7 @@
 #include <KLocalizedString>
 
 #include <QFileInfo>
+#include <QStandardPaths>
 #include <QThread>
 
 #include <signal.h>
@@ -20,6 +21,7 @@ BupJob::BupJob(BackupPlan &pBackupPlan, const QString &pDestinationPath, const Q
     mIndexProcess.setOutputChannelMode(KProcess::SeparateChannels);
     mSaveProcess.setOutputChannelMode(KProcess::SeparateChannels);
     mPar2Process.setOutputChannelMode(KProcess::SeparateChannels);
+    mCommitGraphProcess.setOutputChannelMode(KProcess::SeparateChannels);
     setCapabilities(KJob::Suspendable);
     mHarmlessErrorCount = 0;
     mAllErrorsHarmless = false;
@@ -228,8 +230,7 @@ void BupJob::slotSavingDone(int pExitCode, QProcess::ExitStatus pExitStatus)
         mLogStream << quoteArgs(mPar2Process.program()) << Qt::endl;
         mPar2Process.start();
     } else {
-        mLogStream << QStringLiteral("Kup successfully completed the bup backup job at ") << QLocale().toString(QDateTime::currentDateTime()) << Qt::endl;
-        jobFinishedSuccess();
+        writeCommitGraph();
     }
 }
 
@@ -256,11 +257,74 @@ void BupJob::slotRecoveryInfoDone(int pExitCode, QProcess::ExitStatus pExitStatu
                                 "Failed to generate recovery info for the backup. "
                                 "See log file for more details."));
     } else {
-        mLogStream << QStringLiteral("Kup successfully completed the bup backup job.") << Qt::endl;
-        jobFinishedSuccess();
+        writeCommitGraph();
     }
 }
 
+// The file browser and the kio worker read commit times and trees from git's
+// commit-graph file instead of loading every commit object. Needs the git program,
+// the backup is complete without it so any failure here is only logged.
+void BupJob::writeCommitGraph()
+{
+    const QString lGitPath = QStandardPaths::findExecutable(QStringLiteral("git"));
+    if (lGitPath.isEmpty()) {
+        mLogStream << QStringLiteral("git not found, skipping writing of commit-graph.") << Qt::endl;
+        slotCommitGraphDone(0, QProcess::NormalExit);
+        return;
+    }
+    mCommitGraphProcess << lGitPath;
+    mCommitGraphProcess << QStringLiteral("--git-dir=%1").arg(mDestinationPath);
+    mCommitGraphProcess << QStringLiteral("commit-graph") << QStringLiteral("write") << QStringLiteral("--reachable");
+
+    connect(&mCommitGraphProcess, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), this, &BupJob::slotCommitGraphDone);
+    connect(&mCommitGraphProcess, &KProcess::started, this, &BupJob::slotCommitGraphStarted);
+    mLogStream << quoteArgs(mCommitGraphProcess.program()) << Qt::endl;
+    mCommitGraphProcess.start();
+}
+
+void BupJob::slotCommitGraphStarted()
+{
+    makeNice(mCommitGraphProcess.processId());
+    emit description(this, i18n("Indexing backup history"));
+}
+
+void BupJob::slotCommitGraphDone(int pExitCode, QProcess::ExitStatus pExitStatus)
+{
+    QString lErrors = QString::fromUtf8(mCommitGraphProcess.readAllStandardError());
+    if (!lErrors.isEmpty()) {
+        mLogStream << lErrors << Qt::endl;
+    }
+    if (pExitStatus != QProcess::NormalExit || pExitCode != 0) {
+        mLogStream << QStringLiteral("Failed to write commit-graph, browsing backups will be slower.") << Qt::endl;
+    }
+    updateHistoryIndex();
+}
+
+// The file digger keeps an index of all versions of all paths so that it doesn't
+// have to load every snapshot. Updating it needs libgit2, so this is done by the
+// file digger itself. The backup is complete at this point and the first update
+// walks the whole history, so it runs detached and the job finishes right away.
+// Only the new snapshots are indexed, an update that finds the index locked by
+// another one gives up and the next backup catches up.
+void BupJob::updateHistoryIndex()
+{
+    const QString lFileDiggerPath = QStandardPaths::findExecutable(QStringLiteral("kup-filedigger"));
+    if (lFileDiggerPath.isEmpty()) {
+        mLogStream << QStringLiteral("kup-filedigger not found, skipping update of history index.") << Qt::endl;
+    } else {
+        const QStringList lArguments{QStringLiteral("--update-history-index"), QStringLiteral("--branch"), QStringLiteral("kup"), mDestinationPath};
+        mLogStream << quoteArgs(QStringList(lFileDiggerPath) + lArguments) << Qt::endl;
+        qint64 lPid;
+        if (QProcess::startDetached(lFileDiggerPath, lArguments, QString(), &lPid)) {
+            makeNice(static_cast<int>(lPid));
+        } else {
+            mLogStream << QStringLiteral("Failed to start update of history index, browsing backups will be slower.") << Qt::endl;
+        }
+    }
+    mLogStream << QStringLiteral("Kup successfully completed the bup backup job at ") << QLocale().toString(QDateTime::currentDateTime()) << Qt::endl;
+    jobFinishedSuccess();
+}
+
 void BupJob::slotReadBupErrors()
 {
     qulonglong lCopiedKBytes = 0, lTotalKBytes = 0, lCopiedFiles = 0, lTotalFiles = 0;
@@ -338,6 +402,9 @@ bool BupJob::doSuspend()
     if (mPar2Process.state() == KProcess::Running) {
         return 0 == ::kill(mPar2Process.processId(), SIGSTOP);
     }
+    if (mCommitGraphProcess.state() == KProcess::Running) {
+        return 0 == ::kill(mCommitGraphProcess.processId(), SIGSTOP);
+    }
     return false;
 }
 
@@ -355,5 +422,8 @@ bool BupJob::doResume()
     if (mPar2Process.state() == KProcess::Running) {
         return 0 == ::kill(mPar2Process.processId(), SIGCONT);
     }
+    if (mCommitGraphProcess.state() == KProcess::Running) {
+        return 0 == ::kill(mCommitGraphProcess.processId(), SIGCONT);
+    }
     return false;
 }
@@ -31,6 +31,10 @@ protected slots:
     void slotSavingDone(int pExitCode, QProcess::ExitStatus pExitStatus);
     void slotRecoveryInfoStarted();
     void slotRecoveryInfoDone(int pExitCode, QProcess::ExitStatus pExitStatus);
+    void writeCommitGraph();
+    void slotCommitGraphStarted();
+    void slotCommitGraphDone(int pExitCode, QProcess::ExitStatus pExitStatus);
+    void updateHistoryIndex();
     void slotReadBupErrors();
 
 protected:
@@ -41,6 +45,7 @@ protected:
     KProcess mIndexProcess;
     KProcess mSaveProcess;
     KProcess mPar2Process;
+    KProcess mCommitGraphProcess;
     QElapsedTimer mInfoRateLimiter;
     int mHarmlessErrorCount;
     bool mAllErrorsHarmless;
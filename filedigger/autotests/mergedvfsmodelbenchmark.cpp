@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "mergedvfs.h"
+#include "mergedvfsmodel.h"
+
+#include <QAbstractItemModelTester>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <git2.h>
+
+static const int cEntryCount = 100000;
+static const int cSnapshotCount = 4;
+
+// Builds a repository where one folder gets cEntryCount files over cSnapshotCount
+// snapshots, every snapshot adding files spread over the whole folder.
+class MergedVfsModelBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        QStandardPaths::setTestModeEnabled(true); // no history index from a real cache
+        git_libgit2_init();
+        QVERIFY(mRepositoryDir.isValid());
+        git_repository *lRepository;
+        QCOMPARE(git_repository_init(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData(), 1), 0);
+        git_oid lBlob;
+        QCOMPARE(git_blob_create_from_buffer(&lBlob, lRepository, "kup", 3), 0);
+
+        git_commit *lParent = nullptr;
+        for (int lSnapshot = 0; lSnapshot < cSnapshotCount; ++lSnapshot) {
+            git_treebuilder *lBuilder;
+            QCOMPARE(git_treebuilder_new(&lBuilder, lRepository, nullptr), 0);
+            for (int i = lSnapshot; i < cEntryCount; i += cSnapshotCount) {
+                const QByteArray lName = QByteArray("file") + QByteArray::number(i).rightJustified(6, '0');
+                QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, lName.constData(), &lBlob, GIT_FILEMODE_BLOB), 0);
+            }
+            git_oid lFolder;
+            QCOMPARE(git_treebuilder_write(&lFolder, lBuilder), 0);
+            git_treebuilder_clear(lBuilder);
+            QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, "folder", &lFolder, GIT_FILEMODE_TREE), 0);
+            git_oid lRootOid;
+            QCOMPARE(git_treebuilder_write(&lRootOid, lBuilder), 0);
+            git_treebuilder_free(lBuilder);
+
+            git_tree *lRoot;
+            QCOMPARE(git_tree_lookup(&lRoot, lRepository, &lRootOid), 0);
+            git_signature *lSignature;
+            QCOMPARE(git_signature_new(&lSignature, "kup", "kup@localhost", 1600000000 + lSnapshot * 3600, 0), 0);
+            const git_commit *lParents[] = {lParent};
+            git_oid lCommitOid;
+            QCOMPARE(git_commit_create(&lCommitOid, lRepository, "refs/heads/kup", lSignature, lSignature, nullptr, "snapshot", lRoot, lParent ? 1 : 0, lParents),
+                     0);
+            git_signature_free(lSignature);
+            git_tree_free(lRoot);
+            git_commit_free(lParent);
+            QCOMPARE(git_commit_lookup(&lParent, lRepository, &lCommitOid), 0);
+        }
+        git_commit_free(lParent);
+        git_repository_free(lRepository);
+    }
+
+    void cleanupTestCase()
+    {
+        git_libgit2_shutdown();
+    }
+
+    void mergeLargeFolder()
+    {
+        QBENCHMARK_ONCE {
+            auto lRepository = new MergedRepository(mRepositoryDir.path(), QStringLiteral("kup"));
+            QVERIFY(lRepository->open());
+            QVERIFY(lRepository->readBranch());
+            MergedVfsModel lModel(lRepository); // takes ownership of lRepository
+            QAbstractItemModelTester lTester(&lModel, QAbstractItemModelTester::FailureReportingMode::QtTest);
+
+            lModel.fetchMore(QModelIndex());
+            QTRY_VERIFY_WITH_TIMEOUT(lModel.hasAllSubNodes(QModelIndex()), 10000);
+            QCOMPARE(lModel.rowCount(QModelIndex()), 1);
+
+            const QModelIndex lFolder = lModel.index(0, 0, QModelIndex());
+            lModel.fetchMore(lFolder);
+            QTRY_VERIFY_WITH_TIMEOUT(lModel.hasAllSubNodes(lFolder), 120000);
+            QCOMPARE(lModel.rowCount(lFolder), cEntryCount);
+            for (int i = 0; i < cEntryCount; i += 997) {
+                const QModelIndex lChild = lModel.index(i, 0, lFolder);
+                QCOMPARE(lModel.parent(lChild), lFolder);
+                QCOMPARE(lChild.data().toString(), QStringLiteral("file%1").arg(i, 6, 10, QLatin1Char('0')));
+            }
+        }
+    }
+
+private:
+    QTemporaryDir mRepositoryDir;
+};
+
+QTEST_MAIN(MergedVfsModelBenchmark)
+
+#include "mergedvfsmodelbenchmark.moc"
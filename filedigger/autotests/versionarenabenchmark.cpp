@@ -0,0 +1,152 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "mergedvfs.h"
+#include "mergedvfsmodel.h"
+
+#include <QSet>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <git2.h>
+
+#if __has_include(<malloc.h>)
+#include <malloc.h>
+#endif
+
+static const int cFileCount = 10000;
+static const int cSnapshotCount = 40;
+static const int cBlobCount = 10;
+static const int cSnapshotsPerVersion = 5; // how long a file keeps its content
+
+// bytes allocated on the heap right now, 0 if it can not be told
+static quint64 heapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// The content a file has in a snapshot, files change at different snapshots.
+static int blobIndex(int pFile, int pSnapshot)
+{
+    return (pSnapshot + pFile % cSnapshotsPerVersion) / cSnapshotsPerVersion % cBlobCount;
+}
+
+// Builds a repository with one folder of cFileCount files over cSnapshotCount
+// snapshots, where every file has a new version every few snapshots, and compares
+// the memory held by the version records in the arena with one vector per node.
+class VersionArenaBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        QStandardPaths::setTestModeEnabled(true); // no history index from a real cache
+        git_libgit2_init();
+        QVERIFY(mRepositoryDir.isValid());
+        git_repository *lRepository;
+        QCOMPARE(git_repository_init(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData(), 1), 0);
+        git_oid lBlobs[cBlobCount];
+        for (int i = 0; i < cBlobCount; ++i) {
+            const QByteArray lContent = "version " + QByteArray::number(i);
+            QCOMPARE(git_blob_create_from_buffer(&lBlobs[i], lRepository, lContent.constData(), static_cast<size_t>(lContent.size())), 0);
+        }
+        for (int i = 0; i < cFileCount; ++i) {
+            QSet<int> lContents;
+            for (int lSnapshot = 0; lSnapshot < cSnapshotCount; ++lSnapshot) {
+                lContents.insert(blobIndex(i, lSnapshot));
+            }
+            mVersionCount += lContents.count();
+        }
+
+        git_commit *lParent = nullptr;
+        for (int lSnapshot = 0; lSnapshot < cSnapshotCount; ++lSnapshot) {
+            git_treebuilder *lBuilder;
+            QCOMPARE(git_treebuilder_new(&lBuilder, lRepository, nullptr), 0);
+            for (int i = 0; i < cFileCount; ++i) {
+                const QByteArray lName = QByteArray("file") + QByteArray::number(i).rightJustified(5, '0');
+                QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, lName.constData(), &lBlobs[blobIndex(i, lSnapshot)], GIT_FILEMODE_BLOB), 0);
+            }
+            git_oid lFolder;
+            QCOMPARE(git_treebuilder_write(&lFolder, lBuilder), 0);
+            git_treebuilder_clear(lBuilder);
+            QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, "folder", &lFolder, GIT_FILEMODE_TREE), 0);
+            git_oid lRootOid;
+            QCOMPARE(git_treebuilder_write(&lRootOid, lBuilder), 0);
+            git_treebuilder_free(lBuilder);
+
+            git_tree *lRoot;
+            QCOMPARE(git_tree_lookup(&lRoot, lRepository, &lRootOid), 0);
+            git_signature *lSignature;
+            QCOMPARE(git_signature_new(&lSignature, "kup", "kup@localhost", 1600000000 + lSnapshot * 3600, 0), 0);
+            const git_commit *lParents[] = {lParent};
+            git_oid lCommitOid;
+            QCOMPARE(git_commit_create(&lCommitOid, lRepository, "refs/heads/kup", lSignature, lSignature, nullptr, "snapshot", lRoot, lParent ? 1 : 0, lParents),
+                     0);
+            git_signature_free(lSignature);
+            git_tree_free(lRoot);
+            git_commit_free(lParent);
+            QCOMPARE(git_commit_lookup(&lParent, lRepository, &lCommitOid), 0);
+        }
+        git_commit_free(lParent);
+        git_repository_free(lRepository);
+    }
+
+    void cleanupTestCase()
+    {
+        git_libgit2_shutdown();
+    }
+
+    void versionMemory()
+    {
+        if (heapInUse() == 0) {
+            QSKIP("heap usage is only measured with glibc");
+        }
+        const quint64 lHeapBefore = heapInUse();
+        auto lRepository = new MergedRepository(mRepositoryDir.path(), QStringLiteral("kup"));
+        QVERIFY(lRepository->open());
+        QVERIFY(lRepository->readBranch());
+        MergedVfsModel lModel(lRepository); // takes ownership of lRepository
+        QModelIndex lFolder;
+        QBENCHMARK_ONCE {
+            lModel.fetchMore(QModelIndex());
+            QTRY_VERIFY_WITH_TIMEOUT(lModel.hasAllSubNodes(QModelIndex()), 10000);
+            lFolder = lModel.index(0, 0, QModelIndex());
+            lModel.fetchMore(lFolder);
+            QTRY_VERIFY_WITH_TIMEOUT(lModel.hasAllSubNodes(lFolder), 120000);
+        }
+        QCOMPARE(lModel.rowCount(lFolder), cFileCount);
+        const quint64 lHeapLoaded = heapInUse();
+
+        // the same records kept in one vector per node, as they were before the arena
+        QVector<VersionList> lVectors;
+        lVectors.reserve(cFileCount);
+        const quint64 lHeapReserved = heapInUse();
+        int lVersionCount = 0;
+        for (int i = 0; i < cFileCount; ++i) {
+            const VersionSpan lVersions = MergedVfsModel::versionList(lModel.index(i, 0, lFolder));
+            lVectors.append(VersionList(lVersions.begin(), lVersions.end()));
+            lVersionCount += lVersions.count();
+        }
+        const quint64 lVectorBytes = heapInUse() - lHeapReserved;
+        QCOMPARE(lVersionCount, mVersionCount);
+
+        const quint64 lArenaBytes = lRepository->versionBytesUsed();
+        qInfo() << "versions:" << lVersionCount << "tree heap bytes:" << lHeapLoaded - lHeapBefore << "arena bytes:" << lArenaBytes
+                << "bytes in per node vectors:" << lVectorBytes << "sizeof(VersionData):" << sizeof(VersionData);
+        QVERIFY(lArenaBytes < lVectorBytes);
+    }
+
+private:
+    QTemporaryDir mRepositoryDir;
+    int mVersionCount = 0;
+};
+
+QTEST_MAIN(VersionArenaBenchmark)
+
+#include "versionarenabenchmark.moc"
@@ -4,6 +4,7 @@
 
 #include "filedigger.h"
 #include "mergedvfsmodel.h"
+#include "nameindex.h"
 #include "restoredialog.h"
 #include "versionlistdelegate.h"
 #include "versionlistmodel.h"
@@ -22,7 +23,9 @@
 
 #include <QGuiApplication>
 #include <QLabel>
+#include <QLineEdit>
 #include <QListView>
+#include <QListWidget>
 #include <QPushButton>
 #include <QSplitter>
 #include <QTimer>
@@ -31,6 +34,9 @@
 #include <kio_version.h>
 #include <utility>
 
+static const int cMaxSearchMatches = 500;
+static const int cSearchDelay = 150; // ms
+
 FileDigger::FileDigger(QString pRepoPath, QString pBranchName, QString pPathToFocus, QWidget *pParent)
     : KMainWindow(pParent)
     , mRepoPath(std::move(pRepoPath))
@@ -45,6 +51,11 @@ FileDigger::FileDigger(QString pRepoPath, QString pBranchName, QString pPathToFo
     });
 }
 
+FileDigger::~FileDigger()
+{
+    delete mNameIndex;
+}
+
 QSize FileDigger::sizeHint() const
 {
     return {800, 600};
@@ -109,13 +120,14 @@ void FileDigger::enterUrl(const QUrl &pUrl)
 
 MergedRepository *FileDigger::createRepo()
 {
-    auto lRepository = new MergedRepository(nullptr, mRepoPath, mBranchName);
+    auto lRepository = new MergedRepository(mRepoPath, mBranchName);
     if (!lRepository->open()) {
         KMessageBox::error(nullptr,
                            xi18nc("@info messagebox, %1 is a folder path",
                                   "The backup archive <filename>%1</filename> could not be opened. "
                                   "Check if the backups really are located there.",
                                   mRepoPath));
+        delete lRepository;
         return nullptr;
     }
     if (!lRepository->readBranch()) {
@@ -124,6 +136,7 @@ MergedRepository *FileDigger::createRepo()
         } else {
             MergedRepository::askForIntegrityCheck();
         }
+        delete lRepository;
         return nullptr;
     }
     return lRepository;
@@ -137,12 +150,41 @@ void FileDigger::createRepoView(MergedRepository *pRepository, const QString &pP
     mMergedVfsView->setHeaderHidden(true);
     mMergedVfsView->setSelectionMode(QAbstractItemView::SingleSelection);
     mMergedVfsView->setModel(mMergedVfsModel);
-    lSplitter->addWidget(mMergedVfsView);
+
+    // the name index is written together with the history index, search needs both up to date
+    delete mNameIndex; // from a repository opened before
+    mNameIndex = new NameIndex(mRepoPath, mBranchName);
+    const HistoryIndex *lHistory = pRepository->historyIndex();
+    const bool lCanSearch = lHistory != nullptr && mNameIndex->load() && mNameIndex->isCurrent(*lHistory);
+    mSearchEdit = new QLineEdit();
+    mSearchEdit->setClearButtonEnabled(true);
+    mSearchEdit->setEnabled(lCanSearch);
+    mSearchEdit->setPlaceholderText(lCanSearch ? i18nc("@info:placeholder", "Search in all backups…")
+                                               : i18nc("@info:placeholder", "Search is available after the next backup"));
+    mSearchResults = new QListWidget();
+    mSearchResults->hide();
+    mSearchTimer = new QTimer(this);
+    mSearchTimer->setSingleShot(true);
+    mSearchTimer->setInterval(cSearchDelay);
+    connect(mSearchEdit, &QLineEdit::textChanged, mSearchTimer, qOverload<>(&QTimer::start));
+    connect(mSearchTimer, &QTimer::timeout, this, &FileDigger::search);
+    connect(mSearchResults, &QListWidget::itemActivated, this, &FileDigger::focusSearchResult);
+
+    auto lTreePane = new QWidget();
+    auto lTreeLayout = new QVBoxLayout();
+    lTreeLayout->setContentsMargins(0, 0, 0, 0);
+    lTreeLayout->addWidget(mSearchEdit);
+    lTreeLayout->addWidget(mSearchResults, 1);
+    lTreeLayout->addWidget(mMergedVfsView, 2);
+    lTreePane->setLayout(lTreeLayout);
+    lSplitter->addWidget(lTreePane);
     connect(mMergedVfsView->selectionModel(), &QItemSelectionModel::currentChanged, this, &FileDigger::updateVersionModel);
+    connect(mMergedVfsView, &QTreeView::collapsed, mMergedVfsModel, &MergedVfsModel::cancelFetch);
+    connect(mMergedVfsModel, &MergedVfsModel::subNodesReady, this, &FileDigger::subNodesReady);
 
     mVersionView = new QListView();
     mVersionView->setSelectionMode(QAbstractItemView::SingleSelection);
-    mVersionModel = new VersionListModel(this);
+    mVersionModel = new VersionListModel(pRepository->name(), this);
     mVersionView->setModel(mVersionModel);
     auto lVersionDelegate = new VersionListDelegate(mVersionView, this);
     mVersionView->setItemDelegate(lVersionDelegate);
@@ -150,34 +192,120 @@ void FileDigger::createRepoView(MergedRepository *pRepository, const QString &pP
     connect(lVersionDelegate, &VersionListDelegate::openRequested, this, &FileDigger::open);
     connect(lVersionDelegate, &VersionListDelegate::restoreRequested, this, &FileDigger::restore);
     mMergedVfsView->setFocus();
+    setCentralWidget(lSplitter);
 
-    QModelIndex lIndex;
-    if (pPathToFocus.isEmpty()) {
-        // expand all levels from the top until the node has more than one child
-        while (mMergedVfsModel->rowCount(lIndex.parent()) == 1) {
-            mMergedVfsView->expand(lIndex);
-            lIndex = mMergedVfsModel->index(0, 0, lIndex);
+    // without a path, expand all levels from the top until a node has more than one child
+    mFocusIndex = QModelIndex();
+    mFocusPath = pPathToFocus.split('/', Qt::SkipEmptyParts);
+    mFocusOnPath = !pPathToFocus.isEmpty();
+    mFocusing = true;
+    continueFocus();
+}
+
+void FileDigger::subNodesReady(const QModelIndex &pParent)
+{
+    // folders expanded while their parent was still loading can be loaded now
+    for (int i = 0; i < mMergedVfsModel->rowCount(pParent); ++i) {
+        const QModelIndex lChild = mMergedVfsModel->index(i, 0, pParent);
+        if (mMergedVfsView->isExpanded(lChild) && mMergedVfsModel->canFetchMore(lChild)) {
+            mMergedVfsModel->fetchMore(lChild);
         }
-    } else {
-        const auto lPathSegments = pPathToFocus.split('/', Qt::SkipEmptyParts);
-        for (const auto &lPathSegment : lPathSegments) {
-            mMergedVfsView->expand(lIndex);
+    }
+    // version lists of the sub nodes were completed and sorted
+    const QModelIndex lCurrent = mMergedVfsView->currentIndex();
+    if (lCurrent.isValid() && lCurrent.parent() == pParent) {
+        updateVersionModel(lCurrent, lCurrent);
+    }
+    if (mFocusing && mFocusIndex == pParent) {
+        continueFocus();
+    }
+}
 
-            if (mMergedVfsModel->rowCount(lIndex) == 0) {
-                break;
+void FileDigger::continueFocus()
+{
+    while (mFocusing) {
+        const QModelIndex lIndex = mFocusIndex;
+        if (!mFocusOnPath || !mFocusPath.isEmpty()) {
+            mMergedVfsView->expand(lIndex);
+            if (!mFocusing || mFocusIndex != lIndex) {
+                return; // expanding finished loading and focusing went on from subNodesReady()
             }
-
+            if (!mMergedVfsModel->hasAllSubNodes(lIndex)) {
+                mMergedVfsModel->fetchMore(lIndex);
+                return; // continues from subNodesReady()
+            }
+        }
+        QModelIndex lNext;
+        const int lRowCount = mMergedVfsModel->rowCount(lIndex);
+        if (!mFocusOnPath) {
+            if (lRowCount > 0) {
+                lNext = mMergedVfsModel->index(0, 0, lIndex);
+            }
+            if (lRowCount > 1) {
+                mFocusIndex = lNext;
+                lNext = QModelIndex();
+            }
+        } else if (!mFocusPath.isEmpty() && lRowCount > 0) {
             auto lFirstChild = mMergedVfsModel->index(0, 0, lIndex);
-            auto lNextIndexList = mMergedVfsModel->match(lFirstChild, Qt::DisplayRole, lPathSegment, 1, Qt::MatchExactly);
-            if (lNextIndexList.isEmpty()) {
-                break;
+            auto lNextIndexList = mMergedVfsModel->match(lFirstChild, Qt::DisplayRole, mFocusPath.takeFirst(), 1, Qt::MatchExactly);
+            if (!lNextIndexList.isEmpty()) {
+                lNext = lNextIndexList.front();
+            }
+        }
+        if (!lNext.isValid()) {
+            mFocusing = false;
+            if (mFocusIndex.isValid()) {
+                mMergedVfsView->selectionModel()->setCurrentIndex(mFocusIndex, QItemSelectionModel::Select);
+                mMergedVfsView->scrollTo(mFocusIndex);
             }
-            lIndex = lNextIndexList.front();
+            return;
         }
+        mFocusIndex = lNext;
     }
+}
 
-    mMergedVfsView->selectionModel()->setCurrentIndex(lIndex, QItemSelectionModel::Select);
-    setCentralWidget(lSplitter);
+void FileDigger::search()
+{
+    mSearchResults->clear();
+    const QString lQuery = mSearchEdit->text().trimmed();
+    if (lQuery.isEmpty()) {
+        mSearchResults->hide();
+        return;
+    }
+    QVector<NameMatch> lMatches;
+    mNameIndex->search(lQuery, cMaxSearchMatches, lMatches);
+    const QIcon lFolderIcon = QIcon::fromTheme(QStringLiteral("folder"));
+    for (const NameMatch &lMatch : std::as_const(lMatches)) {
+        auto lItem = new QListWidgetItem(i18ncp("@item:inlistbox search result, %2 is a path",
+                                                "%2 (%1 version)",
+                                                "%2 (%1 versions)",
+                                                lMatch.mVersionCount,
+                                                lMatch.mPath),
+                                         mSearchResults);
+        lItem->setData(Qt::UserRole, lMatch.mPath);
+        if (lMatch.mIsDirectory) {
+            lItem->setIcon(lFolderIcon);
+        }
+    }
+    if (lMatches.isEmpty()) {
+        auto lItem = new QListWidgetItem(i18nc("@item:inlistbox", "No matches"), mSearchResults);
+        lItem->setFlags(Qt::NoItemFlags);
+    }
+    mSearchResults->show();
+}
+
+void FileDigger::focusSearchResult(QListWidgetItem *pItem)
+{
+    const QString lPath = pItem->data(Qt::UserRole).toString();
+    if (lPath.isEmpty()) {
+        return;
+    }
+    mFocusIndex = QModelIndex();
+    mFocusPath = lPath.split('/', Qt::SkipEmptyParts);
+    mFocusOnPath = true;
+    mFocusing = true;
+    continueFocus();
+    mMergedVfsView->setFocus();
 }
 
 void FileDigger::createSelectionView()
@@ -6,14 +6,21 @@
 #define FILEDIGGER_H
 
 #include <KMainWindow>
+#include <QPersistentModelIndex>
+#include <QStringList>
 #include <QUrl>
 
 class KDirOperator;
 class MergedVfsModel;
 class MergedRepository;
+class NameIndex;
 class VersionListModel;
+class QLineEdit;
 class QListView;
+class QListWidget;
+class QListWidgetItem;
 class QModelIndex;
+class QTimer;
 class QTreeView;
 
 class FileDigger : public KMainWindow
@@ -21,6 +28,7 @@ class FileDigger : public KMainWindow
     Q_OBJECT
 public:
     explicit FileDigger(QString pRepoPath, QString pBranchName, QString pPathToFocus = QString(), QWidget *pParent = nullptr);
+    ~FileDigger() override;
     QSize sizeHint() const override;
 
 protected slots:
@@ -30,6 +38,10 @@ protected slots:
     void repoPathAvailable(const QString &pPathToFocus);
     void checkFileWidgetPath();
     void enterUrl(const QUrl &pUrl);
+    void subNodesReady(const QModelIndex &pParent);
+    void continueFocus();
+    void search();
+    void focusSearchResult(QListWidgetItem *pItem);
 
 protected:
     MergedRepository *createRepo();
@@ -37,6 +49,16 @@ protected:
     void createSelectionView();
     MergedVfsModel *mMergedVfsModel{};
     QTreeView *mMergedVfsView{};
+    // Expanding to the path to focus waits for the sub nodes of mFocusIndex to load.
+    QPersistentModelIndex mFocusIndex;
+    QStringList mFocusPath;
+    bool mFocusOnPath{};
+    bool mFocusing{};
+
+    NameIndex *mNameIndex{};
+    QLineEdit *mSearchEdit{};
+    QListWidget *mSearchResults{};
+    QTimer *mSearchTimer{};
 
     VersionListModel *mVersionModel{};
     QListView *mVersionView{};
@@ -0,0 +1,411 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "historyindex.h"
+#include "kupfiledigger_debug.h"
+#include "treeloader.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QRandomGenerator>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <git2/graph.h>
+
+#include <cstring>
+#include <utility>
+
+static const char cHistoryMagic[8] = {'K', 'U', 'P', 'H', 'I', 'S', 'T', 'O'};
+static const quint32 cHistoryVersion = 1;
+static const quint32 cBlockMagic = 0x4B55504B;
+static const quint32 cRecordCommit = 1;
+static const quint32 cRecordVersion = 2;
+static const quint32 cVersionChunked = 1;
+static const quint32 cVersionHaveMetadata = 2;
+static const int cLockTimeout = 10000; // ms
+
+struct HistoryHeader {
+    char mMagic[8];
+    quint32 mVersion;
+    quint32 mGeneration;
+};
+
+// followed by the records and the branch head the block brings the index up to
+struct HistoryBlockHeader {
+    quint32 mMagic;
+    quint32 mSize;
+};
+
+struct RecordHeader {
+    quint32 mType;
+    quint32 mSize;
+};
+
+struct CommitRecord {
+    git_oid mTreeOid;
+    qint64 mCommitTime;
+};
+
+// followed by the name, UTF-8 encoded
+struct VersionRecord {
+    git_oid mOid;
+    quint32 mParentDir;
+    quint32 mDirId;
+    quint32 mMode;
+    quint32 mFlags;
+    qint64 mCommitTime;
+    qint64 mModifiedDate;
+    qint64 mSize;
+};
+
+template<typename T>
+static bool takeRecord(const char *&pData, const char *pEnd, T &pRecord)
+{
+    if (pEnd - pData < static_cast<qptrdiff>(sizeof(T))) {
+        return false;
+    }
+    memcpy(&pRecord, pData, sizeof(T));
+    pData += sizeof(T);
+    return true;
+}
+
+template<typename T>
+static void appendRecord(QByteArray &pBuffer, const T &pRecord)
+{
+    pBuffer.append(reinterpret_cast<const char *>(&pRecord), static_cast<int>(sizeof(T)));
+}
+
+static QByteArray dirKey(quint32 pParentDir, const QByteArray &pName)
+{
+    QByteArray lKey(reinterpret_cast<const char *>(&pParentDir), sizeof(pParentDir));
+    lKey.append(pName);
+    return lKey;
+}
+
+static QByteArray treeKey(quint32 pDirId, const git_oid *pOid)
+{
+    QByteArray lKey(reinterpret_cast<const char *>(&pDirId), sizeof(pDirId));
+    lKey.append(reinterpret_cast<const char *>(pOid->id), GIT_OID_RAWSZ);
+    return lKey;
+}
+
+static QByteArray versionKey(quint32 pParentDir, const git_oid *pOid, const QByteArray &pName)
+{
+    QByteArray lKey = treeKey(pParentDir, pOid);
+    lKey.append(pName);
+    return lKey;
+}
+
+// pData points at the record header
+static void takeVersion(const char *pData, VersionRecord &pRecord, QByteArray &pName)
+{
+    RecordHeader lHeader;
+    memcpy(&lHeader, pData, sizeof(lHeader));
+    memcpy(&pRecord, pData + sizeof(lHeader), sizeof(pRecord));
+    const char *lName = pData + sizeof(lHeader) + sizeof(pRecord);
+    pName = QByteArray::fromRawData(lName, static_cast<int>(lHeader.mSize - sizeof(pRecord)));
+}
+
+HistoryIndex::HistoryIndex(const QString &pRepositoryPath, const QString &pBranchName)
+    : mRefName(QByteArray("refs/heads/") + pBranchName.toLocal8Bit())
+    , mMapped(nullptr)
+    , mValidSize(0)
+    , mHaveHead(false)
+    , mHead()
+    , mGeneration(0)
+    , mNextDirId(cRootDir + 1)
+{
+    mPath = cachePath(pRepositoryPath, pBranchName, QStringLiteral(".history"));
+}
+
+QString HistoryIndex::cachePath(const QString &pRepositoryPath, const QString &pBranchName, const QString &pSuffix)
+{
+    const QByteArray lKey = QDir(pRepositoryPath).canonicalPath().toUtf8() + "\nrefs/heads/" + pBranchName.toLocal8Bit();
+    const QByteArray lHash = QCryptographicHash::hash(lKey, QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QStringLiteral("/kup/") + QString::fromLatin1(lHash) + pSuffix;
+}
+
+HistoryIndex::~HistoryIndex()
+{
+    unload();
+}
+
+void HistoryIndex::unload()
+{
+    if (mMapped != nullptr) {
+        mFile.unmap(mMapped);
+        mMapped = nullptr;
+    }
+    mFile.close();
+    mValidSize = 0;
+    mHaveHead = false;
+    mCommits.clear();
+    mBlocks.clear();
+    mVersionRecords.clear();
+}
+
+bool HistoryIndex::load()
+{
+    unload();
+    mFile.setFileName(mPath);
+    if (!mFile.open(QIODevice::ReadOnly) || mFile.size() < static_cast<qint64>(sizeof(HistoryHeader))) {
+        return false;
+    }
+    mMapped = mFile.map(0, mFile.size());
+    if (mMapped == nullptr) {
+        return false;
+    }
+    const char *lStart = reinterpret_cast<const char *>(mMapped);
+    const char *lData = lStart;
+    const char *lEnd = lStart + mFile.size();
+    HistoryHeader lHeader;
+    if (!takeRecord(lData, lEnd, lHeader) || 0 != memcmp(lHeader.mMagic, cHistoryMagic, sizeof(cHistoryMagic)) || lHeader.mVersion != cHistoryVersion) {
+        qCDebug(KUPFILEDIGGER) << "ignoring incompatible history index" << mPath;
+        return false;
+    }
+    mGeneration = lHeader.mGeneration;
+    HistoryBlockHeader lBlock;
+    const char *lBlockStart = lData;
+    while (takeRecord(lData, lEnd, lBlock) && lBlock.mMagic == cBlockMagic) {
+        // a block only counts if the head at its end was written too
+        if (lEnd - lData < static_cast<qptrdiff>(lBlock.mSize) + GIT_OID_RAWSZ) {
+            break;
+        }
+        parseBlock(lData, lData + lBlock.mSize);
+        Block lParsedBlock;
+        lParsedBlock.mStart = lData;
+        lData += lBlock.mSize;
+        lParsedBlock.mEnd = lData;
+        memcpy(mHead.id, lData, GIT_OID_RAWSZ);
+        lParsedBlock.mHead = mHead;
+        mBlocks.append(lParsedBlock);
+        lData += GIT_OID_RAWSZ;
+        mHaveHead = true;
+        lBlockStart = lData;
+    }
+    mValidSize = lBlockStart - lStart;
+    return mHaveHead;
+}
+
+void HistoryIndex::parseBlock(const char *pData, const char *pEnd)
+{
+    RecordHeader lHeader;
+    const char *lRecordStart = pData;
+    while (takeRecord(pData, pEnd, lHeader) && pEnd - pData >= static_cast<qptrdiff>(lHeader.mSize)) {
+        if (lHeader.mType == cRecordCommit && lHeader.mSize == sizeof(CommitRecord)) {
+            CommitRecord lRecord;
+            memcpy(&lRecord, pData, sizeof(lRecord));
+            mCommits.append(HistoryCommit{lRecord.mTreeOid, lRecord.mCommitTime});
+        } else if (lHeader.mType == cRecordVersion && lHeader.mSize >= sizeof(VersionRecord)) {
+            VersionRecord lRecord;
+            memcpy(&lRecord, pData, sizeof(lRecord));
+            mVersionRecords[lRecord.mParentDir].append(lRecordStart);
+        }
+        pData += lHeader.mSize;
+        lRecordStart = pData;
+    }
+}
+
+bool HistoryIndex::isCurrent(const git_oid *pHead) const
+{
+    return mHaveHead && git_oid_equal(&mHead, pHead);
+}
+
+void HistoryIndex::versions(quint32 pDirId, QVector<HistoryVersion> &pVersions) const
+{
+    const QVector<const char *> lRecords = mVersionRecords.value(pDirId);
+    pVersions.reserve(pVersions.count() + lRecords.count());
+    for (const char *lData : lRecords) {
+        VersionRecord lRecord;
+        QByteArray lName;
+        takeVersion(lData, lRecord, lName);
+        HistoryVersion lVersion;
+        lVersion.mEntry.mName = QString::fromUtf8(lName);
+        lVersion.mEntry.mMode = lRecord.mMode;
+        lVersion.mEntry.mChunked = lRecord.mFlags & cVersionChunked;
+        lVersion.mEntry.mHaveMetadata = lRecord.mFlags & cVersionHaveMetadata;
+        lVersion.mEntry.mOid = lRecord.mOid;
+        lVersion.mEntry.mModifiedDate = lRecord.mModifiedDate;
+        lVersion.mEntry.mSize = lRecord.mSize;
+        lVersion.mCommitTime = lRecord.mCommitTime;
+        lVersion.mDirId = lRecord.mDirId;
+        pVersions.append(lVersion);
+    }
+}
+
+void HistoryIndex::blockNames(int pBlock, const NameCallback &pCallback) const
+{
+    const char *lData = mBlocks.at(pBlock).mStart;
+    const char *lEnd = mBlocks.at(pBlock).mEnd;
+    RecordHeader lHeader;
+    const char *lRecordStart = lData;
+    while (takeRecord(lData, lEnd, lHeader) && lEnd - lData >= static_cast<qptrdiff>(lHeader.mSize)) {
+        if (lHeader.mType == cRecordVersion && lHeader.mSize >= sizeof(VersionRecord)) {
+            VersionRecord lRecord;
+            QByteArray lName;
+            takeVersion(lRecordStart, lRecord, lName);
+            pCallback(lRecord.mParentDir, lRecord.mDirId, lName);
+        }
+        lData += lHeader.mSize;
+        lRecordStart = lData;
+    }
+}
+
+bool HistoryIndex::update(git_repository *pRepository)
+{
+    if (!QDir().mkpath(QFileInfo(mPath).absolutePath())) {
+        return false;
+    }
+    QLockFile lLock(mPath + QStringLiteral(".lock"));
+    if (!lLock.tryLock(cLockTimeout)) {
+        qCWarning(KUPFILEDIGGER) << "history index is locked by another process" << mPath;
+        return false;
+    }
+    load();
+    git_oid lHead;
+    if (0 != git_reference_name_to_id(&lHead, pRepository, mRefName.constData())) {
+        return false;
+    }
+    if (isCurrent(&lHead)) {
+        return true;
+    }
+    const bool lAppend = mHaveHead && 1 == git_graph_descendant_of(pRepository, &lHead, &mHead);
+    if (!lAppend) {
+        unload();
+    }
+
+    mDirIds.clear();
+    mKnownVersions.clear();
+    mVisitedTrees.clear();
+    mNextDirId = cRootDir + 1;
+    for (const HistoryCommit &lCommit : std::as_const(mCommits)) {
+        mVisitedTrees.insert(treeKey(cRootDir, &lCommit.mTreeOid));
+    }
+    for (auto lIter = mVersionRecords.constBegin(); lIter != mVersionRecords.constEnd(); ++lIter) {
+        for (const char *lData : lIter.value()) {
+            VersionRecord lRecord;
+            QByteArray lName;
+            takeVersion(lData, lRecord, lName);
+            mKnownVersions.insert(versionKey(lRecord.mParentDir, &lRecord.mOid, lName));
+            if (lRecord.mDirId != cNoDir) {
+                mDirIds.insert(dirKey(lRecord.mParentDir, lName), lRecord.mDirId);
+                mVisitedTrees.insert(treeKey(lRecord.mDirId, &lRecord.mOid));
+                mNextDirId = qMax(mNextDirId, lRecord.mDirId + 1);
+            }
+        }
+    }
+
+    // oldest first, a version is recorded with the first snapshot that has it.
+    git_revwalk *lWalker;
+    if (0 != git_revwalk_new(&lWalker, pRepository)) {
+        return false;
+    }
+    git_revwalk_sorting(lWalker, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+    if (0 != git_revwalk_push(lWalker, &lHead) || (lAppend && 0 != git_revwalk_hide(lWalker, &mHead))) {
+        git_revwalk_free(lWalker);
+        return false;
+    }
+    QByteArray lPayload;
+    git_oid lOid;
+    while (0 == git_revwalk_next(&lOid, lWalker)) {
+        git_commit *lCommit;
+        if (0 != git_commit_lookup(&lCommit, pRepository, &lOid)) {
+            continue;
+        }
+        CommitRecord lRecord;
+        memset(&lRecord, 0, sizeof(lRecord));
+        lRecord.mTreeOid = *git_commit_tree_id(lCommit);
+        lRecord.mCommitTime = git_commit_time(lCommit);
+        git_commit_free(lCommit);
+        appendRecord(lPayload, RecordHeader{cRecordCommit, sizeof(CommitRecord)});
+        appendRecord(lPayload, lRecord);
+        visitTree(pRepository, cRootDir, &lRecord.mTreeOid, lRecord.mCommitTime, lPayload);
+    }
+    git_revwalk_free(lWalker);
+    mKnownVersions.clear();
+    mVisitedTrees.clear();
+    mDirIds.clear();
+
+    QByteArray lBlock;
+    appendRecord(lBlock, HistoryBlockHeader{cBlockMagic, static_cast<quint32>(lPayload.size())});
+    lBlock.append(lPayload);
+    lBlock.append(reinterpret_cast<const char *>(lHead.id), GIT_OID_RAWSZ);
+
+    const qint64 lValidSize = mValidSize;
+    unload();
+    if (!lAppend) {
+        // replace instead of truncating, the filedigger may have the old file mapped.
+        HistoryHeader lHeader;
+        memset(&lHeader, 0, sizeof(lHeader));
+        memcpy(lHeader.mMagic, cHistoryMagic, sizeof(cHistoryMagic));
+        lHeader.mVersion = cHistoryVersion;
+        lHeader.mGeneration = QRandomGenerator::global()->generate();
+        QSaveFile lFile(mPath);
+        if (!lFile.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        lFile.write(reinterpret_cast<const char *>(&lHeader), sizeof(lHeader));
+        lFile.write(lBlock);
+        return lFile.commit();
+    }
+    QFile lFile(mPath);
+    if (!lFile.open(QIODevice::ReadWrite)) {
+        return false;
+    }
+    // drop what an interrupted update left behind, readers never look past the valid part.
+    if (lFile.size() != lValidSize && !lFile.resize(lValidSize)) {
+        return false;
+    }
+    lFile.seek(lValidSize);
+    return lFile.write(lBlock) == lBlock.size() && lFile.flush();
+}
+
+void HistoryIndex::visitTree(git_repository *pRepository, quint32 pDirId, const git_oid *pTreeOid, qint64 pCommitTime, QByteArray &pPayload)
+{
+    const QByteArray lTreeKey = treeKey(pDirId, pTreeOid);
+    if (mVisitedTrees.contains(lTreeKey)) {
+        return; // everything below was recorded when this tree was first seen
+    }
+    mVisitedTrees.insert(lTreeKey);
+    QVector<DecodedEntry> lEntries;
+    if (!decodeBupTree(pRepository, pTreeOid, lEntries)) {
+        qCWarning(KUPFILEDIGGER) << "could not read tree" << git_oid_tostr_s(pTreeOid);
+        return;
+    }
+    for (const DecodedEntry &lEntry : std::as_const(lEntries)) {
+        const QByteArray lName = lEntry.mName.toUtf8();
+        quint32 lDirId = cNoDir;
+        if (S_ISDIR(lEntry.mMode)) {
+            const QByteArray lDirKey = dirKey(pDirId, lName);
+            lDirId = mDirIds.value(lDirKey, cNoDir);
+            if (lDirId == cNoDir) {
+                lDirId = mNextDirId++;
+                mDirIds.insert(lDirKey, lDirId);
+            }
+        }
+        const QByteArray lVersionKey = versionKey(pDirId, &lEntry.mOid, lName);
+        if (!mKnownVersions.contains(lVersionKey)) {
+            mKnownVersions.insert(lVersionKey);
+            VersionRecord lRecord;
+            memset(&lRecord, 0, sizeof(lRecord));
+            lRecord.mOid = lEntry.mOid;
+            lRecord.mParentDir = pDirId;
+            lRecord.mDirId = lDirId;
+            lRecord.mMode = lEntry.mMode;
+            lRecord.mFlags = (lEntry.mChunked ? cVersionChunked : 0) | (lEntry.mHaveMetadata ? cVersionHaveMetadata : 0);
+            lRecord.mCommitTime = pCommitTime;
+            lRecord.mModifiedDate = lEntry.mModifiedDate;
+            lRecord.mSize = lEntry.mSize;
+            appendRecord(pPayload, RecordHeader{cRecordVersion, static_cast<quint32>(sizeof(VersionRecord) + lName.size())});
+            appendRecord(pPayload, lRecord);
+            pPayload.append(lName);
+        }
+        if (lDirId != cNoDir) {
+            visitTree(pRepository, lDirId, &lEntry.mOid, pCommitTime, pPayload);
+        }
+    }
+}
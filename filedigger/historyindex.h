@@ -0,0 +1,110 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef HISTORYINDEX_H
+#define HISTORYINDEX_H
+
+#include "mergedvfs.h"
+
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+
+#include <functional>
+
+// One distinct version of an entry in the merged history of a branch.
+struct HistoryVersion {
+    DecodedEntry mEntry;
+    qint64 mCommitTime; // of the first snapshot that has this version
+    quint32 mDirId; // folders only, where to find the entries of this version
+};
+
+struct HistoryCommit {
+    git_oid mTreeOid;
+    qint64 mCommitTime;
+};
+
+// All paths of a branch with their distinct versions, kept in ~/.cache/kup. The
+// daemon runs "kup-filedigger --update-history-index" after each backup, which only
+// looks at the commits made since the last update. Versions are recorded with the
+// first snapshot they appear in, so folders that did not change are skipped. The
+// file is memory mapped when read, versions are decoded when a folder is opened.
+class HistoryIndex
+{
+public:
+    static constexpr quint32 cRootDir = 0;
+    static constexpr quint32 cNoDir = 0xFFFFFFFF;
+
+    typedef std::function<void(quint32 pParentDir, quint32 pDirId, const QByteArray &pName)> NameCallback;
+
+    HistoryIndex(const QString &pRepositoryPath, const QString &pBranchName);
+    ~HistoryIndex();
+    // Where the indexes of a branch are kept, pSuffix tells them apart.
+    static QString cachePath(const QString &pRepositoryPath, const QString &pBranchName, const QString &pSuffix);
+
+    bool load();
+    // True if the index is loaded and covers every commit up to pHead.
+    bool isCurrent(const git_oid *pHead) const;
+    const git_oid *head() const
+    {
+        return &mHead;
+    }
+    // Changes every time the index is built from scratch, folder ids may differ then.
+    quint32 generation() const
+    {
+        return mGeneration;
+    }
+    const QVector<HistoryCommit> &commits() const // oldest first
+    {
+        return mCommits;
+    }
+    void versions(quint32 pDirId, QVector<HistoryVersion> &pVersions) const;
+    // Each update adds one block, these are used for keeping the NameIndex in step.
+    int blockCount() const
+    {
+        return mBlocks.count();
+    }
+    const git_oid *blockHead(int pBlock) const
+    {
+        return &mBlocks.at(pBlock).mHead;
+    }
+    // Calls pCallback for every version record added by the block, names are UTF-8.
+    void blockNames(int pBlock, const NameCallback &pCallback) const;
+
+    // Adds the commits of the branch made since the last update. Starts over if
+    // the history has been rewritten, for example after old backups were removed.
+    bool update(git_repository *pRepository);
+
+protected:
+    struct Block {
+        const char *mStart;
+        const char *mEnd;
+        git_oid mHead;
+    };
+
+    void unload();
+    void parseBlock(const char *pData, const char *pEnd);
+    void visitTree(git_repository *pRepository, quint32 pDirId, const git_oid *pTreeOid, qint64 pCommitTime, QByteArray &pPayload);
+
+    QString mPath;
+    QByteArray mRefName;
+    QFile mFile;
+    uchar *mMapped;
+    qint64 mValidSize;
+    bool mHaveHead;
+    git_oid mHead;
+    quint32 mGeneration;
+    QVector<HistoryCommit> mCommits;
+    QVector<Block> mBlocks;
+    QHash<quint32, QVector<const char *>> mVersionRecords; // by parent folder
+
+    // only used while updating
+    QHash<QByteArray, quint32> mDirIds; // parent folder and name
+    QSet<QByteArray> mKnownVersions; // parent folder, oid and name
+    QSet<QByteArray> mVisitedTrees; // folder and tree oid
+    quint32 mNextDirId;
+};
+
+#endif // HISTORYINDEX_H
@@ -2,7 +2,11 @@
 //
 // SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
 
+#include "bupodb.h"
 #include "filedigger.h"
+#include "historyindex.h"
+#include "nameindex.h"
+#include "treeloader.h"
 
 #include <git2/global.h>
 
@@ -11,14 +15,50 @@
 #include <KLocalizedString>
 
 #include <QApplication>
+#include <QCoreApplication>
 #include <QCommandLineOption>
 #include <QCommandLineParser>
 #include <QDir>
 #include <QFile>
 #include <QTextStream>
 
+#include <cstring>
+
+// Run by the kup daemon after each backup, it has no libgit2 of its own. No GUI
+// is created so that this also works when nobody is logged in.
+static int updateHistoryIndex(int pArgCount, char **pArgArray)
+{
+    QCoreApplication lApp(pArgCount, pArgArray);
+    QCommandLineParser lParser;
+    lParser.addOption({"update-history-index", QStringLiteral("Update the history and name indexes of a branch and exit.")});
+    lParser.addOption({{"b", "branch"}, QStringLiteral("Name of the branch."), "branch name", "kup"});
+    lParser.addPositionalArgument(QStringLiteral("<repository path>"), QStringLiteral("Path to the bup repository."));
+    lParser.process(lApp);
+    if (lParser.positionalArguments().isEmpty()) {
+        lParser.showHelp(1);
+    }
+    const QString lRepoPath = QDir(lParser.positionalArguments().first()).absolutePath();
+
+    git_libgit2_init();
+    git_repository *lRepository;
+    bool lSuccess = false;
+    if (0 == openBupRepository(&lRepository, lRepoPath)) {
+        HistoryIndex lHistory(lRepoPath, lParser.value("branch"));
+        lSuccess = lHistory.update(lRepository) && lHistory.load() && NameIndex(lRepoPath, lParser.value("branch")).update(lHistory);
+        git_repository_free(lRepository);
+    }
+    git_libgit2_shutdown();
+    return lSuccess ? 0 : 1;
+}
+
 int main(int pArgCount, char **pArgArray)
 {
+    for (int i = 1; i < pArgCount; ++i) {
+        if (0 == strcmp(pArgArray[i], "--update-history-index")) {
+            return updateHistoryIndex(pArgCount, pArgArray);
+        }
+    }
+
     QApplication lApp(pArgCount, pArgArray);
     QApplication::setAttribute(Qt::AA_UseHighDpiPixmaps, true);
 
@@ -39,6 +79,7 @@ int main(int pArgCount, char **pArgArray)
     QCommandLineParser lParser;
     lParser.addOption({{"b", "branch"}, i18n("Name of the branch to be opened."), "branch name", "kup"});
     lParser.addOption({{"p", "path"}, i18n("File or folder path to be focused."), "path"});
+    lParser.addOption({"tree-cache-size", i18n("Memory used for caching decoded folders, in MiB."), "size", "64"});
     lParser.addPositionalArgument(QStringLiteral("<repository path>"), i18n("Path to the bup repository to be opened."));
 
     lAbout.setupCommandLine(&lParser);
@@ -54,6 +95,7 @@ int main(int pArgCount, char **pArgArray)
 
     // This needs to be called first thing, before any other calls to libgit2.
     git_libgit2_init();
+    DecodedTreeCache::setMaxSize(qBound(1, lParser.value("tree-cache-size").toInt(), 2047) * 1024 * 1024);
 
     auto lFileDigger = new FileDigger(lRepoPath, lParser.value("branch"), lParser.value("path"));
     lFileDigger->show();
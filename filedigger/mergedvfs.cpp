@@ -3,6 +3,9 @@
 // SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
 
 #include "mergedvfs.h"
+#include "bupodb.h"
+#include "commitgraph.h"
+#include "historyindex.h"
 #include "kupdaemon.h"
 #include "kupfiledigger_debug.h"
 #include "vfshelpers.h"
@@ -13,35 +16,57 @@
 
 #include <QDBusInterface>
 #include <QDir>
-#include <QGuiApplication>
 
 #include <git2/branch.h>
+#include <cstdlib>
+#include <memory>
+#include <type_traits>
 #include <utility>
 
 using NameMap = QMap<QString, MergedNode *>;
 using NameMapIterator = QMapIterator<QString, MergedNode *>;
 
 git_repository *MergedNode::mRepository = nullptr;
+QSet<QString> MergedNode::mNames;
+VersionArena MergedNode::mVersionArena;
+
+static const int cVersionBlockRecords = 4096;
 
 bool mergedNodeLessThan(const MergedNode *a, const MergedNode *b)
 {
     if (a->isDirectory() != b->isDirectory()) {
         return a->isDirectory();
     }
-    return a->objectName() < b->objectName();
+    return a->name() < b->name();
 }
 
-bool versionGreaterThan(const VersionData *a, const VersionData *b)
+bool versionGreaterThan(const VersionData &a, const VersionData &b)
 {
-    return a->mModifiedDate > b->mModifiedDate;
+    return a.mModifiedDate > b.mModifiedDate;
+}
+
+MergedNode::MergedNode(MergedNode *pParent, const QString &pName, uint pMode)
+    : mParent(pParent)
+    , mMode(pMode)
+    , mPending(new PendingVersions)
+    , mVersions(nullptr)
+    , mVersionCount(0)
+    , mMergedVersionCount(0)
+    , mRow(0)
+    , mSubNodesComplete(!S_ISDIR(pMode))
+    , mHistoryDirId(HistoryIndex::cNoDir)
+{
+    auto lIter = mNames.constFind(pName);
+    if (lIter == mNames.constEnd()) {
+        lIter = mNames.insert(pName);
+    }
+    mName = *lIter;
 }
 
-MergedNode::MergedNode(QObject *pParent, const QString &pName, uint pMode)
-    : QObject(pParent)
+MergedNode::~MergedNode()
 {
-    mSubNodes = nullptr;
-    setObjectName(pName);
-    mMode = pMode;
+    qDeleteAll(mSubNodes);
+    delete mPending;
 }
 
 void MergedNode::getBupUrl(int pVersionIndex, QUrl *pComplete, QString *pRepoPath, QString *pBranchName, qint64 *pCommitTime, QString *pPathInRepo) const
@@ -50,27 +75,27 @@ void MergedNode::getBupUrl(int pVersionIndex, QUrl *pComplete, QString *pRepoPat
     const MergedNode *lNode = this;
     while (lNode != nullptr) {
         lStack.append(lNode);
-        lNode = qobject_cast<const MergedNode *>(lNode->parent());
+        lNode = lNode->parent();
     }
-    const auto lRepo = qobject_cast<const MergedRepository *>(lStack.takeLast());
+    const auto lRepo = static_cast<const MergedRepository *>(lStack.takeLast());
     if (pComplete) {
-        pComplete->setUrl("bup://" + lRepo->objectName() + lRepo->mBranchName + '/'
-                          + vfsTimeToString(static_cast<git_time_t>(mVersionList.at(pVersionIndex)->mCommitTime)));
+        pComplete->setUrl("bup://" + lRepo->name() + lRepo->mBranchName + '/'
+                          + vfsTimeToString(static_cast<git_time_t>(versionList().at(pVersionIndex).mCommitTime)));
     }
     if (pRepoPath) {
-        *pRepoPath = lRepo->objectName();
+        *pRepoPath = lRepo->name();
     }
     if (pBranchName) {
         *pBranchName = lRepo->mBranchName;
     }
     if (pCommitTime) {
-        *pCommitTime = mVersionList.at(pVersionIndex)->mCommitTime;
+        *pCommitTime = versionList().at(pVersionIndex).mCommitTime;
     }
     if (pPathInRepo) {
         pPathInRepo->clear();
     }
     while (!lStack.isEmpty()) {
-        QString lPathComponent = lStack.takeLast()->objectName();
+        QString lPathComponent = lStack.takeLast()->name();
         if (pComplete) {
             pComplete->setPath(pComplete->path() + '/' + lPathComponent);
         }
@@ -81,19 +106,6 @@ void MergedNode::getBupUrl(int pVersionIndex, QUrl *pComplete, QString *pRepoPat
     }
 }
 
-MergedNodeList &MergedNode::subNodes()
-{
-    if (mSubNodes == nullptr) {
-        mSubNodes = new MergedNodeList();
-        if (S_ISDIR(mMode)) {
-            QGuiApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
-            generateSubNodes();
-            QGuiApplication::restoreOverrideCursor();
-        }
-    }
-    return *mSubNodes;
-}
-
 void MergedNode::askForIntegrityCheck()
 {
 #if KWIDGETSADDONS_VERSION >= QT_VERSION_CHECK(5, 101, 0)
@@ -122,116 +134,116 @@ void MergedNode::askForIntegrityCheck()
     }
 }
 
-void MergedNode::generateSubNodes()
+void MergedNode::mergeVersion(const DecodedTree &pTree, MergedNodeList &pNewNodes)
 {
-    NameMap lSubNodeMap;
-    foreach (VersionData *lCurrentVersion, mVersionList) {
-        git_tree *lTree;
-        if (0 != git_tree_lookup(&lTree, mRepository, &lCurrentVersion->mOid)) {
-            askForIntegrityCheck();
-            continue; // try to be fault tolerant by not aborting...
+    ++mMergedVersionCount;
+    if (!pTree.mValid) {
+        return;
+    }
+    const VersionData &lCurrentVersion = versionList().at(pTree.mVersionIndex);
+    for (const DecodedEntry &lEntry : pTree.mEntries) {
+        mergeEntry(lEntry, lCurrentVersion.mCommitTime, lCurrentVersion.mModifiedDate, pNewNodes);
+    }
+}
+
+MergedNode *MergedNode::mergeEntry(const DecodedEntry &pEntry, qint64 pCommitTime, qint64 pDirModifiedDate, MergedNodeList &pNewNodes)
+{
+    QString lName = pEntry.mName;
+    MergedNode *lSubNode = mSubNodeNames.value(lName, nullptr);
+    if (lSubNode == nullptr) {
+        lSubNode = new MergedNode(this, lName, pEntry.mMode);
+        mSubNodeNames.insert(lName, lSubNode);
+        pNewNodes.append(lSubNode);
+    } else if ((S_IFMT & pEntry.mMode) != (S_IFMT & lSubNode->mMode)) {
+        if (S_ISDIR(pEntry.mMode)) {
+            lName.append(xi18nc("added after folder name in some cases", " (folder)"));
+        } else if (S_ISLNK(pEntry.mMode)) {
+            lName.append(xi18nc("added after file name in some cases", " (symlink)"));
+        } else {
+            lName.append(xi18nc("added after file name in some cases", " (file)"));
         }
-        git_blob *lMetadataBlob = nullptr;
-        VintStream *lMetadataStream = nullptr;
-        const git_tree_entry *lMetaDataTreeEntry = git_tree_entry_byname(lTree, ".bupm");
-        if (lMetaDataTreeEntry != nullptr && 0 == git_blob_lookup(&lMetadataBlob, mRepository, git_tree_entry_id(lMetaDataTreeEntry))) {
-            lMetadataStream = new VintStream(git_blob_rawcontent(lMetadataBlob), static_cast<int>(git_blob_rawsize(lMetadataBlob)), this);
-            Metadata lMetadata;
-            readMetadata(*lMetadataStream, lMetadata); // the first entry is metadata for the directory itself, discard it.
+        lSubNode = mSubNodeNames.value(lName, nullptr);
+        if (lSubNode == nullptr) {
+            lSubNode = new MergedNode(this, lName, pEntry.mMode);
+            mSubNodeNames.insert(lName, lSubNode);
+            pNewNodes.append(lSubNode);
         }
+    }
 
-        ulong lEntryCount = git_tree_entrycount(lTree);
-        for (uint i = 0; i < lEntryCount; ++i) {
-            uint lMode;
-            const git_oid *lOid;
-            QString lName;
-            bool lChunked;
-            const git_tree_entry *lTreeEntry = git_tree_entry_byindex(lTree, i);
-            getEntryAttributes(lTreeEntry, lMode, lChunked, lOid, lName);
-            if (lName == QStringLiteral(".bupm")) {
-                continue;
-            }
-
-            MergedNode *lSubNode = lSubNodeMap.value(lName, nullptr);
-            if (lSubNode == nullptr) {
-                lSubNode = new MergedNode(this, lName, lMode);
-                lSubNodeMap.insert(lName, lSubNode);
-                mSubNodes->append(lSubNode);
-            } else if ((S_IFMT & lMode) != (S_IFMT & lSubNode->mMode)) {
-                if (S_ISDIR(lMode)) {
-                    lName.append(xi18nc("added after folder name in some cases", " (folder)"));
-                } else if (S_ISLNK(lMode)) {
-                    lName.append(xi18nc("added after file name in some cases", " (symlink)"));
-                } else {
-                    lName.append(xi18nc("added after file name in some cases", " (file)"));
-                }
-                lSubNode = lSubNodeMap.value(lName, nullptr);
-                if (lSubNode == nullptr) {
-                    lSubNode = new MergedNode(this, lName, lMode);
-                    lSubNodeMap.insert(lName, lSubNode);
-                    mSubNodes->append(lSubNode);
-                }
-            }
-
-            bool lAlreadySeen = std::any_of(lSubNode->mVersionList.cbegin(), lSubNode->mVersionList.cend(), [&](auto pVersion) {
-                return pVersion->mOid == *lOid;
-            });
-
-            if (S_ISDIR(lMode)) {
-                if (!lAlreadySeen) {
-                    lSubNode->mVersionList.append(new VersionData(lOid, lCurrentVersion->mCommitTime, lCurrentVersion->mModifiedDate, 0));
-                }
-            } else {
-                qint64 lModifiedDate = lCurrentVersion->mModifiedDate;
-                qint64 lSize = -1;
-                Metadata lMetadata;
-                if (lMetadataStream != nullptr && 0 == readMetadata(*lMetadataStream, lMetadata)) {
-                    lModifiedDate = lMetadata.mMtime;
-                    lSize = lMetadata.mSize;
-                }
-                if (!lAlreadySeen) {
-                    VersionData *lVersionData;
-                    if (lSize >= 0) {
-                        lVersionData = new VersionData(lOid, lCurrentVersion->mCommitTime, lModifiedDate, static_cast<quint64>(lSize));
-                    } else {
-                        lVersionData = new VersionData(lChunked, lOid, lCurrentVersion->mCommitTime, lModifiedDate);
-                    }
-                    lSubNode->mVersionList.append(lVersionData);
-                }
+    PendingVersions *lPending = lSubNode->mPending;
+    auto lKnown = lPending->mOids.constFind(pEntry.mOid);
+    if (lKnown != lPending->mOids.constEnd()) {
+        // Stamp a version with the oldest snapshot it is in, like the history index
+        // does, no matter in which order the versions of the folder are merged.
+        VersionData &lVersion = lPending->mVersions[lKnown.value()];
+        if (pCommitTime < lVersion.mCommitTime) {
+            lVersion.mCommitTime = pCommitTime;
+            if (S_ISDIR(pEntry.mMode) || !pEntry.mHaveMetadata) {
+                lVersion.mModifiedDate = pDirModifiedDate;
             }
         }
-        if (lMetadataStream != nullptr) {
-            delete lMetadataStream;
-            git_blob_free(lMetadataBlob);
-        }
-        git_tree_free(lTree);
+        return lSubNode;
     }
-    std::sort(mSubNodes->begin(), mSubNodes->end(), mergedNodeLessThan);
-    foreach (MergedNode *lNode, *mSubNodes) {
-        std::sort(lNode->mVersionList.begin(), lNode->mVersionList.end(), versionGreaterThan);
+    lPending->mOids.insert(pEntry.mOid, lPending->mVersions.count());
+    if (S_ISDIR(pEntry.mMode)) {
+        lPending->mVersions.append(VersionData(&pEntry.mOid, pCommitTime, pDirModifiedDate, 0));
+    } else if (pEntry.mHaveMetadata && pEntry.mSize >= 0) {
+        lPending->mVersions.append(VersionData(&pEntry.mOid, pCommitTime, pEntry.mModifiedDate, static_cast<quint64>(pEntry.mSize)));
+    } else {
+        qint64 lModifiedDate = pEntry.mHaveMetadata ? pEntry.mModifiedDate : pDirModifiedDate;
+        lPending->mVersions.append(VersionData(pEntry.mChunked, &pEntry.mOid, pCommitTime, lModifiedDate));
+    }
+    return lSubNode;
+}
+
+void MergedNode::completeSubNodes()
+{
+    foreach (MergedNode *lNode, mSubNodes) {
+        lNode->storeVersions();
     }
+    mSubNodeNames.clear();
+    mSubNodeNames.squeeze();
+    mSubNodesComplete = true;
 }
 
-MergedRepository::MergedRepository(QObject *pParent, const QString &pRepositoryPath, QString pBranchName)
-    : MergedNode(pParent, pRepositoryPath, DEFAULT_MODE_DIRECTORY)
+void MergedNode::storeVersions()
+{
+    if (mPending == nullptr) {
+        return;
+    }
+    VersionList &lVersions = mPending->mVersions;
+    std::sort(lVersions.begin(), lVersions.end(), versionGreaterThan);
+    mVersions = mVersionArena.store(lVersions);
+    mVersionCount = lVersions.count();
+    delete mPending;
+    mPending = nullptr;
+}
+
+MergedRepository::MergedRepository(const QString &pRepositoryPath, QString pBranchName)
+    : MergedNode(nullptr, pRepositoryPath, DEFAULT_MODE_DIRECTORY)
     , mBranchName(std::move(pBranchName))
+    , mHistoryIndex(nullptr)
 {
-    if (!objectName().endsWith(QLatin1Char('/'))) {
-        setObjectName(objectName() + QLatin1Char('/'));
+    if (!mName.endsWith(QLatin1Char('/'))) {
+        mName.append(QLatin1Char('/'));
     }
 }
 
 MergedRepository::~MergedRepository()
 {
+    mNames.clear();
+    mVersionArena.clear(); // the nodes do not free their versions
+    delete mHistoryIndex;
     if (mRepository != nullptr) {
         git_repository_free(mRepository);
+        mRepository = nullptr;
     }
 }
 
 bool MergedRepository::open()
 {
-    if (0 != git_repository_open(&mRepository, objectName().toLocal8Bit())) {
-        qCWarning(KUPFILEDIGGER) << "could not open repository " << objectName();
+    if (0 != openBupRepository(&mRepository, name())) {
+        qCWarning(KUPFILEDIGGER) << "could not open repository " << name();
         mRepository = nullptr;
         return false;
     }
@@ -243,16 +255,33 @@ bool MergedRepository::readBranch()
     if (mRepository == nullptr) {
         return false;
     }
+    QString lCompleteBranchName = QStringLiteral("refs/heads/");
+    lCompleteBranchName.append(mBranchName);
+
+    git_oid lHead;
+    const bool lHaveHead = 0 == git_reference_name_to_id(&lHead, mRepository, lCompleteBranchName.toLocal8Bit());
+    if (lHaveHead && readHistoryIndex(&lHead)) {
+        return true;
+    }
+    CommitGraph lGraph;
+    if (lHaveHead && lGraph.open(mRepository)) {
+        auto lAddVersion = [this](const git_oid *, const git_oid *pTree, qint64 pCommitTime) {
+            mPending->mVersions.append(VersionData(pTree, pCommitTime, pCommitTime, 0));
+        };
+        if (walkCommitGraph(mRepository, lGraph, &lHead, nullptr, lAddVersion)) {
+            return !mPending->mVersions.isEmpty();
+        }
+        mPending->mVersions.clear();
+    }
+
     git_revwalk *lRevisionWalker;
     if (0 != git_revwalk_new(&lRevisionWalker, mRepository)) {
-        qCWarning(KUPFILEDIGGER) << "could not create a revision walker in repository " << objectName();
+        qCWarning(KUPFILEDIGGER) << "could not create a revision walker in repository " << name();
         return false;
     }
 
-    QString lCompleteBranchName = QStringLiteral("refs/heads/");
-    lCompleteBranchName.append(mBranchName);
     if (0 != git_revwalk_push_ref(lRevisionWalker, lCompleteBranchName.toLocal8Bit())) {
-        qCWarning(KUPFILEDIGGER) << "Unable to read branch " << mBranchName << " in repository " << objectName();
+        qCWarning(KUPFILEDIGGER) << "Unable to read branch " << mBranchName << " in repository " << name();
         git_revwalk_free(lRevisionWalker);
         return false;
     }
@@ -264,7 +293,7 @@ bool MergedRepository::readBranch()
             continue;
         }
         git_time_t lTime = git_commit_time(lCommit);
-        mVersionList.append(new VersionData(git_commit_tree_id(lCommit), lTime, lTime, 0));
+        mPending->mVersions.append(VersionData(git_commit_tree_id(lCommit), lTime, lTime, 0));
         lEmptyList = false;
         git_commit_free(lCommit);
     }
@@ -272,12 +301,28 @@ bool MergedRepository::readBranch()
     return !lEmptyList;
 }
 
+bool MergedRepository::readHistoryIndex(const git_oid *pHead)
+{
+    auto lIndex = new HistoryIndex(name(), mBranchName);
+    if (!lIndex->load() || !lIndex->isCurrent(pHead) || lIndex->commits().isEmpty()) {
+        delete lIndex; // missing or stale, the daemon updates it after the next backup
+        return false;
+    }
+    const QVector<HistoryCommit> &lCommits = lIndex->commits();
+    for (int i = lCommits.count() - 1; i >= 0; --i) {
+        mPending->mVersions.append(VersionData(&lCommits.at(i).mTreeOid, lCommits.at(i).mCommitTime, lCommits.at(i).mCommitTime, 0));
+    }
+    mHistoryIndex = lIndex;
+    mHistoryDirId = HistoryIndex::cRootDir;
+    return true;
+}
+
 bool MergedRepository::permissionsOk()
 {
     if (mRepository == nullptr) {
         return false;
     }
-    QDir lRepoDir(objectName());
+    QDir lRepoDir(name());
     if (!lRepoDir.exists()) {
         return false;
     }
@@ -309,22 +354,86 @@ bool operator==(const git_oid &pOidA, const git_oid &pOidB)
     return a == b;
 }
 
-quint64 VersionData::size()
+quint64 VersionData::size() const
+{
+    if (!mSizeIsValid) {
+        return loadVersionSize(&mOid, mChunkedFile, MergedNode::mRepository);
+    }
+    return mSize;
+}
+
+void MergedNode::setVersionSize(int pIndex, const git_oid *pOid, quint64 pSize)
+{
+    VersionData *lVersions = mPending != nullptr ? mPending->mVersions.data() : mVersions;
+    const int lCount = mPending != nullptr ? mPending->mVersions.count() : mVersionCount;
+    if (pIndex < lCount && git_oid_equal(&lVersions[pIndex].mOid, pOid)) {
+        lVersions[pIndex].setSize(pSize);
+    }
+}
+
+VersionArena::VersionArena()
+    : mBlockUsed(cVersionBlockRecords)
+    , mLargeRecords(0)
+{
+}
+
+VersionArena::~VersionArena()
+{
+    clear();
+}
+
+VersionData *VersionArena::store(const VersionList &pVersions)
 {
-    if (mSizeIsValid) {
-        return mSize;
+    const int lCount = pVersions.count();
+    if (lCount == 0) {
+        return nullptr;
     }
-    if (mChunkedFile) {
-        mSize = calculateChunkFileSize(&mOid, MergedNode::mRepository);
+    VersionData *lRecords;
+    if (lCount > cVersionBlockRecords / 4) {
+        // a file with very many versions, keep it from wasting the end of a block
+        lRecords = static_cast<VersionData *>(malloc(sizeof(VersionData) * static_cast<size_t>(lCount)));
+        Q_CHECK_PTR(lRecords);
+        mLargeBlocks.append(lRecords);
+        mLargeRecords += static_cast<quint64>(lCount);
     } else {
-        git_blob *lBlob;
-        if (0 == git_blob_lookup(&lBlob, MergedNode::mRepository, &mOid)) {
-            mSize = static_cast<quint64>(git_blob_rawsize(lBlob));
-            git_blob_free(lBlob);
-        } else {
-            mSize = 0;
+        if (mBlockUsed + lCount > cVersionBlockRecords) {
+            auto lBlock = static_cast<VersionData *>(malloc(sizeof(VersionData) * cVersionBlockRecords));
+            Q_CHECK_PTR(lBlock);
+            mBlocks.append(lBlock);
+            mBlockUsed = 0;
         }
+        lRecords = mBlocks.last() + mBlockUsed;
+        mBlockUsed += lCount;
     }
-    mSizeIsValid = true;
-    return mSize;
+    std::uninitialized_copy(pVersions.constBegin(), pVersions.constEnd(), lRecords);
+    return lRecords;
+}
+
+void VersionArena::clear()
+{
+    static_assert(std::is_trivially_destructible<VersionData>::value, "the records are freed without being destroyed");
+    for (VersionData *lBlock : std::as_const(mBlocks)) {
+        free(lBlock);
+    }
+    mBlocks.clear();
+    for (VersionData *lBlock : std::as_const(mLargeBlocks)) {
+        free(lBlock);
+    }
+    mLargeBlocks.clear();
+    mBlockUsed = cVersionBlockRecords;
+    mLargeRecords = 0;
+}
+
+quint64 VersionArena::bytesUsed() const
+{
+    return (static_cast<quint64>(mBlocks.count()) * cVersionBlockRecords + mLargeRecords) * sizeof(VersionData);
+}
+
+quint64 loadVersionSize(const git_oid *pOid, bool pChunkedFile, git_repository *pRepository)
+{
+    if (pChunkedFile) {
+        return calculateChunkFileSize(pOid, pRepository);
+    }
+    quint64 lSize;
+    return readBlobSize(pOid, pRepository, lSize) ? lSize : 0;
 }
@@ -9,36 +9,46 @@
 uint qHash(git_oid pOid);
 bool operator==(const git_oid &pOidA, const git_oid &pOidB);
 #include <QHash>
-#include <QObject>
+#include <QSet>
+#include <QVector>
 
 #include <QUrl>
 
 #include <sys/stat.h>
 
+// Stored by value in the version list of a node, keep it small. The size of
+// files without metadata is calculated the first time it is asked for.
 struct VersionData {
     VersionData(bool pChunkedFile, const git_oid *pOid, qint64 pCommitTime, qint64 pModifiedDate)
-        : mChunkedFile(pChunkedFile)
-        , mOid(*pOid)
+        : mOid(*pOid)
+        , mSizeIsValid(false)
+        , mChunkedFile(pChunkedFile)
         , mCommitTime(pCommitTime)
         , mModifiedDate(pModifiedDate)
     {
-        mSizeIsValid = false;
     }
 
     VersionData(const git_oid *pOid, qint64 pCommitTime, qint64 pModifiedDate, quint64 pSize)
-        : mChunkedFile(false)
-        , mOid(*pOid)
+        : mOid(*pOid)
+        , mSizeIsValid(true)
+        , mChunkedFile(false)
         , mCommitTime(pCommitTime)
         , mModifiedDate(pModifiedDate)
         , mSize(pSize)
     {
-        mSizeIsValid = true;
     }
 
-    quint64 size();
+    // Blocks while the size is calculated if it is not known, VersionListModel loads
+    // them in the background and stores them with setSize().
+    quint64 size() const;
+    void setSize(quint64 pSize)
+    {
+        mSize = pSize;
+        mSizeIsValid = true;
+    }
+    git_oid mOid;
     bool mSizeIsValid;
     bool mChunkedFile;
-    git_oid mOid;
     qint64 mCommitTime;
     qint64 mModifiedDate;
 
@@ -46,24 +56,108 @@ protected:
     quint64 mSize{};
 };
 
+quint64 loadVersionSize(const git_oid *pOid, bool pChunkedFile, git_repository *pRepository);
+
+// One entry of a decoded tree, produced by the TreeLoader thread.
+struct DecodedEntry {
+    QString mName;
+    uint mMode;
+    bool mChunked;
+    bool mHaveMetadata; // mModifiedDate and mSize are only valid when true
+    git_oid mOid;
+    qint64 mModifiedDate;
+    qint64 mSize;
+};
+
+// The entries of one version of a directory, mVersionIndex is an index into the
+// version list of the directory node.
+struct DecodedTree {
+    int mVersionIndex;
+    bool mValid;
+    QVector<DecodedEntry> mEntries;
+};
+typedef QVector<DecodedTree> DecodedTreeList;
+
+class HistoryIndex;
 class MergedNode;
 typedef QList<MergedNode *> MergedNodeList;
 typedef QListIterator<MergedNode *> MergedNodeListIterator;
-typedef QList<VersionData *> VersionList;
-typedef QListIterator<VersionData *> VersionListIterator;
+typedef QVector<VersionData> VersionList;
 
-class MergedNode : public QObject
+// A view of the versions of one node, valid as long as the node.
+class VersionSpan
+{
+public:
+    VersionSpan(const VersionData *pData, int pCount)
+        : mData(pData)
+        , mCount(pCount)
+    {
+    }
+    const VersionData *begin() const
+    {
+        return mData;
+    }
+    const VersionData *end() const
+    {
+        return mData + mCount;
+    }
+    const VersionData &at(int pIndex) const
+    {
+        Q_ASSERT(pIndex >= 0 && pIndex < mCount);
+        return mData[pIndex];
+    }
+    int count() const
+    {
+        return mCount;
+    }
+    bool isEmpty() const
+    {
+        return mCount == 0;
+    }
+
+protected:
+    const VersionData *mData;
+    int mCount;
+};
+
+// Storage for the version records of all nodes in a repository. The records of one
+// node are copied in next to each other once they are all known, large blocks
+// instead of one vector per node.
+class VersionArena
+{
+public:
+    VersionArena();
+    ~VersionArena();
+    VersionData *store(const VersionList &pVersions);
+    // pointers handed out before are no longer valid after this.
+    void clear();
+    // bytes held by the blocks, including the unused end of the last one
+    quint64 bytesUsed() const;
+
+protected:
+    QList<VersionData *> mBlocks;
+    QList<VersionData *> mLargeBlocks; // one per node with many versions
+    int mBlockUsed; // records used in the last of mBlocks
+    quint64 mLargeRecords;
+};
+
+// Not a QObject, there is one of these for every path in every snapshot. Sub nodes
+// are owned by their parent. Names are shared between all nodes with the same name.
+class MergedNode
 {
-    Q_OBJECT
     friend struct VersionData;
+    friend class MergedVfsModel;
 
 public:
-    MergedNode(QObject *pParent, const QString &pName, uint pMode);
-    ~MergedNode() override
+    MergedNode(MergedNode *pParent, const QString &pName, uint pMode);
+    virtual ~MergedNode();
+    MergedNode *parent() const
+    {
+        return mParent;
+    }
+    const QString &name() const
     {
-        delete mSubNodes;
-        while (!mVersionList.isEmpty())
-            delete mVersionList.takeFirst();
+        return mName;
     }
     bool isDirectory() const
     {
@@ -75,11 +169,36 @@ public:
                    QString *pBranchName = nullptr,
                    qint64 *pCommitTime = nullptr,
                    QString *pPathInRepo = nullptr) const;
-    virtual MergedNodeList &subNodes();
-    const VersionList *versionList() const
+    // The sub nodes found so far. They are filled in by MergedVfsModel, which loads
+    // the trees of all versions in the background and merges them one at a time.
+    const MergedNodeList &subNodes() const
+    {
+        return mSubNodes;
+    }
+    bool subNodesComplete() const
+    {
+        return mSubNodesComplete;
+    }
+    int mergedVersionCount() const
+    {
+        return mMergedVersionCount;
+    }
+    // Position among the sub nodes of the parent, kept up to date by MergedVfsModel.
+    int row() const
     {
-        return &mVersionList;
+        return mRow;
     }
+    // Sorted newest first once the parent has all its sub nodes, in the order they
+    // were found before that.
+    VersionSpan versionList() const
+    {
+        if (mPending != nullptr) {
+            return VersionSpan(mPending->mVersions.constData(), mPending->mVersions.count());
+        }
+        return VersionSpan(mVersions, mVersionCount);
+    }
+    // Keeps a size loaded in the background, ignored if pIndex is no longer pOid.
+    void setVersionSize(int pIndex, const git_oid *pOid, quint64 pSize);
     uint mode() const
     {
         return mMode;
@@ -87,26 +206,68 @@ public:
     static void askForIntegrityCheck();
 
 protected:
-    virtual void generateSubNodes();
+    // Merges one version of this directory, nodes seen for the first time are
+    // returned in pNewNodes and must be added to mSubNodes by the caller.
+    void mergeVersion(const DecodedTree &pTree, MergedNodeList &pNewNodes);
+    // Adds one version of a sub node, pDirModifiedDate is used for folders and
+    // for files without metadata. Returns the sub node.
+    MergedNode *mergeEntry(const DecodedEntry &pEntry, qint64 pCommitTime, qint64 pDirModifiedDate, MergedNodeList &pNewNodes);
+    void completeSubNodes();
+    // Sorts the versions and moves them into mVersionArena.
+    void storeVersions();
+
+    // Versions are collected here while the parent is merging.
+    struct PendingVersions {
+        VersionList mVersions;
+        QHash<git_oid, int> mOids; // index in mVersions
+    };
 
     static git_repository *mRepository;
+    static QSet<QString> mNames; // for sharing the name strings
+    static VersionArena mVersionArena;
+    MergedNode *mParent;
+    QString mName;
     uint mMode;
-    VersionList mVersionList;
-    MergedNodeList *mSubNodes;
+    PendingVersions *mPending; // null once the versions are in mVersionArena
+    VersionData *mVersions;
+    int mVersionCount;
+    MergedNodeList mSubNodes;
+    QHash<QString, MergedNode *> mSubNodeNames; // only used while merging
+    int mMergedVersionCount;
+    int mRow;
+    bool mSubNodesComplete;
+    quint32 mHistoryDirId; // folder in the history index, if it is used
 };
 
+// Folders first, then by name. The order of sub nodes.
+bool mergedNodeLessThan(const MergedNode *a, const MergedNode *b);
+
 class MergedRepository : public MergedNode
 {
-    Q_OBJECT
 public:
-    MergedRepository(QObject *pParent, const QString &pRepositoryPath, QString pBranchName);
+    MergedRepository(const QString &pRepositoryPath, QString pBranchName);
     ~MergedRepository() override;
 
     bool open();
     bool readBranch();
     bool permissionsOk();
+    // The history index of the branch if it is up to date, otherwise null.
+    const HistoryIndex *historyIndex() const
+    {
+        return mHistoryIndex;
+    }
+    // bytes held by the version records of nodes whose parent is complete
+    quint64 versionBytesUsed() const
+    {
+        return mVersionArena.bytesUsed();
+    }
 
     QString mBranchName;
+
+protected:
+    bool readHistoryIndex(const git_oid *pHead);
+
+    HistoryIndex *mHistoryIndex;
 };
 
 #endif // MERGEDVFS_H
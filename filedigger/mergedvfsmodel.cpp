@@ -3,7 +3,9 @@
 // SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
 
 #include "mergedvfsmodel.h"
+#include "historyindex.h"
 #include "mergedvfs.h"
+#include "treeloader.h"
 
 #include <KIO/Global>
 
@@ -11,15 +13,31 @@
 #include <QMimeDatabase>
 #include <QMimeType>
 #include <QPixmap>
+#include <QTimer>
+
+#include <algorithm>
 
 MergedVfsModel::MergedVfsModel(MergedRepository *pRoot, QObject *pParent)
     : QAbstractItemModel(pParent)
     , mRoot(pRoot)
+    , mLoader(new TreeLoader(pRoot->name()))
+    , mLastRequest(0)
+    , mIntegrityCheckAsked(false)
 {
+    mLoader->moveToThread(&mLoaderThread);
+    connect(mLoader, &TreeLoader::treesDecoded, this, &MergedVfsModel::mergeTrees);
+    connect(mLoader, &TreeLoader::loadFinished, this, &MergedVfsModel::finishLoading);
+    mLoaderThread.start();
 }
 
 MergedVfsModel::~MergedVfsModel()
 {
+    for (auto lIter = mLoadingNodes.constBegin(); lIter != mLoadingNodes.constEnd(); ++lIter) {
+        mLoader->cancel(lIter.key());
+    }
+    mLoaderThread.quit();
+    mLoaderThread.wait();
+    delete mLoader;
     delete mRoot;
 }
 
@@ -37,18 +55,36 @@ QVariant MergedVfsModel::data(const QModelIndex &pIndex, int pRole) const
     auto *lNode = static_cast<MergedNode *>(pIndex.internalPointer());
     switch (pRole) {
     case Qt::DisplayRole:
-        return lNode->objectName();
-    case Qt::DecorationRole: {
-        QString lIconName = KIO::iconNameForUrl(QUrl::fromLocalFile(lNode->objectName()));
-        if (lNode->isDirectory()) {
+        return lNode->name();
+    case Qt::DecorationRole:
+        return iconForNode(lNode);
+    default:
+        return QVariant();
+    }
+}
+
+// Files with the same extension get the same icon, names without one are looked up as is.
+static QString iconKey(const QString &pName)
+{
+    const int lDot = pName.indexOf(QLatin1Char('.'), 1);
+    return lDot < 0 ? pName : pName.mid(lDot);
+}
+
+QIcon MergedVfsModel::iconForNode(const MergedNode *pNode) const
+{
+    if (pNode->isDirectory()) {
+        if (mFolderIcon.isNull()) {
             QMimeDatabase db;
-            lIconName = db.mimeTypeForName(QStringLiteral("inode/directory")).iconName();
+            mFolderIcon = QIcon::fromTheme(db.mimeTypeForName(QStringLiteral("inode/directory")).iconName());
         }
-        return QIcon::fromTheme(lIconName);
+        return mFolderIcon;
     }
-    default:
-        return QVariant();
+    const QString lKey = iconKey(pNode->name());
+    auto lIter = mIcons.constFind(lKey);
+    if (lIter == mIcons.constEnd()) {
+        lIter = mIcons.insert(lKey, QIcon::fromTheme(KIO::iconNameForUrl(QUrl::fromLocalFile(pNode->name()))));
     }
+    return lIter.value();
 }
 
 QModelIndex MergedVfsModel::index(int pRow, int pColumn, const QModelIndex &pParent) const
@@ -75,15 +111,11 @@ QModelIndex MergedVfsModel::parent(const QModelIndex &pChild) const
         return {};
     }
     auto lChild = static_cast<MergedNode *>(pChild.internalPointer());
-    auto lParent = qobject_cast<MergedNode *>(lChild->parent());
+    MergedNode *lParent = lChild->parent();
     if (lParent == nullptr || lParent == mRoot) {
         return {}; // invalid
     }
-    auto lGrandParent = qobject_cast<MergedNode *>(lParent->parent());
-    if (lGrandParent == nullptr) {
-        return {}; // invalid
-    }
-    return createIndex(lGrandParent->subNodes().indexOf(lParent), 0, lParent);
+    return createIndex(lParent->row(), 0, lParent);
 }
 
 int MergedVfsModel::rowCount(const QModelIndex &pParent) const
@@ -98,12 +130,215 @@ int MergedVfsModel::rowCount(const QModelIndex &pParent) const
     return lParent->subNodes().count();
 }
 
-const VersionList *MergedVfsModel::versionList(const QModelIndex &pIndex)
+VersionSpan MergedVfsModel::versionList(const QModelIndex &pIndex)
 {
     return node(pIndex)->versionList();
 }
 
-const MergedNode *MergedVfsModel::node(const QModelIndex &pIndex)
+MergedNode *MergedVfsModel::node(const QModelIndex &pIndex)
+{
+    return static_cast<MergedNode *>(pIndex.internalPointer());
+}
+
+bool MergedVfsModel::hasChildren(const QModelIndex &pParent) const
+{
+    MergedNode *lNode = nodeForIndex(pParent);
+    if (!lNode->isDirectory()) {
+        return false;
+    }
+    // show folders as expandable until they are known to be empty
+    return !lNode->subNodesComplete() || !lNode->subNodes().isEmpty();
+}
+
+bool MergedVfsModel::canFetchMore(const QModelIndex &pParent) const
+{
+    MergedNode *lNode = nodeForIndex(pParent);
+    if (lNode->subNodesComplete() || mLoadRequests.contains(lNode)) {
+        return false;
+    }
+    // the versions of a node are only all known when its parent is complete
+    MergedNode *lParentNode = lNode->parent();
+    return lNode == mRoot || (lParentNode != nullptr && lParentNode->subNodesComplete());
+}
+
+void MergedVfsModel::fetchMore(const QModelIndex &pParent)
+{
+    if (!canFetchMore(pParent)) {
+        return;
+    }
+    MergedNode *lNode = nodeForIndex(pParent);
+    if (mRoot->historyIndex() != nullptr && lNode->mHistoryDirId != HistoryIndex::cNoDir) {
+        mergeHistory(lNode);
+        return;
+    }
+    const VersionSpan lVersions = lNode->versionList();
+    QVector<git_oid> lTrees;
+    lTrees.reserve(lVersions.count() - lNode->mergedVersionCount());
+    for (int i = lNode->mergedVersionCount(); i < lVersions.count(); ++i) {
+        lTrees.append(lVersions.at(i).mOid);
+    }
+    if (lTrees.isEmpty()) {
+        completeSubNodes(lNode);
+        return;
+    }
+    const quint64 lRequest = ++mLastRequest;
+    mLoadingNodes.insert(lRequest, lNode);
+    mLoadRequests.insert(lNode, lRequest);
+    mLoader->load(lRequest, lTrees, lNode->mergedVersionCount());
+}
+
+void MergedVfsModel::cancelFetch(const QModelIndex &pParent)
+{
+    MergedNode *lNode = nodeForIndex(pParent);
+    auto lIter = mLoadingNodes.begin();
+    while (lIter != mLoadingNodes.end()) {
+        MergedNode *lAncestor = lIter.value();
+        while (lAncestor != nullptr && lAncestor != lNode) {
+            lAncestor = lAncestor->parent();
+        }
+        if (lAncestor == nullptr) {
+            ++lIter;
+            continue;
+        }
+        mLoader->cancel(lIter.key());
+        mLoadRequests.remove(lIter.value());
+        lIter = mLoadingNodes.erase(lIter);
+    }
+}
+
+bool MergedVfsModel::hasAllSubNodes(const QModelIndex &pParent) const
+{
+    return nodeForIndex(pParent)->subNodesComplete();
+}
+
+void MergedVfsModel::mergeTrees(quint64 pRequest, const DecodedTreeList &pTrees)
 {
+    MergedNode *lNode = mLoadingNodes.value(pRequest, nullptr);
+    if (lNode == nullptr) {
+        return; // cancelled
+    }
+    MergedNodeList lNewNodes;
+    for (const DecodedTree &lTree : pTrees) {
+        if (lTree.mVersionIndex != lNode->mergedVersionCount()) {
+            continue;
+        }
+        if (!lTree.mValid && !mIntegrityCheckAsked) {
+            // not from inside this slot, more batches would be merged while the dialog is open.
+            mIntegrityCheckAsked = true;
+            QTimer::singleShot(0, this, [] {
+                MergedNode::askForIntegrityCheck();
+            });
+        }
+        lNode->mergeVersion(lTree, lNewNodes);
+    }
+    insertSubNodes(lNode, lNewNodes);
+}
+
+void MergedVfsModel::finishLoading(quint64 pRequest)
+{
+    MergedNode *lNode = mLoadingNodes.take(pRequest);
+    if (lNode == nullptr) {
+        return;
+    }
+    mLoadRequests.remove(lNode);
+    if (lNode->mergedVersionCount() == lNode->versionList().count()) {
+        completeSubNodes(lNode);
+    }
+}
+
+void MergedVfsModel::mergeHistory(MergedNode *pNode)
+{
+    QVector<HistoryVersion> lVersions;
+    mRoot->historyIndex()->versions(pNode->mHistoryDirId, lVersions);
+    MergedNodeList lNewNodes;
+    for (const HistoryVersion &lVersion : std::as_const(lVersions)) {
+        MergedNode *lSubNode = pNode->mergeEntry(lVersion.mEntry, lVersion.mCommitTime, lVersion.mCommitTime, lNewNodes);
+        if (lSubNode->isDirectory()) {
+            lSubNode->mHistoryDirId = lVersion.mDirId;
+        }
+    }
+    pNode->mMergedVersionCount = pNode->versionList().count();
+    insertSubNodes(pNode, lNewNodes);
+    completeSubNodes(pNode);
+}
+
+MergedNode *MergedVfsModel::nodeForIndex(const QModelIndex &pIndex) const
+{
+    if (!pIndex.isValid()) {
+        return mRoot;
+    }
     return static_cast<MergedNode *>(pIndex.internalPointer());
 }
+
+QModelIndex MergedVfsModel::indexForNode(MergedNode *pNode) const
+{
+    MergedNode *lParent = pNode->parent();
+    if (pNode == mRoot || lParent == nullptr) {
+        return {};
+    }
+    return createIndex(pNode->row(), 0, pNode);
+}
+
+void MergedVfsModel::insertSubNodes(MergedNode *pNode, MergedNodeList &pNewNodes)
+{
+    if (pNewNodes.isEmpty()) {
+        return;
+    }
+    std::sort(pNewNodes.begin(), pNewNodes.end(), mergedNodeLessThan);
+    const QModelIndex lParent = indexForNode(pNode);
+    MergedNodeList &lSubNodes = pNode->mSubNodes;
+
+    // Merge both sorted lists in one pass, counting the separate ranges of new rows.
+    MergedNodeList lMerged;
+    lMerged.reserve(lSubNodes.count() + pNewNodes.count());
+    int lFirstNewRow = -1;
+    int lNewRanges = 0;
+    int lOld = 0;
+    int lNew = 0;
+    while (lOld < lSubNodes.count() || lNew < pNewNodes.count()) {
+        if (lNew < pNewNodes.count() && (lOld == lSubNodes.count() || mergedNodeLessThan(pNewNodes.at(lNew), lSubNodes.at(lOld)))) {
+            if (lNew == 0 || lMerged.last() != pNewNodes.at(lNew - 1)) {
+                ++lNewRanges;
+            }
+            if (lFirstNewRow < 0) {
+                lFirstNewRow = lMerged.count();
+            }
+            lMerged.append(pNewNodes.at(lNew++));
+        } else {
+            lMerged.append(lSubNodes.at(lOld++));
+        }
+    }
+
+    if (lNewRanges == 1) {
+        beginInsertRows(lParent, lFirstNewRow, lFirstNewRow + pNewNodes.count() - 1);
+        lSubNodes = lMerged;
+        // views may ask for the parent of any row when the insert is announced
+        for (int i = lFirstNewRow; i < lSubNodes.count(); ++i) {
+            lSubNodes.at(i)->mRow = i;
+        }
+        endInsertRows();
+        return;
+    }
+    // New rows all over the place, announcing each range would renumber the rows
+    // after it every time. Move the existing rows to their new place in one go.
+    emit layoutAboutToBeChanged({lParent});
+    const QModelIndexList lOldIndexes = persistentIndexList();
+    lSubNodes = lMerged;
+    for (int i = 0; i < lSubNodes.count(); ++i) {
+        lSubNodes.at(i)->mRow = i;
+    }
+    QModelIndexList lNewIndexes;
+    lNewIndexes.reserve(lOldIndexes.count());
+    for (const QModelIndex &lIndex : lOldIndexes) {
+        auto lNode = static_cast<MergedNode *>(lIndex.internalPointer());
+        lNewIndexes.append(createIndex(lNode->row(), lIndex.column(), lNode));
+    }
+    changePersistentIndexList(lOldIndexes, lNewIndexes);
+    emit layoutChanged({lParent});
+}
+
+void MergedVfsModel::completeSubNodes(MergedNode *pNode)
+{
+    pNode->completeSubNodes();
+    emit subNodesReady(indexForNode(pNode));
+}
@@ -6,9 +6,16 @@
 #define MERGEDVFSMODEL_H
 
 #include <QAbstractItemModel>
+#include <QHash>
+#include <QIcon>
+#include <QThread>
 
 #include "mergedvfs.h"
 
+class TreeLoader;
+
+// Sub nodes are loaded in the background when a view asks for them with
+// fetchMore(), rows are inserted as the versions of a folder get merged.
 class MergedVfsModel : public QAbstractItemModel
 {
     Q_OBJECT
@@ -20,12 +27,44 @@ public:
     QModelIndex index(int pRow, int pColumn, const QModelIndex &pParent) const override;
     QModelIndex parent(const QModelIndex &pChild) const override;
     int rowCount(const QModelIndex &pParent) const override;
+    bool hasChildren(const QModelIndex &pParent) const override;
+    bool canFetchMore(const QModelIndex &pParent) const override;
+    void fetchMore(const QModelIndex &pParent) override;
+
+    // Stops loading sub nodes of pParent and of everything below it. fetchMore()
+    // continues from the first version that was not merged yet.
+    void cancelFetch(const QModelIndex &pParent);
+    bool hasAllSubNodes(const QModelIndex &pParent) const;
+
+    static VersionSpan versionList(const QModelIndex &pIndex);
+    static MergedNode *node(const QModelIndex &pIndex);
 
-    static const VersionList *versionList(const QModelIndex &pIndex);
-    static const MergedNode *node(const QModelIndex &pIndex);
+signals:
+    // All versions of pParent have been merged, version lists of its sub nodes are complete.
+    void subNodesReady(const QModelIndex &pParent);
+
+protected slots:
+    void mergeTrees(quint64 pRequest, const DecodedTreeList &pTrees);
+    void finishLoading(quint64 pRequest);
 
 protected:
+    MergedNode *nodeForIndex(const QModelIndex &pIndex) const;
+    QModelIndex indexForNode(MergedNode *pNode) const;
+    QIcon iconForNode(const MergedNode *pNode) const;
+    // Reads all versions of the sub nodes from the history index, no trees are loaded.
+    void mergeHistory(MergedNode *pNode);
+    void insertSubNodes(MergedNode *pNode, MergedNodeList &pNewNodes);
+    void completeSubNodes(MergedNode *pNode);
+
     MergedRepository *mRoot;
+    QThread mLoaderThread;
+    TreeLoader *mLoader;
+    QHash<quint64, MergedNode *> mLoadingNodes;
+    QHash<MergedNode *, quint64> mLoadRequests;
+    quint64 mLastRequest;
+    bool mIntegrityCheckAsked;
+    mutable QIcon mFolderIcon;
+    mutable QHash<QString, QIcon> mIcons; // by extension
 };
 
 #endif // MERGEDVFSMODEL_H
@@ -0,0 +1,439 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "nameindex.h"
+#include "historyindex.h"
+#include "kupfiledigger_debug.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QSaveFile>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+static const char cNamesMagic[8] = {'K', 'U', 'P', 'N', 'A', 'M', 'E', 'S'};
+static const quint32 cNamesVersion = 1;
+static const quint32 cBlockMagic = 0x4B55504E;
+static const int cLockTimeout = 10000; // ms
+static const int cMaxFolderDepth = 4096;
+
+struct NamesHeader {
+    char mMagic[8];
+    quint32 mVersion;
+    quint32 mHistoryGeneration;
+};
+
+// followed by the payload and the head of the history block it brings the index up to
+struct NamesBlockHeader {
+    quint32 mMagic;
+    quint32 mSize;
+};
+
+// followed by the entries, trigrams, postings and names
+struct PayloadHeader {
+    quint32 mEntryCount;
+    quint32 mTrigramCount;
+    quint32 mPostingCount;
+    quint32 mNamesSize;
+};
+
+struct NameEntry {
+    quint32 mParentDir;
+    quint32 mDirId;
+    quint32 mNameOffset;
+    quint32 mNameSize;
+    quint32 mVersionCount;
+};
+
+// postings are entry indexes, sorted
+struct TrigramEntry {
+    quint32 mTrigram;
+    quint32 mFirstPosting;
+    quint32 mPostingCount;
+};
+
+template<typename T>
+static T readAt(const char *pArray, quint32 pIndex)
+{
+    T lRecord;
+    memcpy(&lRecord, pArray + static_cast<qint64>(pIndex) * static_cast<qint64>(sizeof(T)), sizeof(T));
+    return lRecord;
+}
+
+template<typename T>
+static void appendRecord(QByteArray &pBuffer, const T &pRecord)
+{
+    pBuffer.append(reinterpret_cast<const char *>(&pRecord), static_cast<int>(sizeof(T)));
+}
+
+static quint32 trigramAt(const QByteArray &pText, int pPosition)
+{
+    return (quint32(uchar(pText.at(pPosition))) << 16) | (quint32(uchar(pText.at(pPosition + 1))) << 8) | quint32(uchar(pText.at(pPosition + 2)));
+}
+
+static QByteArray foldedName(const QByteArray &pName)
+{
+    return QString::fromUtf8(pName).toLower().toUtf8();
+}
+
+static bool findTrigram(const char *pTrigrams, quint32 pCount, quint32 pTrigram, TrigramEntry &pEntry)
+{
+    quint32 lStart = 0;
+    quint32 lEnd = pCount;
+    while (lStart < lEnd) {
+        const quint32 lMiddle = lStart + (lEnd - lStart) / 2;
+        pEntry = readAt<TrigramEntry>(pTrigrams, lMiddle);
+        if (pEntry.mTrigram == pTrigram) {
+            return true;
+        }
+        if (pEntry.mTrigram < pTrigram) {
+            lStart = lMiddle + 1;
+        } else {
+            lEnd = lMiddle;
+        }
+    }
+    return false;
+}
+
+static bool hasPosting(const char *pPostings, const TrigramEntry &pTrigram, quint32 pEntry)
+{
+    quint32 lStart = pTrigram.mFirstPosting;
+    quint32 lEnd = pTrigram.mFirstPosting + pTrigram.mPostingCount;
+    while (lStart < lEnd) {
+        const quint32 lMiddle = lStart + (lEnd - lStart) / 2;
+        const quint32 lPosting = readAt<quint32>(pPostings, lMiddle);
+        if (lPosting == pEntry) {
+            return true;
+        }
+        if (lPosting < pEntry) {
+            lStart = lMiddle + 1;
+        } else {
+            lEnd = lMiddle;
+        }
+    }
+    return false;
+}
+
+// One block for the names in history blocks pFirst to pLast.
+static QByteArray buildBlock(const HistoryIndex &pHistory, int pFirst, int pLast)
+{
+    QVector<NameEntry> lEntries;
+    QByteArray lNames;
+    QHash<QByteArray, int> lEntryIndexes; // parent folder and name
+    for (int i = pFirst; i <= pLast; ++i) {
+        pHistory.blockNames(i, [&](quint32 pParentDir, quint32 pDirId, const QByteArray &pName) {
+            QByteArray lKey(reinterpret_cast<const char *>(&pParentDir), sizeof(pParentDir));
+            lKey.append(pName);
+            auto lIter = lEntryIndexes.constFind(lKey);
+            if (lIter != lEntryIndexes.constEnd()) {
+                NameEntry &lEntry = lEntries[lIter.value()];
+                ++lEntry.mVersionCount;
+                if (pDirId != HistoryIndex::cNoDir) {
+                    lEntry.mDirId = pDirId;
+                }
+                return;
+            }
+            lEntryIndexes.insert(lKey, lEntries.count());
+            lEntries.append(NameEntry{pParentDir, pDirId, static_cast<quint32>(lNames.size()), static_cast<quint32>(pName.size()), 1});
+            lNames.append(pName);
+        });
+    }
+
+    QVector<quint64> lPairs; // trigram and entry index
+    for (int i = 0; i < lEntries.count(); ++i) {
+        const QByteArray lName = foldedName(QByteArray::fromRawData(lNames.constData() + lEntries.at(i).mNameOffset, int(lEntries.at(i).mNameSize)));
+        for (int j = 0; j + 2 < lName.size(); ++j) {
+            lPairs.append((quint64(trigramAt(lName, j)) << 32) | quint64(i));
+        }
+    }
+    std::sort(lPairs.begin(), lPairs.end());
+    lPairs.erase(std::unique(lPairs.begin(), lPairs.end()), lPairs.end());
+
+    QVector<TrigramEntry> lTrigrams;
+    QVector<quint32> lPostings;
+    lPostings.reserve(lPairs.count());
+    for (const quint64 lPair : std::as_const(lPairs)) {
+        const auto lTrigram = quint32(lPair >> 32);
+        if (lTrigrams.isEmpty() || lTrigrams.last().mTrigram != lTrigram) {
+            lTrigrams.append(TrigramEntry{lTrigram, static_cast<quint32>(lPostings.count()), 0});
+        }
+        ++lTrigrams.last().mPostingCount;
+        lPostings.append(quint32(lPair & 0xFFFFFFFF));
+    }
+
+    QByteArray lPayload;
+    appendRecord(lPayload,
+                 PayloadHeader{static_cast<quint32>(lEntries.count()),
+                               static_cast<quint32>(lTrigrams.count()),
+                               static_cast<quint32>(lPostings.count()),
+                               static_cast<quint32>(lNames.size())});
+    lPayload.append(reinterpret_cast<const char *>(lEntries.constData()), lEntries.count() * int(sizeof(NameEntry)));
+    lPayload.append(reinterpret_cast<const char *>(lTrigrams.constData()), lTrigrams.count() * int(sizeof(TrigramEntry)));
+    lPayload.append(reinterpret_cast<const char *>(lPostings.constData()), lPostings.count() * int(sizeof(quint32)));
+    lPayload.append(lNames);
+
+    QByteArray lBlock;
+    appendRecord(lBlock, NamesBlockHeader{cBlockMagic, static_cast<quint32>(lPayload.size())});
+    lBlock.append(lPayload);
+    lBlock.append(reinterpret_cast<const char *>(pHistory.blockHead(pLast)->id), GIT_OID_RAWSZ);
+    return lBlock;
+}
+
+NameIndex::NameIndex(const QString &pRepositoryPath, const QString &pBranchName)
+    : mPath(HistoryIndex::cachePath(pRepositoryPath, pBranchName, QStringLiteral(".names")))
+    , mMapped(nullptr)
+    , mValidSize(0)
+    , mHistoryGeneration(0)
+{
+}
+
+NameIndex::~NameIndex()
+{
+    unload();
+}
+
+void NameIndex::unload()
+{
+    if (mMapped != nullptr) {
+        mFile.unmap(mMapped);
+        mMapped = nullptr;
+    }
+    mFile.close();
+    mValidSize = 0;
+    mBlocks.clear();
+    mDirectories.clear();
+}
+
+bool NameIndex::load()
+{
+    unload();
+    mFile.setFileName(mPath);
+    if (!mFile.open(QIODevice::ReadOnly) || mFile.size() < static_cast<qint64>(sizeof(NamesHeader))) {
+        return false;
+    }
+    mMapped = mFile.map(0, mFile.size());
+    if (mMapped == nullptr) {
+        return false;
+    }
+    const char *lStart = reinterpret_cast<const char *>(mMapped);
+    const char *lEnd = lStart + mFile.size();
+    NamesHeader lHeader;
+    memcpy(&lHeader, lStart, sizeof(lHeader));
+    if (0 != memcmp(lHeader.mMagic, cNamesMagic, sizeof(cNamesMagic)) || lHeader.mVersion != cNamesVersion) {
+        qCDebug(KUPFILEDIGGER) << "ignoring incompatible name index" << mPath;
+        return false;
+    }
+    mHistoryGeneration = lHeader.mHistoryGeneration;
+    const char *lData = lStart + sizeof(lHeader);
+    while (lEnd - lData >= static_cast<qptrdiff>(sizeof(NamesBlockHeader))) {
+        NamesBlockHeader lBlockHeader;
+        memcpy(&lBlockHeader, lData, sizeof(lBlockHeader));
+        const char *lPayload = lData + sizeof(lBlockHeader);
+        // a block only counts if the head at its end was written too
+        if (lBlockHeader.mMagic != cBlockMagic || lEnd - lPayload < static_cast<qptrdiff>(lBlockHeader.mSize) + GIT_OID_RAWSZ) {
+            break;
+        }
+        Block lBlock;
+        if (!parseBlock(lPayload, lBlockHeader.mSize, lBlock)) {
+            break;
+        }
+        memcpy(lBlock.mHead.id, lPayload + lBlockHeader.mSize, GIT_OID_RAWSZ);
+        mBlocks.append(lBlock);
+        lData = lPayload + lBlockHeader.mSize + GIT_OID_RAWSZ;
+    }
+    mValidSize = lData - lStart;
+    return !mBlocks.isEmpty();
+}
+
+bool NameIndex::parseBlock(const char *pData, quint32 pSize, Block &pBlock)
+{
+    if (pSize < sizeof(PayloadHeader)) {
+        return false;
+    }
+    PayloadHeader lHeader;
+    memcpy(&lHeader, pData, sizeof(lHeader));
+    const quint64 lExpectedSize = sizeof(PayloadHeader) + quint64(lHeader.mEntryCount) * sizeof(NameEntry)
+        + quint64(lHeader.mTrigramCount) * sizeof(TrigramEntry) + quint64(lHeader.mPostingCount) * sizeof(quint32) + lHeader.mNamesSize;
+    if (lExpectedSize != pSize) {
+        return false;
+    }
+    pBlock.mEntryCount = lHeader.mEntryCount;
+    pBlock.mTrigramCount = lHeader.mTrigramCount;
+    pBlock.mPostingCount = lHeader.mPostingCount;
+    pBlock.mNamesSize = lHeader.mNamesSize;
+    pBlock.mEntries = pData + sizeof(PayloadHeader);
+    pBlock.mTrigrams = pBlock.mEntries + quint64(lHeader.mEntryCount) * sizeof(NameEntry);
+    pBlock.mPostings = pBlock.mTrigrams + quint64(lHeader.mTrigramCount) * sizeof(TrigramEntry);
+    pBlock.mNames = pBlock.mPostings + quint64(lHeader.mPostingCount) * sizeof(quint32);
+    return true;
+}
+
+// How many blocks of pHistory are covered, -1 if this index does not belong to it.
+int NameIndex::indexedHistoryBlocks(const HistoryIndex &pHistory) const
+{
+    if (mBlocks.isEmpty() || mHistoryGeneration != pHistory.generation()) {
+        return -1;
+    }
+    for (int i = pHistory.blockCount() - 1; i >= 0; --i) {
+        if (git_oid_equal(pHistory.blockHead(i), &mBlocks.last().mHead)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+bool NameIndex::isCurrent(const HistoryIndex &pHistory) const
+{
+    return pHistory.blockCount() > 0 && indexedHistoryBlocks(pHistory) == pHistory.blockCount();
+}
+
+bool NameIndex::update(const HistoryIndex &pHistory)
+{
+    if (pHistory.blockCount() == 0 || !QDir().mkpath(QFileInfo(mPath).absolutePath())) {
+        return false;
+    }
+    QLockFile lLock(mPath + QStringLiteral(".lock"));
+    if (!lLock.tryLock(cLockTimeout)) {
+        qCWarning(KUPFILEDIGGER) << "name index is locked by another process" << mPath;
+        return false;
+    }
+    load();
+    const int lIndexed = indexedHistoryBlocks(pHistory);
+    if (lIndexed == pHistory.blockCount()) {
+        return true;
+    }
+    const qint64 lValidSize = mValidSize;
+    unload();
+    if (lIndexed < 0) {
+        // all of the history in one block, replaced so that a running file digger keeps its mapping.
+        NamesHeader lHeader;
+        memset(&lHeader, 0, sizeof(lHeader));
+        memcpy(lHeader.mMagic, cNamesMagic, sizeof(cNamesMagic));
+        lHeader.mVersion = cNamesVersion;
+        lHeader.mHistoryGeneration = pHistory.generation();
+        QSaveFile lFile(mPath);
+        if (!lFile.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        lFile.write(reinterpret_cast<const char *>(&lHeader), sizeof(lHeader));
+        lFile.write(buildBlock(pHistory, 0, pHistory.blockCount() - 1));
+        return lFile.commit();
+    }
+    const QByteArray lBlock = buildBlock(pHistory, lIndexed, pHistory.blockCount() - 1);
+    QFile lFile(mPath);
+    if (!lFile.open(QIODevice::ReadWrite)) {
+        return false;
+    }
+    if (lFile.size() != lValidSize && !lFile.resize(lValidSize)) {
+        return false;
+    }
+    lFile.seek(lValidSize);
+    return lFile.write(lBlock) == lBlock.size() && lFile.flush();
+}
+
+void NameIndex::search(const QString &pQuery, int pMaxMatches, QVector<NameMatch> &pMatches) const
+{
+    const QByteArray lQuery = pQuery.toLower().toUtf8();
+    if (lQuery.isEmpty()) {
+        return;
+    }
+    QVector<quint32> lQueryTrigrams;
+    for (int i = 0; i + 2 < lQuery.size(); ++i) {
+        lQueryTrigrams.append(trigramAt(lQuery, i));
+    }
+    std::sort(lQueryTrigrams.begin(), lQueryTrigrams.end());
+    lQueryTrigrams.erase(std::unique(lQueryTrigrams.begin(), lQueryTrigrams.end()), lQueryTrigrams.end());
+
+    QHash<QByteArray, int> lMatchIndexes; // parent folder and name
+    QVector<QPair<quint32, QByteArray>> lMatchNames;
+    QVector<NameMatch> lMatches;
+    for (const Block &lBlock : mBlocks) {
+        // candidates are the postings of the rarest trigram, checked against the others
+        QVector<TrigramEntry> lTrigrams;
+        bool lAllFound = true;
+        for (const quint32 lTrigram : std::as_const(lQueryTrigrams)) {
+            TrigramEntry lEntry;
+            if (!findTrigram(lBlock.mTrigrams, lBlock.mTrigramCount, lTrigram, lEntry)) {
+                lAllFound = false;
+                break;
+            }
+            lTrigrams.append(lEntry);
+        }
+        if (!lAllFound) {
+            continue;
+        }
+        std::sort(lTrigrams.begin(), lTrigrams.end(), [](const TrigramEntry &a, const TrigramEntry &b) {
+            return a.mPostingCount < b.mPostingCount;
+        });
+        // queries shorter than a trigram look at every name
+        const quint32 lCandidateCount = lTrigrams.isEmpty() ? lBlock.mEntryCount : lTrigrams.first().mPostingCount;
+        for (quint32 i = 0; i < lCandidateCount; ++i) {
+            const quint32 lEntryIndex = lTrigrams.isEmpty() ? i : readAt<quint32>(lBlock.mPostings, lTrigrams.first().mFirstPosting + i);
+            bool lHasAll = true;
+            for (int j = 1; j < lTrigrams.count() && lHasAll; ++j) {
+                lHasAll = hasPosting(lBlock.mPostings, lTrigrams.at(j), lEntryIndex);
+            }
+            if (!lHasAll || lEntryIndex >= lBlock.mEntryCount) {
+                continue;
+            }
+            const NameEntry lEntry = readAt<NameEntry>(lBlock.mEntries, lEntryIndex);
+            if (quint64(lEntry.mNameOffset) + lEntry.mNameSize > lBlock.mNamesSize) {
+                continue;
+            }
+            const QByteArray lName = QByteArray::fromRawData(lBlock.mNames + lEntry.mNameOffset, int(lEntry.mNameSize));
+            if (!foldedName(lName).contains(lQuery)) {
+                continue;
+            }
+            QByteArray lKey(reinterpret_cast<const char *>(&lEntry.mParentDir), sizeof(lEntry.mParentDir));
+            lKey.append(lName);
+            auto lIter = lMatchIndexes.constFind(lKey);
+            if (lIter != lMatchIndexes.constEnd()) {
+                lMatches[lIter.value()].mVersionCount += int(lEntry.mVersionCount);
+                lMatches[lIter.value()].mIsDirectory |= lEntry.mDirId != HistoryIndex::cNoDir;
+            } else if (lMatches.count() < pMaxMatches) {
+                lMatchIndexes.insert(lKey, lMatches.count());
+                lMatchNames.append(qMakePair(lEntry.mParentDir, lName));
+                lMatches.append(NameMatch{QString(), int(lEntry.mVersionCount), lEntry.mDirId != HistoryIndex::cNoDir});
+            }
+        }
+    }
+    for (int i = 0; i < lMatches.count(); ++i) {
+        lMatches[i].mPath = pathOf(lMatchNames.at(i).first, lMatchNames.at(i).second);
+    }
+    std::sort(lMatches.begin(), lMatches.end(), [](const NameMatch &a, const NameMatch &b) {
+        return a.mPath < b.mPath;
+    });
+    pMatches += lMatches;
+}
+
+QString NameIndex::pathOf(quint32 pParentDir, const QByteArray &pName) const
+{
+    if (mDirectories.isEmpty()) {
+        for (const Block &lBlock : mBlocks) {
+            for (quint32 i = 0; i < lBlock.mEntryCount; ++i) {
+                const NameEntry lEntry = readAt<NameEntry>(lBlock.mEntries, i);
+                if (lEntry.mDirId != HistoryIndex::cNoDir && quint64(lEntry.mNameOffset) + lEntry.mNameSize <= lBlock.mNamesSize) {
+                    mDirectories.insert(lEntry.mDirId,
+                                        qMakePair(lEntry.mParentDir, QByteArray::fromRawData(lBlock.mNames + lEntry.mNameOffset, int(lEntry.mNameSize))));
+                }
+            }
+        }
+    }
+    QStringList lComponents;
+    lComponents.prepend(QString::fromUtf8(pName));
+    quint32 lDirId = pParentDir;
+    for (int i = 0; lDirId != HistoryIndex::cRootDir && i < cMaxFolderDepth; ++i) {
+        auto lIter = mDirectories.constFind(lDirId);
+        if (lIter == mDirectories.constEnd()) {
+            break;
+        }
+        lComponents.prepend(QString::fromUtf8(lIter.value().second));
+        lDirId = lIter.value().first;
+    }
+    return lComponents.join(QLatin1Char('/'));
+}
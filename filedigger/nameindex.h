@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include <git2.h>
+
+class HistoryIndex;
+
+struct NameMatch {
+    QString mPath; // from the top of the branch, without a leading '/'
+    int mVersionCount;
+    bool mIsDirectory;
+};
+
+// Trigram index over the names of every path that ever existed on a branch, kept
+// next to the HistoryIndex it is built from. Each update of the history index gets
+// one block here with the names that got new versions in it, so updates only look
+// at the new part of the history. A search looks up the trigrams of the query in
+// each block and checks the names that have all of them.
+class NameIndex
+{
+public:
+    NameIndex(const QString &pRepositoryPath, const QString &pBranchName);
+    ~NameIndex();
+
+    bool load();
+    // True if the index is loaded and covers all of pHistory.
+    bool isCurrent(const HistoryIndex &pHistory) const;
+    // Adds the blocks of pHistory that are not indexed yet, pHistory must be loaded.
+    bool update(const HistoryIndex &pHistory);
+    // Case insensitive search for names containing pQuery, sorted by path.
+    void search(const QString &pQuery, int pMaxMatches, QVector<NameMatch> &pMatches) const;
+
+protected:
+    struct Block {
+        const char *mEntries;
+        const char *mTrigrams;
+        const char *mPostings;
+        const char *mNames;
+        quint32 mEntryCount;
+        quint32 mTrigramCount;
+        quint32 mPostingCount;
+        quint32 mNamesSize;
+        git_oid mHead;
+    };
+
+    void unload();
+    bool parseBlock(const char *pData, quint32 pSize, Block &pBlock);
+    int indexedHistoryBlocks(const HistoryIndex &pHistory) const;
+    QString pathOf(quint32 pParentDir, const QByteArray &pName) const;
+
+    QString mPath;
+    QFile mFile;
+    uchar *mMapped;
+    qint64 mValidSize;
+    quint32 mHistoryGeneration;
+    QVector<Block> mBlocks;
+    mutable QHash<quint32, QPair<quint32, QByteArray>> mDirectories; // built on first search
+};
+
+#endif // NAMEINDEX_H
@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "sizeloader.h"
+#include "bupodb.h"
+#include "kupfiledigger_debug.h"
+
+#include <QElapsedTimer>
+
+#include <utility>
+
+static const int cMaxBatchSize = 32; // sizes
+static const int cMaxBatchDelay = 100; // ms
+
+SizeLoader::SizeLoader(QString pRepositoryPath)
+    : mRepositoryPath(std::move(pRepositoryPath))
+    , mRepository(nullptr)
+{
+    qRegisterMetaType<LoadedSizeList>("LoadedSizeList");
+}
+
+SizeLoader::~SizeLoader()
+{
+    if (mRepository != nullptr) {
+        git_repository_free(mRepository);
+    }
+}
+
+void SizeLoader::load(quint64 pRequest, const SizeQueryList &pQueries)
+{
+    {
+        QMutexLocker lLocker(&mMutex);
+        mActiveRequests.insert(pRequest);
+    }
+    QMetaObject::invokeMethod(
+        this,
+        [this, pRequest, pQueries] {
+            run(pRequest, pQueries);
+        },
+        Qt::QueuedConnection);
+}
+
+void SizeLoader::cancel(quint64 pRequest)
+{
+    QMutexLocker lLocker(&mMutex);
+    mActiveRequests.remove(pRequest);
+}
+
+bool SizeLoader::isActive(quint64 pRequest)
+{
+    QMutexLocker lLocker(&mMutex);
+    return mActiveRequests.contains(pRequest);
+}
+
+void SizeLoader::run(quint64 pRequest, const SizeQueryList &pQueries)
+{
+    if (mRepository == nullptr && 0 != openBupRepository(&mRepository, mRepositoryPath)) {
+        qCWarning(KUPFILEDIGGER) << "size loader could not open repository " << mRepositoryPath;
+        mRepository = nullptr;
+        if (isActive(pRequest)) {
+            emit loadFailed(pRequest);
+        }
+        cancel(pRequest);
+        return;
+    }
+    LoadedSizeList lBatch;
+    QElapsedTimer lBatchTimer;
+    lBatchTimer.start();
+    for (const SizeQuery &lQuery : pQueries) {
+        if (!isActive(pRequest)) {
+            return;
+        }
+        lBatch.append(LoadedSize{lQuery.mRow, lQuery.mOid, loadVersionSize(&lQuery.mOid, lQuery.mChunkedFile, mRepository)});
+        if (lBatch.count() >= cMaxBatchSize || lBatchTimer.hasExpired(cMaxBatchDelay)) {
+            emit sizesLoaded(pRequest, lBatch);
+            lBatch.clear();
+            lBatchTimer.start();
+        }
+    }
+    if (!lBatch.isEmpty()) {
+        emit sizesLoaded(pRequest, lBatch);
+    }
+    cancel(pRequest);
+}
@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef SIZELOADER_H
+#define SIZELOADER_H
+
+#include "mergedvfs.h"
+
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+
+struct SizeQuery {
+    int mRow;
+    git_oid mOid;
+    bool mChunkedFile;
+};
+typedef QVector<SizeQuery> SizeQueryList;
+
+struct LoadedSize {
+    int mRow;
+    git_oid mOid;
+    quint64 mSize;
+};
+typedef QVector<LoadedSize> LoadedSizeList;
+
+Q_DECLARE_METATYPE(LoadedSize)
+
+// Calculates file sizes that were not stored in the metadata, on a background
+// thread with its own handle to the repository. Used like the TreeLoader.
+class SizeLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SizeLoader(QString pRepositoryPath);
+    ~SizeLoader() override;
+
+    // Can be called from any thread.
+    void load(quint64 pRequest, const SizeQueryList &pQueries);
+    // Can be called from any thread, sizes already sent may still arrive.
+    void cancel(quint64 pRequest);
+
+signals:
+    void sizesLoaded(quint64 pRequest, const LoadedSizeList &pSizes);
+    // The repository could not be opened, no sizes will arrive for pRequest.
+    void loadFailed(quint64 pRequest);
+
+protected:
+    void run(quint64 pRequest, const SizeQueryList &pQueries);
+    bool isActive(quint64 pRequest);
+
+    QString mRepositoryPath;
+    git_repository *mRepository;
+    QMutex mMutex;
+    QSet<quint64> mActiveRequests;
+};
+
+#endif // SIZELOADER_H
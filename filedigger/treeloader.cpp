@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "treeloader.h"
+#include "bupodb.h"
+#include "kupfiledigger_debug.h"
+#include "vfshelpers.h"
+
+#include <QElapsedTimer>
+
+#include <utility>
+
+static const int cMaxBatchSize = 16; // trees
+static const int cMaxBatchDelay = 100; // ms
+static const int cDefaultTreeCacheSize = 64 * 1024 * 1024;
+
+QMutex DecodedTreeCache::mMutex;
+QCache<QByteArray, QVector<DecodedEntry>> DecodedTreeCache::mCache(cDefaultTreeCacheSize);
+
+static QByteArray cacheKey(const git_oid *pTreeOid)
+{
+    return QByteArray(reinterpret_cast<const char *>(pTreeOid->id), GIT_OID_RAWSZ);
+}
+
+void DecodedTreeCache::setMaxSize(int pBytes)
+{
+    QMutexLocker lLocker(&mMutex);
+    mCache.setMaxCost(pBytes);
+}
+
+bool DecodedTreeCache::find(const git_oid *pTreeOid, QVector<DecodedEntry> &pEntries)
+{
+    QMutexLocker lLocker(&mMutex);
+    QVector<DecodedEntry> *lEntries = mCache.object(cacheKey(pTreeOid));
+    if (lEntries == nullptr) {
+        return false;
+    }
+    pEntries = *lEntries; // implicitly shared, no copy of the entries
+    return true;
+}
+
+void DecodedTreeCache::insert(const git_oid *pTreeOid, const QVector<DecodedEntry> &pEntries)
+{
+    int lCost = GIT_OID_RAWSZ + static_cast<int>(sizeof(QVector<DecodedEntry>));
+    for (const DecodedEntry &lEntry : pEntries) {
+        lCost += static_cast<int>(sizeof(DecodedEntry)) + lEntry.mName.size() * static_cast<int>(sizeof(QChar));
+    }
+    QMutexLocker lLocker(&mMutex);
+    mCache.insert(cacheKey(pTreeOid), new QVector<DecodedEntry>(pEntries), lCost);
+}
+
+TreeLoader::TreeLoader(QString pRepositoryPath)
+    : mRepositoryPath(std::move(pRepositoryPath))
+    , mRepository(nullptr)
+{
+    qRegisterMetaType<DecodedTreeList>("DecodedTreeList");
+}
+
+TreeLoader::~TreeLoader()
+{
+    if (mRepository != nullptr) {
+        git_repository_free(mRepository);
+    }
+}
+
+void TreeLoader::load(quint64 pRequest, const QVector<git_oid> &pTrees, int pFirstVersion)
+{
+    {
+        QMutexLocker lLocker(&mMutex);
+        mActiveRequests.insert(pRequest);
+    }
+    QMetaObject::invokeMethod(
+        this,
+        [this, pRequest, pTrees, pFirstVersion] {
+            run(pRequest, pTrees, pFirstVersion);
+        },
+        Qt::QueuedConnection);
+}
+
+void TreeLoader::cancel(quint64 pRequest)
+{
+    QMutexLocker lLocker(&mMutex);
+    mActiveRequests.remove(pRequest);
+}
+
+bool TreeLoader::isActive(quint64 pRequest)
+{
+    QMutexLocker lLocker(&mMutex);
+    return mActiveRequests.contains(pRequest);
+}
+
+void TreeLoader::run(quint64 pRequest, const QVector<git_oid> &pTrees, int pFirstVersion)
+{
+    if (mRepository == nullptr && 0 != openBupRepository(&mRepository, mRepositoryPath)) {
+        qCWarning(KUPFILEDIGGER) << "loader thread could not open repository " << mRepositoryPath;
+        mRepository = nullptr;
+    }
+    DecodedTreeList lBatch;
+    QElapsedTimer lBatchTimer;
+    lBatchTimer.start();
+    for (int i = 0; i < pTrees.count(); ++i) {
+        if (!isActive(pRequest)) {
+            return;
+        }
+        DecodedTree lTree;
+        lTree.mVersionIndex = pFirstVersion + i;
+        decodeTree(&pTrees.at(i), lTree);
+        lBatch.append(lTree);
+        if (lBatch.count() >= cMaxBatchSize || lBatchTimer.hasExpired(cMaxBatchDelay)) {
+            emit treesDecoded(pRequest, lBatch);
+            lBatch.clear();
+            lBatchTimer.start();
+        }
+    }
+    if (!lBatch.isEmpty()) {
+        emit treesDecoded(pRequest, lBatch);
+    }
+    if (isActive(pRequest)) {
+        cancel(pRequest);
+        emit loadFinished(pRequest);
+    }
+}
+
+void TreeLoader::decodeTree(const git_oid *pTreeOid, DecodedTree &pTree)
+{
+    if (DecodedTreeCache::find(pTreeOid, pTree.mEntries)) {
+        pTree.mValid = true;
+        return;
+    }
+    pTree.mValid = mRepository != nullptr && decodeBupTree(mRepository, pTreeOid, pTree.mEntries);
+    if (pTree.mValid) {
+        DecodedTreeCache::insert(pTreeOid, pTree.mEntries);
+    }
+}
+
+bool decodeBupTree(git_repository *pRepository, const git_oid *pTreeOid, QVector<DecodedEntry> &pEntries)
+{
+    git_tree *lTree;
+    if (0 != git_tree_lookup(&lTree, pRepository, pTreeOid)) {
+        return false;
+    }
+    git_blob *lMetadataBlob = nullptr;
+    VintStream *lMetadataStream = nullptr;
+    const git_tree_entry *lMetaDataTreeEntry = git_tree_entry_byname(lTree, ".bupm");
+    if (lMetaDataTreeEntry != nullptr && 0 == git_blob_lookup(&lMetadataBlob, pRepository, git_tree_entry_id(lMetaDataTreeEntry))) {
+        lMetadataStream = new VintStream(git_blob_rawcontent(lMetadataBlob), static_cast<int>(git_blob_rawsize(lMetadataBlob)));
+        Metadata lMetadata;
+        readMetadata(*lMetadataStream, lMetadata); // the first entry is metadata for the directory itself, discard it.
+    }
+
+    ulong lEntryCount = git_tree_entrycount(lTree);
+    pEntries.reserve(static_cast<int>(lEntryCount));
+    for (uint i = 0; i < lEntryCount; ++i) {
+        DecodedEntry lEntry;
+        const git_oid *lOid;
+        const git_tree_entry *lTreeEntry = git_tree_entry_byindex(lTree, i);
+        getEntryAttributes(lTreeEntry, lEntry.mMode, lEntry.mChunked, lOid, lEntry.mName);
+        if (lEntry.mName == QStringLiteral(".bupm")) {
+            continue;
+        }
+        lEntry.mOid = *lOid;
+        lEntry.mHaveMetadata = false;
+        lEntry.mModifiedDate = 0;
+        lEntry.mSize = -1;
+        if (!S_ISDIR(lEntry.mMode)) {
+            Metadata lMetadata(lEntry.mMode); // V2 records have no size, it must start out as invalid
+            if (lMetadataStream != nullptr && 0 == readMetadata(*lMetadataStream, lMetadata)) {
+                lEntry.mHaveMetadata = true;
+                lEntry.mModifiedDate = lMetadata.mMtime;
+                lEntry.mSize = lMetadata.mSize;
+            }
+        }
+        pEntries.append(lEntry);
+    }
+    if (lMetadataStream != nullptr) {
+        delete lMetadataStream;
+        git_blob_free(lMetadataBlob);
+    }
+    git_tree_free(lTree);
+    return true;
+}
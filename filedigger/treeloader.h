@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef TREELOADER_H
+#define TREELOADER_H
+
+#include "mergedvfs.h"
+
+#include <QCache>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+
+Q_DECLARE_METATYPE(DecodedTree)
+
+// Decoded trees by tree oid, shared by all loaders in the process. The same trees
+// show up in many snapshots, this way each one is only inflated and parsed once.
+// Least recently used trees are dropped when the cache grows beyond its byte budget.
+class DecodedTreeCache
+{
+public:
+    static void setMaxSize(int pBytes);
+    static bool find(const git_oid *pTreeOid, QVector<DecodedEntry> &pEntries);
+    static void insert(const git_oid *pTreeOid, const QVector<DecodedEntry> &pEntries);
+
+protected:
+    static QMutex mMutex;
+    static QCache<QByteArray, QVector<DecodedEntry>> mCache;
+};
+
+// Looks up and decodes bup trees on a background thread, it lives in its own
+// thread and has its own handle to the repository since libgit2 objects can't be
+// shared between threads. Decoded trees are sent back in small batches so that
+// the GUI can show sub nodes while the rest of the versions are still loading.
+class TreeLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TreeLoader(QString pRepositoryPath);
+    ~TreeLoader() override;
+
+    // Can be called from any thread. pFirstVersion is the version index of the first tree.
+    void load(quint64 pRequest, const QVector<git_oid> &pTrees, int pFirstVersion);
+    // Can be called from any thread, trees already sent may still arrive.
+    void cancel(quint64 pRequest);
+
+signals:
+    void treesDecoded(quint64 pRequest, const DecodedTreeList &pTrees);
+    void loadFinished(quint64 pRequest);
+
+protected:
+    void run(quint64 pRequest, const QVector<git_oid> &pTrees, int pFirstVersion);
+    bool isActive(quint64 pRequest);
+    void decodeTree(const git_oid *pTreeOid, DecodedTree &pTree);
+
+    QString mRepositoryPath;
+    git_repository *mRepository;
+    QMutex mMutex;
+    QSet<quint64> mActiveRequests;
+};
+
+// Reads the entries of a bup tree and the metadata of its files from the .bupm blob.
+bool decodeBupTree(git_repository *pRepository, const git_oid *pTreeOid, QVector<DecodedEntry> &pEntries);
+
+#endif // TREELOADER_H
@@ -5,7 +5,6 @@
 #include "versionlistdelegate.h"
 #include "versionlistmodel.h"
 
-#include <KFormat>
 #include <KLocalizedString>
 
 #include <QAbstractItemModel>
@@ -190,7 +189,7 @@ void VersionListDelegate::paint(QPainter *pPainter, const QStyleOptionViewItem &
 
     QRect lSizeDisplayBounds;
     if (!pIndex.data(VersionIsDirectoryRole).toBool()) {
-        QString lSizeText = KFormat().formatByteSize(static_cast<double>(pIndex.data(VersionSizeRole).toULongLong()));
+        QString lSizeText = pIndex.data(VersionSizeTextRole).toString();
         pPainter->drawText(lMarginRect, Qt::AlignRight | Qt::AlignTop, lSizeText, &lSizeDisplayBounds);
     }
     QString lDateText = pOption.fontMetrics.elidedText(pIndex.data().toString(), Qt::ElideRight, lMarginRect.width() - lSizeDisplayBounds.width());
@@ -4,7 +4,6 @@
 
 #include "versionlistmodel.h"
 
-#include <KFormat>
 #include <KLocalizedString>
 
 #include <QDateTime>
@@ -12,52 +11,115 @@
 #include <QMimeDatabase>
 #include <QMimeType>
 
-VersionListModel::VersionListModel(QObject *parent)
+VersionListModel::VersionListModel(const QString &pRepositoryPath, QObject *parent)
     : QAbstractListModel(parent)
+    , mLoader(new SizeLoader(pRepositoryPath))
+    , mSizeRequest(0)
 {
-    mVersionList = nullptr;
+    mLoader->moveToThread(&mLoaderThread);
+    connect(mLoader, &SizeLoader::sizesLoaded, this, &VersionListModel::setSizes);
+    connect(mLoader, &SizeLoader::loadFailed, this, &VersionListModel::clearSizePlaceholders);
+    mLoaderThread.start();
 }
 
-void VersionListModel::setNode(const MergedNode *pNode)
+VersionListModel::~VersionListModel()
 {
+    mLoader->cancel(mSizeRequest);
+    mLoaderThread.quit();
+    mLoaderThread.wait();
+    delete mLoader;
+}
+
+void VersionListModel::setNode(MergedNode *pNode)
+{
+    mLoader->cancel(mSizeRequest);
     beginResetModel();
     mNode = pNode;
-    mVersionList = mNode->versionList();
+    const VersionSpan lVersions = mNode->versionList();
+    mVersionList = VersionList(lVersions.begin(), lVersions.end());
+    mSizesFailed = false;
+    if (mNode->isDirectory()) {
+        mMimeType = QStringLiteral("inode/directory");
+    } else {
+        QMimeDatabase db;
+        mMimeType = db.mimeTypeForFile(mNode->name(), QMimeDatabase::MatchExtension).name();
+    }
+    mDateTexts.fill(QString(), mVersionList.count());
+    mSizeTexts.fill(QString(), mVersionList.count());
     endResetModel();
+
+    if (mNode->isDirectory()) {
+        return;
+    }
+    SizeQueryList lQueries;
+    for (int i = 0; i < mVersionList.count(); ++i) {
+        const VersionData &lData = mVersionList.at(i);
+        if (!lData.mSizeIsValid) {
+            lQueries.append(SizeQuery{i, lData.mOid, lData.mChunkedFile});
+        }
+    }
+    if (!lQueries.isEmpty()) {
+        mLoader->load(++mSizeRequest, lQueries);
+    }
+}
+
+void VersionListModel::setSizes(quint64 pRequest, const LoadedSizeList &pSizes)
+{
+    if (pRequest != mSizeRequest || mNode == nullptr) {
+        return;
+    }
+    for (const LoadedSize &lSize : pSizes) {
+        if (lSize.mRow >= mVersionList.count() || !git_oid_equal(&mVersionList.at(lSize.mRow).mOid, &lSize.mOid)) {
+            continue;
+        }
+        mVersionList[lSize.mRow].setSize(lSize.mSize);
+        mNode->setVersionSize(lSize.mRow, &lSize.mOid, lSize.mSize); // no need to load it again next time
+        mSizeTexts[lSize.mRow].clear();
+        const QModelIndex lIndex = index(lSize.mRow);
+        emit dataChanged(lIndex, lIndex, {VersionSizeRole, VersionSizeTextRole});
+    }
+}
+
+void VersionListModel::clearSizePlaceholders(quint64 pRequest)
+{
+    if (pRequest != mSizeRequest || mVersionList.isEmpty()) {
+        return;
+    }
+    mSizesFailed = true;
+    emit dataChanged(index(0), index(mVersionList.count() - 1), {VersionSizeTextRole});
 }
 
 int VersionListModel::rowCount(const QModelIndex &pParent) const
 {
     Q_UNUSED(pParent)
-    if (mVersionList != nullptr) {
-        return mVersionList->count();
-    }
-    return 0;
+    return mVersionList.count();
 }
 
 QVariant VersionListModel::data(const QModelIndex &pIndex, int pRole) const
 {
-    if (!pIndex.isValid() || mVersionList == nullptr) {
+    if (!pIndex.isValid() || pIndex.row() >= mVersionList.count()) {
         return QVariant();
     }
-    QMimeDatabase db;
-    KFormat lFormat;
-    VersionData *lData = mVersionList->at(pIndex.row());
+    const int lRow = pIndex.row();
+    const VersionData &lData = mVersionList.at(lRow);
     switch (pRole) {
     case Qt::DisplayRole:
-        return lFormat.formatRelativeDateTime(QDateTime::fromSecsSinceEpoch(static_cast<qint64>(lData->mModifiedDate)), QLocale::ShortFormat);
+        if (mDateTexts.at(lRow).isNull()) {
+            mDateTexts[lRow] = mFormat.formatRelativeDateTime(QDateTime::fromSecsSinceEpoch(static_cast<qint64>(lData.mModifiedDate)), QLocale::ShortFormat);
+        }
+        return mDateTexts.at(lRow);
     case VersionBupUrlRole: {
         QUrl lUrl;
         mNode->getBupUrl(pIndex.row(), &lUrl);
         return lUrl;
     }
     case VersionMimeTypeRole:
-        if (mNode->isDirectory()) {
-            return QString(QStringLiteral("inode/directory"));
-        }
-        return db.mimeTypeForFile(mNode->objectName(), QMimeDatabase::MatchExtension).name();
+        return mMimeType;
     case VersionSizeRole:
-        return lData->size();
+        if (!lData.mSizeIsValid) {
+            return QVariant();
+        }
+        return lData.size();
     case VersionSourceInfoRole: {
         BupSourceInfo lSourceInfo;
         mNode->getBupUrl(pIndex.row(),
@@ -67,11 +129,22 @@ QVariant VersionListModel::data(const QModelIndex &pIndex, int pRole) const
                          &lSourceInfo.mCommitTime,
                          &lSourceInfo.mPathInRepo);
         lSourceInfo.mIsDirectory = mNode->isDirectory();
-        lSourceInfo.mSize = lData->size();
+        lSourceInfo.mSize = lData.size();
         return QVariant::fromValue<BupSourceInfo>(lSourceInfo);
     }
     case VersionIsDirectoryRole:
         return mNode->isDirectory();
+    case VersionSizeTextRole:
+        if (!lData.mSizeIsValid) {
+            if (mSizesFailed) {
+                return xi18nc("@label size of a file that could not be calculated", "unknown");
+            }
+            return xi18nc("@label placeholder while the size of a file is calculated", "…");
+        }
+        if (mSizeTexts.at(lRow).isNull()) {
+            mSizeTexts[lRow] = mFormat.formatByteSize(static_cast<double>(lData.size()));
+        }
+        return mSizeTexts.at(lRow);
     default:
         return QVariant();
     }
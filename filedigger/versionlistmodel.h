@@ -6,7 +6,11 @@
 #define VERSIONLISTMODEL_H
 
 #include "mergedvfs.h"
+#include "sizeloader.h"
+#include <KFormat>
+
 #include <QAbstractListModel>
+#include <QThread>
 
 struct BupSourceInfo {
     QUrl mBupKioPath;
@@ -24,22 +28,40 @@ class VersionListModel : public QAbstractListModel
 {
     Q_OBJECT
 public:
-    explicit VersionListModel(QObject *parent = nullptr);
-    void setNode(const MergedNode *pNode);
+    explicit VersionListModel(const QString &pRepositoryPath, QObject *parent = nullptr);
+    ~VersionListModel() override;
+    // Sizes that are not known yet are loaded in the background, VersionSizeRole
+    // is invalid until dataChanged() is emitted for the row. The versions of pNode
+    // are copied, call again to show versions merged later.
+    void setNode(MergedNode *pNode);
     int rowCount(const QModelIndex &pParent) const override;
     QVariant data(const QModelIndex &pIndex, int pRole) const override;
 
+protected slots:
+    void setSizes(quint64 pRequest, const LoadedSizeList &pSizes);
+    void clearSizePlaceholders(quint64 pRequest);
+
 protected:
-    const VersionList *mVersionList;
-    const MergedNode *mNode{};
+    VersionList mVersionList;
+    MergedNode *mNode{};
+    bool mSizesFailed{};
+    // display texts are formatted when first asked for, mime type once per node
+    QString mMimeType;
+    mutable QVector<QString> mDateTexts;
+    mutable QVector<QString> mSizeTexts;
+    KFormat mFormat;
+    QThread mLoaderThread;
+    SizeLoader *mLoader;
+    quint64 mSizeRequest;
 };
 
 enum VersionDataRole {
     VersionBupUrlRole = Qt::UserRole + 1, // QUrl
     VersionMimeTypeRole, // QString
-    VersionSizeRole, // quint64
+    VersionSizeRole, // quint64, invalid while loading
     VersionSourceInfoRole, // PathInfo
-    VersionIsDirectoryRole // bool
+    VersionIsDirectoryRole, // bool
+    VersionSizeTextRole // QString, a placeholder while the size is loading
 };
 
 #endif // VERSIONLISTMODEL_H
@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "vfshelpers.h"
+
+#include <QTest>
+
+#include <sys/stat.h>
+
+static const int cEntryCount = 10000;
+static const quint64 cRecordCommonV1 = 2;
+static const quint64 cRecordSymlinkTarget = 3;
+static const quint64 cRecordCommonV2 = 9;
+static const quint64 cRecordCommonV3 = 10;
+
+static void appendUint(QByteArray &pData, quint64 pValue)
+{
+    do {
+        auto c = static_cast<uchar>(pValue & 0x7F);
+        pValue >>= 7;
+        if (pValue != 0) {
+            c |= 0x80;
+        }
+        pData.append(static_cast<char>(c));
+    } while (pValue != 0);
+}
+
+static void appendInt(QByteArray &pData, qint64 pValue)
+{
+    quint64 lValue = pValue < 0 ? static_cast<quint64>(-pValue) : static_cast<quint64>(pValue);
+    auto c = static_cast<uchar>(lValue & 0x3F);
+    if (pValue < 0) {
+        c |= 0x40;
+    }
+    lValue >>= 6;
+    if (lValue != 0) {
+        c |= 0x80;
+    }
+    pData.append(static_cast<char>(c));
+    if (lValue != 0) {
+        appendUint(pData, lValue);
+    }
+}
+
+static void appendBytes(QByteArray &pData, const QByteArray &pBytes)
+{
+    appendUint(pData, static_cast<quint64>(pBytes.size()));
+    pData.append(pBytes);
+}
+
+// One .bupm entry in the layout bup writes, with user and group names and an
+// unknown record that the decoder has to skip.
+static QByteArray bupmEntry(quint64 pVersion, int pIndex)
+{
+    const qint64 lMode = (pIndex % 10 == 0 ? 0120777 : DEFAULT_MODE_FILE);
+    QByteArray lRecord;
+    if (pVersion == cRecordCommonV1) {
+        appendUint(lRecord, static_cast<quint64>(lMode));
+        appendUint(lRecord, 1000);
+        appendBytes(lRecord, "user");
+        appendUint(lRecord, 100);
+        appendBytes(lRecord, "users");
+    } else {
+        appendInt(lRecord, lMode);
+        appendInt(lRecord, 1000);
+        appendBytes(lRecord, "user");
+        appendInt(lRecord, 100);
+        appendBytes(lRecord, "users");
+    }
+    appendInt(lRecord, 0); // device
+    appendInt(lRecord, 1600000000 + pIndex); // access time
+    appendInt(lRecord, 123456789);
+    appendInt(lRecord, 1500000000 + pIndex); // modification time
+    appendInt(lRecord, 987654321);
+    if (pVersion == cRecordCommonV3) {
+        appendInt(lRecord, 1500000000); // status change time
+        appendInt(lRecord, 0);
+        appendInt(lRecord, 4096 + pIndex); // size
+    }
+
+    QByteArray lEntry;
+    appendUint(lEntry, pVersion);
+    appendBytes(lEntry, lRecord);
+    if (S_ISLNK(lMode)) {
+        appendUint(lEntry, cRecordSymlinkTarget);
+        appendBytes(lEntry, "../target");
+    }
+    appendUint(lEntry, 6); // linux attributes, not decoded
+    appendBytes(lEntry, QByteArray(4, '\0'));
+    appendUint(lEntry, 0);
+    return lEntry;
+}
+
+class BupmDecodeBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void decode_data()
+    {
+        QTest::addColumn<quint64>("version");
+        QTest::newRow("V1") << cRecordCommonV1;
+        QTest::newRow("V2") << cRecordCommonV2;
+        QTest::newRow("V3") << cRecordCommonV3;
+    }
+
+    void decode()
+    {
+        QFETCH(quint64, version);
+        QByteArray lData;
+        for (int i = 0; i < cEntryCount; ++i) {
+            lData.append(bupmEntry(version, i));
+        }
+
+        QVector<Metadata> lDecoded(cEntryCount, Metadata(0));
+        QBENCHMARK {
+            VintStream lStream(lData.constData(), lData.size());
+            int lCount = 0;
+            while (!lStream.atEnd() && lCount < cEntryCount) {
+                QCOMPARE(readMetadata(lStream, lDecoded[lCount]), 0);
+                ++lCount;
+            }
+            QCOMPARE(lCount, cEntryCount);
+            QVERIFY(lStream.atEnd());
+        }
+
+        for (int i = 0; i < cEntryCount; i += 997) {
+            const Metadata &lMetadata = lDecoded.at(i);
+            QCOMPARE(lMetadata.mUid, qint64(1000));
+            QCOMPARE(lMetadata.mGid, qint64(100));
+            QCOMPARE(lMetadata.mAtime, qint64(1600000000 + i));
+            QCOMPARE(lMetadata.mMtime, qint64(1500000000 + i));
+            QCOMPARE(static_cast<bool>(S_ISLNK(lMetadata.mMode)), i % 10 == 0);
+            QCOMPARE(lMetadata.mSymlinkTarget, i % 10 == 0 ? QStringLiteral("../target") : QString());
+            if (version == cRecordCommonV3) {
+                QCOMPARE(lMetadata.mSize, qint64(4096 + i));
+            }
+        }
+    }
+
+    void truncated()
+    {
+        const QByteArray lEntry = bupmEntry(cRecordCommonV3, 0);
+        for (int i = 0; i < lEntry.size(); ++i) {
+            VintStream lStream(lEntry.constData(), i);
+            Metadata lMetadata(0);
+            QCOMPARE(readMetadata(lStream, lMetadata), 1);
+        }
+    }
+};
+
+QTEST_GUILESS_MAIN(BupmDecodeBenchmark)
+
+#include "bupmdecodebenchmark.moc"
@@ -0,0 +1,219 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "bupodb.h"
+
+#include <QDir>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+#include <QtEndian>
+
+#include <git2.h>
+#include <git2/sys/mempack.h>
+#include <git2/sys/odb_backend.h>
+
+#include <algorithm>
+#include <random>
+
+static const int cPackCount = 2000;
+static const int cObjectsPerPack = 8;
+static const int cLookupCount = 200;
+static const quint32 cMidxBits = 12;
+static const quint16 cBloomBits = 20;
+static const quint16 cBloomK = 5;
+
+struct PackedObject {
+    git_oid mOid;
+    quint32 mPack; // index into the idx names
+};
+
+static QByteArray bigEndian32(quint32 pValue)
+{
+    QByteArray lData(4, '\0');
+    qToBigEndian(pValue, lData.data());
+    return lData;
+}
+
+// Same bit addressing as BloomFilter::mayContain() for k=5, four bytes of the id per probe.
+static void addToBloom(QByteArray &pTable, const git_oid *pOid)
+{
+    for (int i = 0; i + 4 <= GIT_OID_RAWSZ; i += 4) {
+        const quint64 lRaw = qFromBigEndian<quint32>(pOid->id + i);
+        const quint64 lAddress = (lRaw >> (32 - cBloomBits)) & ((quint64(1) << cBloomBits) - 1);
+        const int lBit = int(lRaw >> (32 - 3 - cBloomBits)) & 7;
+        pTable[int(lAddress)] = char(pTable.at(int(lAddress)) | (1 << lBit));
+    }
+}
+
+static int collectOid(const git_oid *pOid, void *pPayload)
+{
+    static_cast<QVector<git_oid> *>(pPayload)->append(*pOid);
+    return 0;
+}
+
+// Object lookups in a repository with cPackCount packs, through libgit2's own pack
+// backend and through the bup backend with a midx and bloom filter over all packs.
+class BupOdbBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        git_libgit2_init();
+        QVERIFY(mRepositoryDir.isValid());
+        git_repository *lRepository;
+        QCOMPARE(git_repository_init(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData(), 1), 0);
+        const QByteArray lPackDir = QFile::encodeName(mRepositoryDir.path()) + "/objects/pack";
+
+        // objects are kept in memory until packed, nothing is written loose.
+        git_odb *lOdb;
+        git_odb_backend *lMemPack;
+        QCOMPARE(git_repository_odb(&lOdb, lRepository), 0);
+        QCOMPARE(git_mempack_new(&lMemPack), 0);
+        QCOMPARE(git_odb_add_backend(lOdb, lMemPack, 1000), 0);
+        for (int lPack = 0; lPack < cPackCount; ++lPack) {
+            git_packbuilder *lBuilder;
+            QCOMPARE(git_packbuilder_new(&lBuilder, lRepository), 0);
+            for (int i = 0; i < cObjectsPerPack; ++i) {
+                const QByteArray lContent = "pack " + QByteArray::number(lPack) + " object " + QByteArray::number(i);
+                git_oid lOid;
+                QCOMPARE(git_blob_create_from_buffer(&lOid, lRepository, lContent.constData(), size_t(lContent.size())), 0);
+                QCOMPARE(git_packbuilder_insert(lBuilder, &lOid, nullptr), 0);
+            }
+            QCOMPARE(git_packbuilder_write(lBuilder, lPackDir.constData(), 0, nullptr, nullptr), 0);
+            git_packbuilder_free(lBuilder);
+            QCOMPARE(git_mempack_reset(lMemPack), 0);
+        }
+        git_odb_free(lOdb);
+        git_repository_free(lRepository);
+
+        // which objects ended up in which pack
+        QVector<PackedObject> lObjects;
+        QByteArray lIdxNames;
+        const QStringList lIdxFiles = QDir(QFile::decodeName(lPackDir)).entryList(QStringList() << QStringLiteral("*.idx"), QDir::Files);
+        QCOMPARE(lIdxFiles.count(), cPackCount);
+        for (int lPack = 0; lPack < lIdxFiles.count(); ++lPack) {
+            const QByteArray lIdxName = QFile::encodeName(lIdxFiles.at(lPack));
+            git_odb_backend *lBackend;
+            QCOMPARE(git_odb_backend_one_pack(&lBackend, (lPackDir + '/' + lIdxName).constData()), 0);
+            QVector<git_oid> lOids;
+            auto lForeach = lBackend->foreach; // foreach is also a Qt macro
+            QCOMPARE(lForeach(lBackend, collectOid, &lOids), 0);
+            lBackend->free(lBackend);
+            for (const git_oid &lOid : std::as_const(lOids)) {
+                lObjects.append(PackedObject{lOid, quint32(lPack)});
+                mPresent.append(lOid);
+            }
+            lIdxNames.append(lIdxName);
+            lIdxNames.append('\0');
+        }
+        std::sort(lObjects.begin(), lObjects.end(), [](const PackedObject &pFirst, const PackedObject &pSecond) {
+            return git_oid_cmp(&pFirst.mOid, &pSecond.mOid) < 0;
+        });
+        QVERIFY(writeMidx(lPackDir + "/all.midx", lObjects, lIdxNames));
+        QVERIFY(writeBloom(lPackDir + "/bup.bloom", lObjects, lIdxNames));
+
+        std::shuffle(mPresent.begin(), mPresent.end(), std::mt19937(42));
+        mPresent.resize(cLookupCount);
+        for (int i = 0; i < cLookupCount; ++i) {
+            const QByteArray lContent = "missing " + QByteArray::number(i);
+            git_oid lOid;
+            QCOMPARE(git_odb_hash(&lOid, lContent.constData(), size_t(lContent.size()), GIT_OBJECT_BLOB), 0);
+            mMissing.append(lOid);
+        }
+    }
+
+    void cleanupTestCase()
+    {
+        git_libgit2_shutdown();
+    }
+
+    void readHeader_data()
+    {
+        QTest::addColumn<bool>("bupBackend");
+        QTest::addColumn<bool>("missing");
+        QTest::newRow("default, present") << false << false;
+        QTest::newRow("default, missing") << false << true;
+        QTest::newRow("midx and bloom, present") << true << false;
+        QTest::newRow("midx and bloom, missing") << true << true;
+    }
+
+    void readHeader()
+    {
+        QFETCH(bool, bupBackend);
+        QFETCH(bool, missing);
+        git_repository *lRepository;
+        if (bupBackend) {
+            QCOMPARE(openBupRepository(&lRepository, mRepositoryDir.path()), 0);
+        } else {
+            QCOMPARE(git_repository_open(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData()), 0);
+        }
+        git_odb *lOdb;
+        QCOMPARE(git_repository_odb(&lOdb, lRepository), 0);
+        const QVector<git_oid> &lOids = missing ? mMissing : mPresent;
+        const int lExpected = missing ? int(GIT_ENOTFOUND) : 0;
+        QBENCHMARK {
+            for (const git_oid &lOid : lOids) {
+                size_t lSize;
+                git_object_t lType;
+                QCOMPARE(git_odb_read_header(&lSize, &lType, lOdb, &lOid), lExpected);
+            }
+        }
+        git_odb_free(lOdb);
+        git_repository_free(lRepository);
+    }
+
+private:
+    // Version 4 midx as written by "bup midx".
+    bool writeMidx(const QByteArray &pPath, const QVector<PackedObject> &pObjects, const QByteArray &pIdxNames)
+    {
+        QByteArray lData("MIDX");
+        lData.append(bigEndian32(4));
+        lData.append(bigEndian32(cMidxBits));
+        quint32 lCount = 0;
+        for (quint32 lBucket = 0; lBucket < (quint32(1) << cMidxBits); ++lBucket) {
+            while (int(lCount) < pObjects.count() && qFromBigEndian<quint32>(pObjects.at(int(lCount)).mOid.id) >> (32 - cMidxBits) <= lBucket) {
+                ++lCount;
+            }
+            lData.append(bigEndian32(lCount));
+        }
+        for (const PackedObject &lObject : pObjects) {
+            lData.append(reinterpret_cast<const char *>(lObject.mOid.id), GIT_OID_RAWSZ);
+        }
+        for (const PackedObject &lObject : pObjects) {
+            lData.append(bigEndian32(lObject.mPack));
+        }
+        lData.append(pIdxNames);
+        QFile lFile(QFile::decodeName(pPath));
+        return lFile.open(QIODevice::WriteOnly) && lFile.write(lData) == lData.size();
+    }
+
+    bool writeBloom(const QByteArray &pPath, const QVector<PackedObject> &pObjects, const QByteArray &pIdxNames)
+    {
+        QByteArray lData("BLOM");
+        lData.append(bigEndian32(2));
+        QByteArray lSizes(4, '\0');
+        qToBigEndian(cBloomBits, lSizes.data());
+        qToBigEndian(cBloomK, lSizes.data() + 2);
+        lData.append(lSizes);
+        lData.append(bigEndian32(quint32(pObjects.count())));
+        QByteArray lTable(1 << cBloomBits, '\0');
+        for (const PackedObject &lObject : pObjects) {
+            addToBloom(lTable, &lObject.mOid);
+        }
+        lData.append(lTable);
+        lData.append(pIdxNames);
+        QFile lFile(QFile::decodeName(pPath));
+        return lFile.open(QIODevice::WriteOnly) && lFile.write(lData) == lData.size();
+    }
+
+    QTemporaryDir mRepositoryDir;
+    QVector<git_oid> mPresent;
+    QVector<git_oid> mMissing;
+};
+
+QTEST_GUILESS_MAIN(BupOdbBenchmark)
+
+#include "bupodbbenchmark.moc"
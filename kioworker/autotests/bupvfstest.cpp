@@ -0,0 +1,120 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "bupvfs.h"
+
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <git2.h>
+
+static const qint64 cFirstCommitTime = 1600000000;
+
+class BupVfsTest : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        QStandardPaths::setTestModeEnabled(true); // keep the metadata index out of the real cache
+        git_libgit2_init();
+        QVERIFY(mRepositoryDir.isValid());
+        git_repository *lRepository;
+        QCOMPARE(git_repository_init(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData(), 1), 0);
+        git_repository_free(lRepository);
+        QVERIFY(addSnapshot(0));
+        QVERIFY(addSnapshot(1));
+    }
+
+    void cleanupTestCase()
+    {
+        git_libgit2_shutdown();
+    }
+
+    // A snapshot first reached through "latest" must still show up in the next listing.
+    void latestThenList()
+    {
+        Repository lRepository(nullptr, mRepositoryDir.path());
+        QVERIFY(lRepository.isValid());
+        auto lBranch = dynamic_cast<Branch *>(lRepository.resolve(QStringLiteral("kup")));
+        QVERIFY(lBranch != nullptr);
+        QCOMPARE(lBranch->subNodes().count(), 2);
+
+        QVERIFY(addSnapshot(2));
+        Node *lLatest = lBranch->resolve(QStringLiteral("latest"));
+        QVERIFY(lLatest != nullptr);
+        QCOMPARE(lLatest->objectName(), vfsTimeToString(cFirstCommitTime + 2 * 3600));
+        QCOMPARE(lLatest->mMtime, cFirstCommitTime + 2 * 3600);
+
+        lBranch->reload();
+        const NodeList &lSnapshots = lBranch->subNodes();
+        QCOMPARE(lSnapshots.count(), 3);
+        QVERIFY(lSnapshots.contains(lLatest));
+        QCOMPARE(lBranch->resolve(lLatest->objectName()), lLatest);
+    }
+
+    // Nodes dropped after a tar export are generated again, released content is read again.
+    void dropAndRelease()
+    {
+        Repository lRepository(nullptr, mRepositoryDir.path());
+        QVERIFY(lRepository.isValid());
+        auto lSnapshot = dynamic_cast<ArchivedDirectory *>(lRepository.resolve(QStringLiteral("kup/latest")));
+        QVERIFY(lSnapshot != nullptr);
+        auto lFile = dynamic_cast<File *>(lSnapshot->subNode(QStringLiteral("file")));
+        QVERIFY(lFile != nullptr);
+        QByteArray lData;
+        QCOMPARE(lFile->read(lData), 0);
+        lFile->releaseContent();
+        QCOMPARE(lFile->seek(0), 0);
+        QCOMPARE(lFile->read(lData), 0);
+        QCOMPARE(lData, QByteArray("2"));
+
+        const quint64 lBytes = lRepository.memoryUsage();
+        lSnapshot->dropSubNodes();
+        QVERIFY(lRepository.memoryUsage() < lBytes);
+        QCOMPARE(lSnapshot->subNodes().count(), 1);
+        QCOMPARE(lSnapshot->subNodes().first()->objectName(), QStringLiteral("file"));
+    }
+
+private:
+    bool addSnapshot(int pIndex)
+    {
+        git_repository *lRepository;
+        if (0 != git_repository_open(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData())) {
+            return false;
+        }
+        git_oid lBlob, lTreeOid, lCommitOid;
+        git_treebuilder *lBuilder = nullptr;
+        git_tree *lTree = nullptr;
+        git_signature *lSignature = nullptr;
+        git_commit *lParent = nullptr;
+        git_oid lParentOid;
+        const bool lHaveParent = 0 == git_reference_name_to_id(&lParentOid, lRepository, "refs/heads/kup");
+        const QByteArray lContent = QByteArray::number(pIndex);
+        bool lOk = 0 == git_blob_create_from_buffer(&lBlob, lRepository, lContent.constData(), static_cast<size_t>(lContent.size()))
+            && 0 == git_treebuilder_new(&lBuilder, lRepository, nullptr)
+            && 0 == git_treebuilder_insert(nullptr, lBuilder, "file", &lBlob, GIT_FILEMODE_BLOB) && 0 == git_treebuilder_write(&lTreeOid, lBuilder)
+            && 0 == git_tree_lookup(&lTree, lRepository, &lTreeOid)
+            && 0 == git_signature_new(&lSignature, "kup", "kup@localhost", cFirstCommitTime + pIndex * 3600, 0)
+            && (!lHaveParent || 0 == git_commit_lookup(&lParent, lRepository, &lParentOid));
+        if (lOk) {
+            const git_commit *lParents[] = {lParent};
+            lOk = 0
+                == git_commit_create(&lCommitOid, lRepository, "refs/heads/kup", lSignature, lSignature, nullptr, "snapshot", lTree, lHaveParent ? 1 : 0, lParents);
+        }
+        git_commit_free(lParent);
+        git_signature_free(lSignature);
+        git_tree_free(lTree);
+        git_treebuilder_free(lBuilder);
+        git_repository_free(lRepository);
+        return lOk;
+    }
+
+    QTemporaryDir mRepositoryDir;
+};
+
+QTEST_GUILESS_MAIN(BupVfsTest)
+
+#include "bupvfstest.moc"
@@ -0,0 +1,100 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "bupvfs.h"
+
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <git2.h>
+
+static const int cSnapshotCount = 4;
+static const int cFolderCount = 250;
+static const int cFileCount = 1000; // per folder, 1M entries over all snapshots
+
+// Builds a repository with cSnapshotCount snapshots of the same cFolderCount folders
+// and lists all of them, the names repeat in every snapshot like they do in backups.
+class NodeArenaBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        QStandardPaths::setTestModeEnabled(true); // keep the metadata index out of the real cache
+        git_libgit2_init();
+        QVERIFY(mRepositoryDir.isValid());
+        git_repository *lRepository;
+        QCOMPARE(git_repository_init(&lRepository, QFile::encodeName(mRepositoryDir.path()).constData(), 1), 0);
+        git_oid lBlob;
+        QCOMPARE(git_blob_create_from_buffer(&lBlob, lRepository, "kup", 3), 0);
+
+        git_treebuilder *lBuilder;
+        QCOMPARE(git_treebuilder_new(&lBuilder, lRepository, nullptr), 0);
+        for (int i = 0; i < cFileCount; ++i) {
+            const QByteArray lName = QByteArray("file") + QByteArray::number(i).rightJustified(4, '0') + ".txt";
+            QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, lName.constData(), &lBlob, GIT_FILEMODE_BLOB), 0);
+        }
+        git_oid lFolder;
+        QCOMPARE(git_treebuilder_write(&lFolder, lBuilder), 0);
+        git_treebuilder_clear(lBuilder);
+        for (int i = 0; i < cFolderCount; ++i) {
+            const QByteArray lName = QByteArray("folder") + QByteArray::number(i).rightJustified(3, '0');
+            QCOMPARE(git_treebuilder_insert(nullptr, lBuilder, lName.constData(), &lFolder, GIT_FILEMODE_TREE), 0);
+        }
+        git_oid lRootOid;
+        QCOMPARE(git_treebuilder_write(&lRootOid, lBuilder), 0);
+        git_treebuilder_free(lBuilder);
+        git_tree *lRoot;
+        QCOMPARE(git_tree_lookup(&lRoot, lRepository, &lRootOid), 0);
+
+        git_commit *lParent = nullptr;
+        for (int lSnapshot = 0; lSnapshot < cSnapshotCount; ++lSnapshot) {
+            git_signature *lSignature;
+            QCOMPARE(git_signature_new(&lSignature, "kup", "kup@localhost", 1600000000 + lSnapshot * 3600, 0), 0);
+            const git_commit *lParents[] = {lParent};
+            git_oid lCommitOid;
+            QCOMPARE(git_commit_create(&lCommitOid, lRepository, "refs/heads/kup", lSignature, lSignature, nullptr, "snapshot", lRoot, lParent ? 1 : 0, lParents),
+                     0);
+            git_signature_free(lSignature);
+            git_commit_free(lParent);
+            QCOMPARE(git_commit_lookup(&lParent, lRepository, &lCommitOid), 0);
+        }
+        git_commit_free(lParent);
+        git_tree_free(lRoot);
+        git_repository_free(lRepository);
+    }
+
+    void cleanupTestCase()
+    {
+        git_libgit2_shutdown();
+    }
+
+    void listAllSnapshots()
+    {
+        Repository lRepository(nullptr, mRepositoryDir.path());
+        QVERIFY(lRepository.isValid());
+        auto lBranch = dynamic_cast<Branch *>(lRepository.resolve(QStringLiteral("kup")));
+        QVERIFY(lBranch != nullptr);
+        int lEntryCount = 0;
+        QBENCHMARK_ONCE {
+            for (Node *lSnapshot : lBranch->subNodes()) {
+                for (Node *lFolder : static_cast<Directory *>(lSnapshot)->subNodes()) {
+                    lEntryCount += static_cast<Directory *>(lFolder)->subNodes().count();
+                }
+            }
+        }
+        QCOMPARE(lEntryCount, cSnapshotCount * cFolderCount * cFileCount);
+        const quint64 lBytes = lRepository.memoryUsage();
+        qInfo() << "nodes:" << lEntryCount << "arena bytes:" << lBytes << "bytes per entry:" << lBytes / static_cast<quint64>(lEntryCount)
+                << "sizeof(BlobFile):" << sizeof(BlobFile);
+    }
+
+private:
+    QTemporaryDir mRepositoryDir;
+};
+
+QTEST_GUILESS_MAIN(NodeArenaBenchmark)
+
+#include "nodearenabenchmark.moc"
@@ -0,0 +1,44 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "vfshelpers.h"
+
+#include <QDateTime>
+#include <QTest>
+
+class VfsHelpersTest : public QObject
+{
+    Q_OBJECT
+private slots:
+    void timeFromString_data()
+    {
+        QTest::addColumn<QString>("string");
+        QTest::addColumn<bool>("valid");
+        QTest::addColumn<QDateTime>("time");
+
+        QTest::newRow("date only") << QStringLiteral("2024-05-01") << true << QDateTime(QDate(2024, 5, 1), QTime(23, 59, 59, 999));
+        QTest::newRow("date and time") << QStringLiteral("2024-05-01T12:00") << true << QDateTime(QDate(2024, 5, 1), QTime(12, 0));
+        QTest::newRow("midnight") << QStringLiteral("2024-05-01T00:00") << true << QDateTime(QDate(2024, 5, 1), QTime(0, 0));
+        QTest::newRow("bad date") << QStringLiteral("2024-13-01") << false << QDateTime();
+        QTest::newRow("bad time") << QStringLiteral("2024-05-01T25:00") << false << QDateTime();
+        QTest::newRow("not a time") << QStringLiteral("latest") << false << QDateTime();
+    }
+
+    void timeFromString()
+    {
+        QFETCH(QString, string);
+        QFETCH(bool, valid);
+        QFETCH(QDateTime, time);
+
+        qint64 lTime = -1;
+        QCOMPARE(vfsTimeFromString(string, lTime), valid);
+        if (valid) {
+            QCOMPARE(lTime, time.toSecsSinceEpoch());
+        }
+    }
+};
+
+QTEST_GUILESS_MAIN(VfsHelpersTest)
+
+#include "vfshelperstest.moc"
@@ -0,0 +1,529 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "bupodb.h"
+
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QtEndian>
+
+#include <git2/sys/odb_backend.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+
+static const quint32 cMidxVersion = 4;
+static const quint32 cBloomVersion = 2;
+static const int cMidxHeaderSize = 12;
+static const int cBloomHeaderSize = 16;
+
+static quint32 readBigEndian(const uchar *pData)
+{
+    return qFromBigEndian<quint32>(pData);
+}
+
+// Multi-pack index written by "bup midx": a fanout table on the first bits of the
+// object ids, the sorted object ids and for each of them the pack it is stored in.
+class MidxFile
+{
+public:
+    MidxFile()
+        : mMap(nullptr)
+        , mBits(0)
+        , mCount(0)
+    {
+    }
+
+    bool open(const QString &pPath)
+    {
+        mFile.setFileName(pPath);
+        if (!mFile.open(QIODevice::ReadOnly) || mFile.size() < cMidxHeaderSize) {
+            return false;
+        }
+        const qint64 lSize = mFile.size();
+        mMap = mFile.map(0, lSize);
+        if (mMap == nullptr || 0 != memcmp(mMap, "MIDX", 4) || readBigEndian(mMap + 4) != cMidxVersion) {
+            return false;
+        }
+        mBits = readBigEndian(mMap + 8);
+        if (mBits > 30 || cMidxHeaderSize + (qint64(4) << mBits) > lSize) {
+            return false;
+        }
+        mCount = fanout((quint32(1) << mBits) - 1);
+        const qint64 lNamesOffset = shaOffset() + qint64(mCount) * 24;
+        if (lNamesOffset > lSize) {
+            return false;
+        }
+        const char *lNames = reinterpret_cast<const char *>(mMap + lNamesOffset);
+        const QList<QByteArray> lSplit = QByteArray::fromRawData(lNames, int(lSize - lNamesOffset)).split('\0');
+        for (const QByteArray &lName : lSplit) {
+            if (!lName.isEmpty()) {
+                mIdxNames.append(QByteArray(lName.constData(), lName.size())); // deep copy
+            }
+        }
+        return true;
+    }
+
+    // Index into idxNames() of the pack holding pOid, -1 if not in this midx.
+    int find(const git_oid *pOid) const
+    {
+        const quint32 lBucket = mBits == 0 ? 0 : readBigEndian(pOid->id) >> (32 - mBits);
+        quint32 lStart = lBucket == 0 ? 0 : fanout(lBucket - 1);
+        quint32 lEnd = std::min(fanout(lBucket), mCount);
+        const uchar *lShas = mMap + shaOffset();
+        while (lStart < lEnd) {
+            const quint32 lMiddle = lStart + (lEnd - lStart) / 2;
+            const int lCompare = memcmp(lShas + qint64(lMiddle) * GIT_OID_RAWSZ, pOid->id, GIT_OID_RAWSZ);
+            if (lCompare == 0) {
+                const quint32 lWhich = readBigEndian(lShas + qint64(mCount) * GIT_OID_RAWSZ + qint64(lMiddle) * 4);
+                return lWhich < quint32(mIdxNames.count()) ? int(lWhich) : -1;
+            }
+            if (lCompare < 0) {
+                lStart = lMiddle + 1;
+            } else {
+                lEnd = lMiddle;
+            }
+        }
+        return -1;
+    }
+
+    const QList<QByteArray> &idxNames() const
+    {
+        return mIdxNames;
+    }
+
+protected:
+    quint32 fanout(quint32 pIndex) const
+    {
+        return readBigEndian(mMap + cMidxHeaderSize + qint64(pIndex) * 4);
+    }
+    qint64 shaOffset() const
+    {
+        return cMidxHeaderSize + (qint64(4) << mBits);
+    }
+
+    QFile mFile;
+    const uchar *mMap;
+    quint32 mBits;
+    quint32 mCount;
+    QList<QByteArray> mIdxNames;
+};
+
+// bup.bloom, a bloom filter over the object ids of all the packs it lists. Each
+// object sets k bits, the addresses are taken directly from the object id.
+class BloomFilter
+{
+public:
+    BloomFilter()
+        : mMap(nullptr)
+        , mBits(0)
+        , mK(0)
+    {
+    }
+
+    bool open(const QString &pPath)
+    {
+        mFile.setFileName(pPath);
+        if (!mFile.open(QIODevice::ReadOnly) || mFile.size() < cBloomHeaderSize) {
+            return false;
+        }
+        const qint64 lSize = mFile.size();
+        mMap = mFile.map(0, lSize);
+        if (mMap == nullptr || 0 != memcmp(mMap, "BLOM", 4) || readBigEndian(mMap + 4) != cBloomVersion) {
+            return false;
+        }
+        mBits = qFromBigEndian<quint16>(mMap + 8);
+        mK = qFromBigEndian<quint16>(mMap + 10);
+        if ((mK != 4 || mBits > 37) && (mK != 5 || mBits > 29)) {
+            return false;
+        }
+        const qint64 lNamesOffset = cBloomHeaderSize + (qint64(1) << mBits);
+        if (mBits == 0 || lNamesOffset > lSize) {
+            return false;
+        }
+        const char *lNames = reinterpret_cast<const char *>(mMap + lNamesOffset);
+        const QList<QByteArray> lSplit = QByteArray::fromRawData(lNames, int(lSize - lNamesOffset)).split('\0');
+        for (const QByteArray &lName : lSplit) {
+            if (!lName.isEmpty()) {
+                mIdxNames.insert(QByteArray(lName.constData(), lName.size()));
+            }
+        }
+        return true;
+    }
+
+    bool mayContain(const git_oid *pOid) const
+    {
+        const uchar *lSha = pOid->id;
+        const quint64 lMask = (quint64(1) << mBits) - 1;
+        // k=5 takes 32 bits of the id per probe, k=4 takes 40 bits.
+        const int lStep = mK == 5 ? 4 : 5;
+        const int lRawBits = lStep * 8;
+        for (int i = 0; i + lStep <= GIT_OID_RAWSZ; i += lStep) {
+            quint64 lRaw = readBigEndian(lSha + i);
+            if (lStep == 5) {
+                lRaw = (lRaw << 8) | lSha[i + 4];
+            }
+            const quint64 lAddress = (lRaw >> (lRawBits - mBits)) & lMask;
+            const int lBit = int(lRaw >> (lRawBits - 3 - mBits)) & 7;
+            if ((mMap[cBloomHeaderSize + lAddress] & (1 << lBit)) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool covers(const QList<QByteArray> &pIdxNames) const
+    {
+        return std::all_of(pIdxNames.constBegin(), pIdxNames.constEnd(), [this](const QByteArray &pName) {
+            return mIdxNames.contains(pName);
+        });
+    }
+
+protected:
+    QFile mFile;
+    const uchar *mMap;
+    quint16 mBits;
+    quint16 mK;
+    QSet<QByteArray> mIdxNames;
+};
+
+struct BupOdbBackend {
+    git_odb_backend mParent; // must stay first, libgit2 only knows about this part
+    QByteArray mPackDir;
+    struct timespec mPackDirTime;
+    git_odb_backend *mLoose;
+    QList<QByteArray> mIdxNames; // all packs
+    QList<MidxFile *> mMidxFiles;
+    QList<QByteArray> mUncovered; // packs not in any of the midx files
+    BloomFilter *mBloom; // null unless it covers all packs
+    QHash<QByteArray, git_odb_backend *> mPacks; // opened on first use
+    git_odb_backend *mLastPack; // last uncovered pack that had the wanted object
+};
+
+static BupOdbBackend *bupBackend(git_odb_backend *pBackend)
+{
+    return reinterpret_cast<BupOdbBackend *>(pBackend);
+}
+
+static bool packDirTime(const QByteArray &pPackDir, struct timespec &pTime)
+{
+    struct stat lStat;
+    if (0 != stat(pPackDir.constData(), &lStat)) {
+        return false;
+    }
+    pTime = lStat.st_mtim;
+    return true;
+}
+
+static void clearPackLists(BupOdbBackend *pBackend)
+{
+    qDeleteAll(pBackend->mMidxFiles);
+    pBackend->mMidxFiles.clear();
+    delete pBackend->mBloom;
+    pBackend->mBloom = nullptr;
+    pBackend->mIdxNames.clear();
+    pBackend->mUncovered.clear();
+}
+
+static bool scanPackDir(BupOdbBackend *pBackend)
+{
+    clearPackLists(pBackend);
+    if (!packDirTime(pBackend->mPackDir, pBackend->mPackDirTime)) {
+        return false;
+    }
+    QDir lDir(QString::fromLocal8Bit(pBackend->mPackDir));
+    const QStringList lIdxFiles = lDir.entryList(QStringList() << QStringLiteral("*.idx"), QDir::Files);
+    for (const QString &lName : lIdxFiles) {
+        pBackend->mIdxNames.append(lName.toLocal8Bit());
+    }
+    const QSet<QByteArray> lExisting(pBackend->mIdxNames.constBegin(), pBackend->mIdxNames.constEnd());
+
+    // "bup midx --auto" combines small midx files into bigger ones, the old ones may
+    // still be around. Use the biggest ones first and skip any that add nothing new.
+    // A midx that refers to a pack that no longer exists is stale and ignored.
+    QList<MidxFile *> lMidxFiles;
+    const QStringList lMidxNames = lDir.entryList(QStringList() << QStringLiteral("*.midx"), QDir::Files);
+    for (const QString &lName : lMidxNames) {
+        auto lMidx = new MidxFile();
+        bool lUsable = lMidx->open(lDir.absoluteFilePath(lName));
+        for (int i = 0; lUsable && i < lMidx->idxNames().count(); ++i) {
+            lUsable = lExisting.contains(lMidx->idxNames().at(i));
+        }
+        if (lUsable) {
+            lMidxFiles.append(lMidx);
+        } else {
+            delete lMidx;
+        }
+    }
+    std::sort(lMidxFiles.begin(), lMidxFiles.end(), [](const MidxFile *pFirst, const MidxFile *pSecond) {
+        return pFirst->idxNames().count() > pSecond->idxNames().count();
+    });
+    QSet<QByteArray> lCovered;
+    for (MidxFile *lMidx : std::as_const(lMidxFiles)) {
+        bool lAddsPacks = false;
+        for (const QByteArray &lName : lMidx->idxNames()) {
+            if (!lCovered.contains(lName)) {
+                lCovered.insert(lName);
+                lAddsPacks = true;
+            }
+        }
+        if (lAddsPacks) {
+            pBackend->mMidxFiles.append(lMidx);
+        } else {
+            delete lMidx;
+        }
+    }
+    for (const QByteArray &lName : std::as_const(pBackend->mIdxNames)) {
+        if (!lCovered.contains(lName)) {
+            pBackend->mUncovered.append(lName);
+        }
+    }
+
+    // bup only updates the bloom filter together with the midx files, it can lag
+    // behind the newest packs. Then it can't say that an object is missing.
+    auto lBloom = new BloomFilter();
+    if (lBloom->open(lDir.absoluteFilePath(QStringLiteral("bup.bloom"))) && lBloom->covers(pBackend->mIdxNames)) {
+        pBackend->mBloom = lBloom;
+    } else {
+        delete lBloom;
+    }
+    return true;
+}
+
+static git_odb_backend *packBackend(BupOdbBackend *pBackend, const QByteArray &pIdxName)
+{
+    auto lIter = pBackend->mPacks.constFind(pIdxName);
+    if (lIter != pBackend->mPacks.constEnd()) {
+        return lIter.value();
+    }
+    git_odb_backend *lPack = nullptr;
+    const QByteArray lPath = pBackend->mPackDir + pIdxName;
+    if (0 == git_odb_backend_one_pack(&lPack, lPath.constData())) {
+        lPack->odb = pBackend->mParent.odb;
+    } else {
+        lPack = nullptr; // remembered as broken, not retried
+    }
+    pBackend->mPacks.insert(pIdxName, lPack);
+    return lPack;
+}
+
+// The pack that has pOid, or null if the object is in none of them.
+static git_odb_backend *findPack(BupOdbBackend *pBackend, const git_oid *pOid)
+{
+    if (pBackend->mBloom != nullptr && !pBackend->mBloom->mayContain(pOid)) {
+        return nullptr;
+    }
+    for (const MidxFile *lMidx : std::as_const(pBackend->mMidxFiles)) {
+        const int lIndex = lMidx->find(pOid);
+        if (lIndex >= 0) {
+            git_odb_backend *lPack = packBackend(pBackend, lMidx->idxNames().at(lIndex));
+            if (lPack != nullptr) {
+                return lPack;
+            }
+        }
+    }
+    // objects are usually read in the order they were written, likely in the same pack as last time.
+    git_odb_backend *lLastPack = pBackend->mLastPack;
+    if (lLastPack != nullptr && lLastPack->exists(lLastPack, pOid)) {
+        return lLastPack;
+    }
+    for (const QByteArray &lName : std::as_const(pBackend->mUncovered)) {
+        git_odb_backend *lPack = packBackend(pBackend, lName);
+        if (lPack != nullptr && lPack != lLastPack && lPack->exists(lPack, pOid)) {
+            pBackend->mLastPack = lPack;
+            return lPack;
+        }
+    }
+    return nullptr;
+}
+
+static int bupRead(void **pData, size_t *pSize, git_object_t *pType, git_odb_backend *pBackend, const git_oid *pOid)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    git_odb_backend *lPack = findPack(lBackend, pOid);
+    if (lPack != nullptr) {
+        return lPack->read(pData, pSize, pType, lPack, pOid);
+    }
+    git_odb_backend *lLoose = lBackend->mLoose;
+    return lLoose != nullptr ? lLoose->read(pData, pSize, pType, lLoose, pOid) : GIT_ENOTFOUND;
+}
+
+static int bupReadHeader(size_t *pSize, git_object_t *pType, git_odb_backend *pBackend, const git_oid *pOid)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    git_odb_backend *lPack = findPack(lBackend, pOid);
+    if (lPack != nullptr) {
+        return lPack->read_header(pSize, pType, lPack, pOid);
+    }
+    git_odb_backend *lLoose = lBackend->mLoose;
+    return lLoose != nullptr ? lLoose->read_header(pSize, pType, lLoose, pOid) : GIT_ENOTFOUND;
+}
+
+static int bupExists(git_odb_backend *pBackend, const git_oid *pOid)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    if (findPack(lBackend, pOid) != nullptr) {
+        return 1;
+    }
+    git_odb_backend *lLoose = lBackend->mLoose;
+    return lLoose != nullptr ? lLoose->exists(lLoose, pOid) : 0;
+}
+
+// Abbreviated ids can't use the midx or bloom files, asks every pack. Rarely used.
+static int bupExistsPrefix(git_oid *pOid, git_odb_backend *pBackend, const git_oid *pShortId, size_t pLength)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    bool lFound = false;
+    auto lCheck = [&](git_odb_backend *pSource) {
+        if (pSource == nullptr || pSource->exists_prefix == nullptr) {
+            return 0;
+        }
+        git_oid lOid;
+        int lResult = pSource->exists_prefix(&lOid, pSource, pShortId, pLength);
+        if (lResult == GIT_ENOTFOUND) {
+            return 0;
+        }
+        if (lResult != 0) {
+            return lResult;
+        }
+        if (lFound && !git_oid_equal(&lOid, pOid)) {
+            return int(GIT_EAMBIGUOUS);
+        }
+        git_oid_cpy(pOid, &lOid);
+        lFound = true;
+        return 0;
+    };
+    for (const QByteArray &lName : std::as_const(lBackend->mIdxNames)) {
+        int lResult = lCheck(packBackend(lBackend, lName));
+        if (lResult != 0) {
+            return lResult;
+        }
+    }
+    int lResult = lCheck(lBackend->mLoose);
+    if (lResult != 0) {
+        return lResult;
+    }
+    return lFound ? 0 : GIT_ENOTFOUND;
+}
+
+static int bupReadPrefix(git_oid *pOid, void **pData, size_t *pSize, git_object_t *pType, git_odb_backend *pBackend, const git_oid *pShortId, size_t pLength)
+{
+    if (pLength >= GIT_OID_HEXSZ) {
+        git_oid_cpy(pOid, pShortId);
+    } else {
+        int lResult = bupExistsPrefix(pOid, pBackend, pShortId, pLength);
+        if (lResult != 0) {
+            return lResult;
+        }
+    }
+    return bupRead(pData, pSize, pType, pBackend, pOid);
+}
+
+// libgit2 calls this after every failed lookup, only rescan when the directory changed.
+static int bupRefresh(git_odb_backend *pBackend)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    struct timespec lTime;
+    if (!packDirTime(lBackend->mPackDir, lTime)) {
+        return 0;
+    }
+    if (lTime.tv_sec != lBackend->mPackDirTime.tv_sec || lTime.tv_nsec != lBackend->mPackDirTime.tv_nsec) {
+        scanPackDir(lBackend);
+    }
+    return 0;
+}
+
+static int bupForeach(git_odb_backend *pBackend, git_odb_foreach_cb pCallback, void *pPayload)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    for (const QByteArray &lName : std::as_const(lBackend->mIdxNames)) {
+        git_odb_backend *lPack = packBackend(lBackend, lName);
+        if (lPack != nullptr) {
+            // called through a variable, foreach is also a Qt macro
+            auto lForeach = lPack->foreach;
+            int lResult = lForeach(lPack, pCallback, pPayload);
+            if (lResult != 0) {
+                return lResult;
+            }
+        }
+    }
+    git_odb_backend *lLoose = lBackend->mLoose;
+    if (lLoose == nullptr) {
+        return 0;
+    }
+    auto lForeach = lLoose->foreach;
+    return lForeach(lLoose, pCallback, pPayload);
+}
+
+static void bupFree(git_odb_backend *pBackend)
+{
+    BupOdbBackend *lBackend = bupBackend(pBackend);
+    for (git_odb_backend *lPack : std::as_const(lBackend->mPacks)) {
+        if (lPack != nullptr) {
+            lPack->free(lPack);
+        }
+    }
+    if (lBackend->mLoose != nullptr) {
+        lBackend->mLoose->free(lBackend->mLoose);
+    }
+    clearPackLists(lBackend);
+    delete lBackend;
+}
+
+static git_odb_backend *createBupBackend(const QByteArray &pObjectsDir)
+{
+    auto lBackend = new BupOdbBackend();
+    git_odb_init_backend(&lBackend->mParent, GIT_ODB_BACKEND_VERSION);
+    lBackend->mPackDir = pObjectsDir + "pack/";
+    lBackend->mPackDirTime = {0, 0};
+    lBackend->mLoose = nullptr;
+    lBackend->mBloom = nullptr;
+    lBackend->mLastPack = nullptr;
+    if (!scanPackDir(lBackend)) {
+        clearPackLists(lBackend);
+        delete lBackend;
+        return nullptr;
+    }
+    if (0 != git_odb_backend_loose(&lBackend->mLoose, pObjectsDir.constData(), -1, 0, 0, 0)) {
+        lBackend->mLoose = nullptr;
+    }
+    lBackend->mParent.read = bupRead;
+    lBackend->mParent.read_prefix = bupReadPrefix;
+    lBackend->mParent.read_header = bupReadHeader;
+    lBackend->mParent.exists = bupExists;
+    lBackend->mParent.exists_prefix = bupExistsPrefix;
+    lBackend->mParent.refresh = bupRefresh;
+    lBackend->mParent.foreach = bupForeach;
+    lBackend->mParent.free = bupFree;
+    return &lBackend->mParent;
+}
+
+int openBupRepository(git_repository **pRepository, const QString &pPath)
+{
+    int lResult = git_repository_open(pRepository, pPath.toLocal8Bit());
+    if (lResult != 0) {
+        return lResult;
+    }
+    const QByteArray lObjectsDir = QByteArray(git_repository_path(*pRepository)) + "objects/";
+    git_odb_backend *lBackend = createBupBackend(lObjectsDir);
+    if (lBackend == nullptr) {
+        return 0;
+    }
+    git_odb *lOdb;
+    if (0 != git_odb_new(&lOdb)) {
+        lBackend->free(lBackend);
+        return 0;
+    }
+    if (0 != git_odb_add_backend(lOdb, lBackend, 1)) {
+        lBackend->free(lBackend);
+    } else {
+        git_repository_set_odb(*pRepository, lOdb);
+    }
+    git_odb_free(lOdb); // the repository holds its own reference
+    return 0;
+}
@@ -0,0 +1,20 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef BUPODB_H
+#define BUPODB_H
+
+#include <QString>
+
+#include <git2.h>
+
+// Opens a bup repository with an object database that finds objects through bup's
+// .midx files and uses bup.bloom to reject objects that are in none of the packs.
+// Packs are only opened when an object is found in them. libgit2 on its own probes
+// the .idx file of every pack, bup repositories tend to have thousands of packs.
+// Falls back to the default object database if the pack directory can't be read.
+// Returns a libgit2 error code, like git_repository_open().
+int openBupRepository(git_repository **pRepository, const QString &pPath);
+
+#endif // BUPODB_H
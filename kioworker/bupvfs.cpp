@@ -3,28 +3,90 @@
 // SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
 
 #include "bupvfs.h"
+#include "bupodb.h"
+#include "chunkreadahead.h"
+#include "commitgraph.h"
+#include "directoryprefetcher.h"
 #include "kupkio_debug.h"
+#include "nodearena.h"
+#include "vfsindex.h"
 
 #include <git2/blob.h>
 #include <git2/branch.h>
+#include <git2/graph.h>
+#include <git2/odb.h>
 
 #include <sys/stat.h>
 
+#include <QDateTime>
 #include <QMimeDatabase>
+#include <QSet>
+
+#include <algorithm>
+#include <climits>
 
 git_revwalk *Node::mRevisionWalker = nullptr;
 git_repository *Node::mRepository = nullptr;
+VfsIndex *Node::mIndex = nullptr;
+NodeArena *Node::mArena = nullptr;
+DirectoryPrefetcher *Node::mPrefetcher = nullptr;
+
+Q_GLOBAL_STATIC(QString, gNoName)
 
-Node::Node(QObject *pParent, const QString &pName, qint64 pMode)
-    : QObject(pParent)
-    , Metadata(pMode)
+Node::Node(Node *pParent, const QString &pName, qint64 pMode)
+    : mArenaSlot(0)
+    , mParent(pParent)
+    , mName(mArena != nullptr ? mArena->intern(pName) : gNoName())
 {
-    setObjectName(pName);
+    storeMetadata(Metadata(pMode));
 }
 
-int Node::readMetadata(VintStream &pMetadataStream)
+void performNodeLookup(git_repository *pRepository, NodeLookup &pLookup)
 {
-    return ::readMetadata(pMetadataStream, *this);
+    pLookup.mSuccess = false;
+    if (pRepository == nullptr) {
+        return;
+    }
+    switch (pLookup.mType) {
+    case NodeLookup::BlobSize:
+        pLookup.mSuccess = readBlobSize(&pLookup.mOid, pRepository, pLookup.mSize);
+        break;
+    case NodeLookup::ChunkFileSize:
+        pLookup.mSize = calculateChunkFileSize(&pLookup.mOid, pRepository);
+        pLookup.mSuccess = pLookup.mSize > 0;
+        break;
+    case NodeLookup::DirectoryMetadata:
+        pLookup.mSuccess = readDirectoryMetadata(pRepository, &pLookup.mOid, pLookup.mMetadata);
+        break;
+    }
+}
+
+QString Node::mimeType() const
+{
+    if (S_ISDIR(mMode)) {
+        return QStringLiteral("inode/directory");
+    }
+    if (mArena == nullptr) {
+        QMimeDatabase db;
+        return db.mimeTypeForFile(objectName(), QMimeDatabase::MatchExtension).name();
+    }
+    const QString *lDetected = mArena->detectedMimeType(this);
+    return lDetected != nullptr ? *lDetected : mArena->mimeTypeForName(mName);
+}
+
+void Node::setMetadata(const Metadata &pMetadata)
+{
+    storeMetadata(pMetadata);
+}
+
+void Node::storeMetadata(const Metadata &pMetadata)
+{
+    mAtime = pMetadata.mAtime;
+    mMtime = pMetadata.mMtime;
+    mSize = pMetadata.mSize;
+    mMode = static_cast<quint32>(pMetadata.mMode);
+    mUid = static_cast<quint32>(pMetadata.mUid);
+    mGid = static_cast<quint32>(pMetadata.mGid);
 }
 
 Node *Node::resolve(const QString &pPath, bool pFollowLinks)
@@ -46,20 +108,23 @@ Node *Node::resolve(const QStringList &pPathList, bool pFollowLinks)
             continue;
         }
         if (lPathComponent == QStringLiteral("..")) {
-            lNode = qobject_cast<Node *>(lNode->parent());
+            lNode = lNode->parent();
         } else {
-            auto lDir = qobject_cast<Directory *>(lNode);
+            auto lDir = dynamic_cast<Directory *>(lNode);
             if (lDir == nullptr) {
                 return nullptr;
             }
-            lNode = lDir->subNodes().value(lPathComponent, nullptr);
+            lNode = lDir->subNode(lPathComponent);
         }
         if (lNode == nullptr) {
             return nullptr;
         }
     }
-    if (pFollowLinks && !lNode->mSymlinkTarget.isEmpty()) {
-        return qobject_cast<Node *>(lNode->parent())->resolve(lNode->mSymlinkTarget, true);
+    if (pFollowLinks) {
+        const QString lTarget = lNode->symlinkTarget();
+        if (!lTarget.isEmpty()) {
+            return lNode->parent()->resolve(lTarget, true);
+        }
     }
     return lNode;
 }
@@ -69,7 +134,7 @@ QString Node::completePath()
     QString lCompletePath;
     Node *lNode = this;
     while (lNode != nullptr) {
-        Node *lNewNode = qobject_cast<Node *>(lNode->parent());
+        Node *lNewNode = lNode->parent();
         if (lNewNode == nullptr) { // this must be the repository, already starts and ends with slash.
             QString lObjectName = lNode->objectName();
             lObjectName.chop(1);
@@ -86,39 +151,65 @@ QString Node::completePath()
 Node *Node::parentCommit()
 {
     Node *lNode = this;
-    while (lNode != nullptr && qobject_cast<Branch *>(lNode->parent()) == nullptr) {
-        lNode = qobject_cast<Node *>(lNode->parent());
+    while (lNode != nullptr && dynamic_cast<Branch *>(lNode->parent()) == nullptr) {
+        lNode = lNode->parent();
     }
     return lNode;
 }
 
 // Node *Node::parentRepository() {
 //	Node *lNode = this;
-//	while(lNode->parent() != nullptr && qobject_cast<Repository *>(lNode) == nullptr) {
-//		lNode = qobject_cast<Node *>(lNode->parent());
+//	while(lNode->parent() != nullptr && dynamic_cast<Repository *>(lNode) == nullptr) {
+//		lNode = lNode->parent();
 //	}
 //	return lNode;
 // }
 
-Directory::Directory(QObject *pParent, const QString &pName, qint64 pMode)
+Directory::Directory(Node *pParent, const QString &pName, qint64 pMode)
     : Node(pParent, pName, pMode)
+    , mSubNodesGenerated(false)
 {
-    mSubNodes = nullptr;
-    mMimeType = QStringLiteral("inode/directory");
 }
 
-NodeMap Directory::subNodes()
+const NodeList &Directory::subNodes()
 {
-    if (mSubNodes == nullptr) {
-        mSubNodes = new NodeMap();
+    if (!mSubNodesGenerated) {
+        mSubNodesGenerated = true;
         generateSubNodes();
+        sortSubNodes();
+    }
+    return mSubNodes;
+}
+
+Node *Directory::subNode(const QString &pName)
+{
+    const NodeList &lSubNodes = subNodes();
+    auto lIter = std::lower_bound(lSubNodes.constBegin(), lSubNodes.constEnd(), pName, [](const Node *pNode, const QString &pValue) {
+        return pNode->objectName() < pValue;
+    });
+    if (lIter != lSubNodes.constEnd() && (*lIter)->objectName() == pName) {
+        return *lIter;
+    }
+    return nullptr;
+}
+
+void Directory::sortSubNodes()
+{
+    auto lLessThan = [](const Node *pFirst, const Node *pSecond) {
+        return pFirst->objectName() < pSecond->objectName();
+    };
+    if (std::is_sorted(mSubNodes.constBegin(), mSubNodes.constEnd(), lLessThan)) {
+        return;
     }
-    return *mSubNodes;
+    std::sort(mSubNodes.begin(), mSubNodes.end(), lLessThan);
+    mSubNodes.squeeze();
 }
 
-int File::readMetadata(VintStream &pMetadataStream)
+void File::detectMimeTypeFromContent()
 {
-    int lRetVal = Node::readMetadata(pMetadataStream);
+    if (mArena == nullptr || mArena->detectedMimeType(this) != nullptr) {
+        return;
+    }
     QByteArray lContent, lNextData;
     seek(0);
     while (lContent.size() < 1000 && 0 == read(lNextData)) {
@@ -127,11 +218,36 @@ int File::readMetadata(VintStream &pMetadataStream)
     seek(0);
     QMimeDatabase db;
     if (!lContent.isEmpty()) {
-        mMimeType = db.mimeTypeForFileNameAndData(objectName(), lContent).name();
+        mArena->setDetectedMimeType(this, db.mimeTypeForFileNameAndData(objectName(), lContent).name());
     } else {
-        mMimeType = db.mimeTypeForFile(objectName()).name();
+        mArena->setDetectedMimeType(this, mArena->mimeTypeForName(mName));
     }
-    return lRetVal;
+}
+
+void File::applyLookup(const NodeLookup &pLookup)
+{
+    if (!pLookup.mSuccess) {
+        return; // size() will try again when needed
+    }
+    mCachedSize = pLookup.mSize;
+    if (mIndex != nullptr) {
+        mIndex->addFileSize(&pLookup.mOid, pLookup.mSize);
+    }
+}
+
+bool File::prepareSizeLookup(NodeLookup &pLookup, const git_oid *pOid, NodeLookup::Type pType)
+{
+    if (mCachedSize != 0 || mSize >= 0) {
+        return false;
+    }
+    quint64 lSize;
+    if (mIndex != nullptr && mIndex->fileSize(pOid, lSize)) {
+        mCachedSize = lSize;
+        return false;
+    }
+    pLookup.mType = pType;
+    pLookup.mOid = *pOid;
+    return true;
 }
 
 BlobFile::BlobFile(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode)
@@ -165,6 +281,17 @@ int BlobFile::read(QByteArray &pChunk, qint64 pReadSize)
     return 0;
 }
 
+void BlobFile::releaseContent()
+{
+    git_blob_free(mBlob);
+    mBlob = nullptr;
+}
+
+bool BlobFile::prepareLookup(NodeLookup &pLookup)
+{
+    return prepareSizeLookup(pLookup, &mOid, NodeLookup::BlobSize);
+}
+
 git_blob *BlobFile::cachedBlob()
 {
     if (mBlob == nullptr) {
@@ -178,11 +305,25 @@ quint64 BlobFile::calculateSize()
     if (mSize >= 0) {
         return static_cast<quint64>(mSize);
     }
+    quint64 lSize;
+    if (mIndex != nullptr && mIndex->fileSize(&mOid, lSize)) {
+        return lSize;
+    }
     git_blob *lBlob = cachedBlob();
     if (lBlob == nullptr) {
         return 0;
     }
-    return static_cast<quint64>(git_blob_rawsize(lBlob));
+    lSize = static_cast<quint64>(git_blob_rawsize(lBlob));
+    if (mIndex != nullptr) {
+        mIndex->addFileSize(&mOid, lSize);
+    }
+    return lSize;
+}
+
+void Symlink::setMetadata(const Metadata &pMetadata)
+{
+    BlobFile::setMetadata(pMetadata);
+    mTarget = pMetadata.mSymlinkTarget;
 }
 
 ChunkFile::ChunkFile(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode)
@@ -190,8 +331,10 @@ ChunkFile::ChunkFile(Node *pParent, const git_oid *pOid, const QString &pName, q
     , mOid(*pOid)
     , mCurrentBlob(nullptr)
     , mValidSeekPosition(false)
+    , mChunkTableState(ChunkTableNotBuilt)
+    , mChunkIndex(0)
+    , mChunkSkipSize(0)
 {
-    ChunkFile::seek(0);
 }
 
 ChunkFile::~ChunkFile()
@@ -221,6 +364,18 @@ int ChunkFile::seek(quint64 pOffset)
         mCurrentBlob = nullptr;
     }
 
+    // Reading sequentially from the start works well enough by walking the tree,
+    // only pay for building the chunk table when seeking somewhere else.
+    if ((pOffset > 0 || mChunkTableState == ChunkTableBuilt) && ensureChunkTable()) {
+        mChunkIndex = chunkIndexAt(pOffset);
+        if (mChunkIndex < 0) {
+            return KIO::ERR_CANNOT_SEEK;
+        }
+        mChunkSkipSize = pOffset - mChunks.at(mChunkIndex).mOffset;
+        mValidSeekPosition = true;
+        return 0; // success
+    }
+
     git_tree *lTree;
     if (0 != git_tree_lookup(&lTree, mRepository, &mOid)) {
         return KIO::ERR_CANNOT_SEEK;
@@ -275,9 +430,12 @@ int ChunkFile::read(QByteArray &pChunk, qint64 pReadSize)
     if (mOffset >= size()) {
         return KIO::ERR_NO_CONTENT;
     }
-    if (!mValidSeekPosition) {
+    if (!mValidSeekPosition && 0 != seek(mOffset)) {
         return KIO::ERR_CANNOT_READ;
     }
+    if (mChunkTableState == ChunkTableBuilt) {
+        return readFromChunkTable(pChunk, pReadSize);
+    }
 
     TreePosition *lCurrentPos = mPositionStack.last();
     if (mCurrentBlob != nullptr && lCurrentPos->mSkipSize == 0) {
@@ -339,12 +497,125 @@ int ChunkFile::read(QByteArray &pChunk, qint64 pReadSize)
     return 0; // success.
 }
 
+void ChunkFile::releaseContent()
+{
+    while (!mPositionStack.isEmpty()) {
+        delete mPositionStack.takeLast();
+    }
+    if (mCurrentBlob != nullptr) {
+        git_blob_free(mCurrentBlob);
+        mCurrentBlob = nullptr;
+    }
+    mValidSeekPosition = false; // next read has to seek again
+    if (mChunkTableState == ChunkTableBuilt) {
+        mChunks = ChunkTable();
+        mChunkTableState = ChunkTableNotBuilt;
+    }
+}
+
+bool ChunkFile::prepareLookup(NodeLookup &pLookup)
+{
+    return prepareSizeLookup(pLookup, &mOid, NodeLookup::ChunkFileSize);
+}
+
+bool ChunkFile::ensureChunkTable()
+{
+    if (mChunkTableState == ChunkTableNotBuilt) {
+        if (mIndex != nullptr && mIndex->chunkTable(&mOid, mChunks)) {
+            mChunkTableState = ChunkTableBuilt;
+        } else if (buildChunkTable(&mOid, mRepository, mChunks)) {
+            mChunkTableState = ChunkTableBuilt;
+            if (mIndex != nullptr) {
+                mIndex->addChunkTable(&mOid, mChunks);
+            }
+        } else {
+            mChunkTableState = ChunkTableFailed;
+        }
+    }
+    return mChunkTableState == ChunkTableBuilt && !mChunks.isEmpty();
+}
+
+int ChunkFile::chunkIndexAt(quint64 pOffset)
+{
+    auto lNextChunk = std::upper_bound(mChunks.constBegin(), mChunks.constEnd(), pOffset, [](quint64 pValue, const ChunkRecord &pChunk) {
+        return pValue < pChunk.mOffset;
+    });
+    return static_cast<int>(lNextChunk - mChunks.constBegin()) - 1;
+}
+
+ChunkReadAhead *ChunkFile::readAhead(GitWorkerPool *pPool, int pDepth)
+{
+    if (mOffset >= size()) {
+        return nullptr;
+    }
+    if (mChunkTableState == ChunkTableNotBuilt && mIndex != nullptr && mIndex->chunkTable(&mOid, mChunks)) {
+        mChunkTableState = ChunkTableBuilt;
+    }
+    if (mChunkTableState == ChunkTableBuilt && !mChunks.isEmpty()) {
+        int lIndex = chunkIndexAt(mOffset);
+        if (lIndex < 0) {
+            return nullptr;
+        }
+        return new ChunkReadAhead(pPool, mChunks, lIndex, mOffset - mChunks.at(lIndex).mOffset, pDepth);
+    }
+    // A sequential read should not wait for the whole tree to be walked, let the
+    // reader walk it as it goes.
+    auto lWalker = new ChunkTreeWalker(mRepository);
+    quint64 lSkipSize;
+    if (!lWalker->seek(&mOid, mOffset, lSkipSize)) {
+        delete lWalker;
+        return nullptr;
+    }
+    return new ChunkReadAhead(pPool, lWalker, lSkipSize, pDepth);
+}
+
+int ChunkFile::readFromChunkTable(QByteArray &pChunk, qint64 pReadSize)
+{
+    if (mCurrentBlob != nullptr && mChunkSkipSize == 0) {
+        // previous blob has been exhausted, pChunk from last call no longer needs it.
+        git_blob_free(mCurrentBlob);
+        mCurrentBlob = nullptr;
+    }
+    if (mChunkIndex >= mChunks.count()) {
+        return KIO::ERR_CANNOT_READ;
+    }
+    if (mCurrentBlob == nullptr) {
+        if (0 != git_blob_lookup(&mCurrentBlob, mRepository, &mChunks.at(mChunkIndex).mOid)) {
+            return KIO::ERR_CANNOT_READ;
+        }
+    }
+    auto lTotalSize = static_cast<quint64>(git_blob_rawsize(mCurrentBlob));
+    if (lTotalSize < mChunkSkipSize) {
+        return KIO::ERR_CANNOT_READ;
+    }
+    quint64 lReadSize = lTotalSize - mChunkSkipSize;
+    if (pReadSize > 0 && static_cast<quint64>(pReadSize) < lReadSize) {
+        lReadSize = static_cast<quint64>(pReadSize);
+    }
+    pChunk = QByteArray::fromRawData(static_cast<const char *>(git_blob_rawcontent(mCurrentBlob)) + mChunkSkipSize, static_cast<int>(lReadSize));
+    mOffset += lReadSize;
+    mChunkSkipSize += lReadSize;
+    if (mChunkSkipSize == lTotalSize) {
+        mChunkSkipSize = 0;
+        mChunkIndex++;
+    }
+    return 0; // success.
+}
+
 quint64 ChunkFile::calculateSize()
 {
     if (mSize >= 0) {
         return static_cast<quint64>(mSize);
     }
-    return calculateChunkFileSize(&mOid, mRepository);
+    quint64 lSize;
+    if (mIndex != nullptr && mIndex->fileSize(&mOid, lSize)) {
+        return lSize;
+    }
+    lSize = calculateChunkFileSize(&mOid, mRepository);
+    if (mIndex != nullptr && lSize > 0) {
+        mIndex->addFileSize(&mOid, lSize);
+    }
+    return lSize;
 }
 
 ChunkFile::TreePosition::TreePosition(git_tree *pTree)
@@ -362,64 +633,118 @@ ChunkFile::TreePosition::~TreePosition()
 ArchivedDirectory::ArchivedDirectory(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode)
     : Directory(pParent, pName, pMode)
     , mOid(*pOid)
-    , mTree(nullptr)
-    , mMetadataStream(nullptr)
+    , mMetadataLoaded(false)
+{
+}
+
+void ArchivedDirectory::setMetadata(const Metadata &pMetadata)
 {
-    if (0 != git_tree_lookup(&mTree, mRepository, &mOid)) {
+    Node::setMetadata(pMetadata);
+    mMetadataLoaded = true;
+}
+
+void ArchivedDirectory::loadMetadata()
+{
+    if (mMetadataLoaded) {
         return;
     }
-    const git_tree_entry *lTreeEntry = git_tree_entry_byname(mTree, ".bupm");
-    if (lTreeEntry != nullptr && 0 == git_blob_lookup(&mMetadataBlob, mRepository, git_tree_entry_id(lTreeEntry))) {
-        mMetadataStream = new VintStream(git_blob_rawcontent(mMetadataBlob), static_cast<int>(git_blob_rawsize(mMetadataBlob)), this);
-        readMetadata(*mMetadataStream); // the first entry is metadata for the directory itself
+    mMetadataLoaded = true; // don't retry if it fails
+    Metadata lMetadata(mMode);
+    if ((mIndex != nullptr && mIndex->directoryMetadata(&mOid, lMetadata)) || readDirectoryMetadata(mRepository, &mOid, lMetadata)) {
+        setMetadata(lMetadata);
     }
 }
 
-void ArchivedDirectory::generateSubNodes()
+bool ArchivedDirectory::prepareLookup(NodeLookup &pLookup)
 {
-    if (mTree == nullptr) {
-        return;
+    if (mMetadataLoaded) {
+        return false;
     }
-    ulong lEntryCount = git_tree_entrycount(mTree);
-    for (uint i = 0; i < lEntryCount; ++i) {
-        uint lMode;
-        const git_oid *lOid;
-        QString lName;
-        bool lChunked;
-        const git_tree_entry *lTreeEntry = git_tree_entry_byindex(mTree, i);
-        getEntryAttributes(lTreeEntry, lMode, lChunked, lOid, lName);
-        if (lName == QStringLiteral(".bupm")) {
-            continue;
-        }
+    Metadata lMetadata(mMode);
+    if (mIndex != nullptr && mIndex->directoryMetadata(&mOid, lMetadata)) {
+        setMetadata(lMetadata);
+        return false;
+    }
+    pLookup.mType = NodeLookup::DirectoryMetadata;
+    pLookup.mOid = mOid;
+    pLookup.mMetadata = lMetadata;
+    return true;
+}
 
+void ArchivedDirectory::applyLookup(const NodeLookup &pLookup)
+{
+    mMetadataLoaded = true;
+    if (pLookup.mSuccess) {
+        setMetadata(pLookup.mMetadata);
+    }
+}
+
+bool ArchivedDirectory::needsDecoding() const
+{
+    return !mSubNodesGenerated && (mIndex == nullptr || !mIndex->containsDirectory(&mOid));
+}
+
+void ArchivedDirectory::dropSubNodes()
+{
+    for (Node *lSubNode : std::as_const(mSubNodes)) {
+        mArena->destroyTree(lSubNode);
+    }
+    mSubNodes.clear();
+    mSubNodes.squeeze();
+    mSubNodesGenerated = false;
+}
+
+void ArchivedDirectory::generateSubNodes()
+{
+    IndexedDirectory lDirectory;
+    if (mIndex == nullptr || !mIndex->directory(&mOid, lDirectory)) {
+        if ((mPrefetcher == nullptr || !mPrefetcher->take(&mOid, lDirectory)) && !decodeArchivedDirectory(mRepository, &mOid, lDirectory)) {
+            return;
+        }
+        if (mIndex != nullptr) {
+            mIndex->addDirectory(&mOid, lDirectory);
+        }
+    }
+    if (!mMetadataLoaded) {
+        setMetadata(lDirectory.mMetadata);
+    }
+    for (const IndexedEntry &lEntry : std::as_const(lDirectory.mEntries)) {
         Node *lSubNode = nullptr;
-        if (S_ISDIR(lMode)) {
-            lSubNode = new ArchivedDirectory(this, lOid, lName, lMode);
-        } else if (S_ISLNK(lMode)) {
-            lSubNode = new Symlink(this, lOid, lName, lMode);
-        } else if (lChunked) {
-            lSubNode = new ChunkFile(this, lOid, lName, lMode);
+        if (S_ISDIR(lEntry.mMode)) {
+            lSubNode = mArena->create<ArchivedDirectory>(this, &lEntry.mOid, lEntry.mName, lEntry.mMode);
+        } else if (S_ISLNK(lEntry.mMode)) {
+            lSubNode = mArena->create<Symlink>(this, &lEntry.mOid, lEntry.mName, lEntry.mMode);
+        } else if (lEntry.mChunked) {
+            lSubNode = mArena->create<ChunkFile>(this, &lEntry.mOid, lEntry.mName, lEntry.mMode);
         } else {
-            lSubNode = new BlobFile(this, lOid, lName, lMode);
+            lSubNode = mArena->create<BlobFile>(this, &lEntry.mOid, lEntry.mName, lEntry.mMode);
         }
-        mSubNodes->insert(lName, lSubNode);
-        if (!S_ISDIR(lMode) && mMetadataStream != nullptr) {
-            lSubNode->readMetadata(*mMetadataStream);
+        mSubNodes.append(lSubNode);
+        if (!S_ISDIR(lEntry.mMode)) {
+            lSubNode->setMetadata(lEntry.mMetadata);
         }
     }
-    if (mMetadataStream != nullptr) {
-        delete mMetadataStream;
-        mMetadataStream = nullptr;
-        git_blob_free(mMetadataBlob);
-        mMetadataBlob = nullptr;
-    }
-    git_tree_free(mTree);
-    mTree = nullptr;
+}
+
+Snapshot::Snapshot(Node *pParent, const git_oid *pTreeOid, const QString &pName, qint64 pCommitTime)
+    : ArchivedDirectory(pParent, pTreeOid, pName, DEFAULT_MODE_DIRECTORY)
+{
+    mMtime = pCommitTime;
+}
+
+void Snapshot::setMetadata(const Metadata &pMetadata)
+{
+    // show when the backup was taken rather than when the source folder was last modified.
+    qint64 lCommitTime = mMtime;
+    ArchivedDirectory::setMetadata(pMetadata);
+    mMtime = lCommitTime;
 }
 
 Branch::Branch(Node *pParent, const char *pName)
     : Directory(pParent, QString::fromLocal8Bit(pName).remove(0, 11), DEFAULT_MODE_DIRECTORY)
     , mRefName(pName)
+    , mHaveLastHead(false)
+    , mListedCommits(0)
 {
     QByteArray lPath = parent()->objectName().toLocal8Bit();
     lPath.append(mRefName);
@@ -432,48 +757,237 @@ Branch::Branch(Node *pParent, const char *pName)
 
 void Branch::reload()
 {
-    if (mSubNodes == nullptr) {
-        mSubNodes = new NodeMap();
-    }
     // potentially changed content in a branch, generateSubNodes is written so
-    // that it can be called repeatedly.
+    // that it can be called repeatedly and only adds snapshots made since last time.
+    if (!mSubNodesGenerated) {
+        subNodes();
+        return;
+    }
     generateSubNodes();
+    sortSubNodes();
 }
 
 void Branch::generateSubNodes()
 {
-    if (0 != git_revwalk_push_ref(mRevisionWalker, mRefName)) {
+    if (!updateCommits()) {
         return;
     }
+    if (mListedCommits == 0) {
+        // first time or the order of snapshots changed, list all again.
+        mSubNodes.clear();
+        mSubNodes.reserve(mCommits.count());
+        mListedSnapshots.clear();
+        for (const IndexedCommit &lCommit : std::as_const(mCommits)) {
+            listSnapshot(snapshotNode(lCommit));
+        }
+    } else {
+        // only snapshots newer than all listed ones have been added. Some of them may
+        // already have nodes, created by findSnapshot() since the last listing.
+        for (int i = mListedCommits; i < mCommits.count(); ++i) {
+            listSnapshot(snapshotNode(mCommits.at(i)));
+        }
+    }
+    mListedCommits = mCommits.count();
+}
+
+void Branch::listSnapshot(Snapshot *pSnapshot)
+{
+    if (!mListedSnapshots.contains(pSnapshot)) {
+        mListedSnapshots.insert(pSnapshot);
+        mSubNodes.append(pSnapshot);
+    }
+}
+
+Node *Branch::subNode(const QString &pName)
+{
+    if (pName == QStringLiteral("latest") || pName.startsWith(QLatin1Char('@'))) {
+        return findSnapshot(pName);
+    }
+    return Directory::subNode(pName);
+}
+
+Node *Branch::findSnapshot(const QString &pName)
+{
+    if (!updateCommits() || mCommits.isEmpty()) {
+        return nullptr;
+    }
+    if (pName == QStringLiteral("latest")) {
+        return snapshotNode(mCommits.last());
+    }
+    // "@2024-05-01T12:00" is the last snapshot taken at or before that local time,
+    // "@2024-05-01" the last one taken during that day.
+    qint64 lSeconds;
+    if (!vfsTimeFromString(pName.mid(1), lSeconds)) {
+        return nullptr;
+    }
+    auto lIter = std::upper_bound(mCommits.constBegin(), mCommits.constEnd(), lSeconds, [](qint64 pValue, const IndexedCommit &pCommit) {
+        return pValue < pCommit.mCommitTime;
+    });
+    if (lIter == mCommits.constBegin()) {
+        return nullptr; // no snapshot that old
+    }
+    return snapshotNode(*(lIter - 1));
+}
+
+Snapshot *Branch::snapshotNode(const IndexedCommit &pCommit)
+{
+    const QString lName = vfsTimeToString(pCommit.mCommitTime);
+    Snapshot *&lNode = mSnapshots[lName];
+    if (lNode == nullptr) {
+        lNode = mArena->create<Snapshot>(this, &pCommit.mTreeOid, lName, pCommit.mCommitTime);
+    }
+    return lNode;
+}
+
+bool Branch::updateCommits()
+{
+    git_oid lHeadOid;
+    if (0 != git_reference_name_to_id(&lHeadOid, mRepository, mRefName)) {
+        return false;
+    }
+    if (mHaveLastHead && git_oid_equal(&mLastHead, &lHeadOid)) {
+        return true; // no new snapshots
+    }
+
+    if (mHaveLastHead && 1 == git_graph_descendant_of(mRepository, &lHeadOid, &mLastHead)) {
+        // everything up to the last seen head is known, only walk the new commits.
+        IndexedCommitList lNewCommits;
+        if (!walkCommits(&lHeadOid, &mLastHead, lNewCommits)) {
+            return false;
+        }
+        git_oid lIndexedHead;
+        if (mIndex != nullptr && mIndex->branchHead(mRefName, lIndexedHead) && git_oid_equal(&lIndexedHead, &mLastHead)) {
+            mIndex->addCommits(mRefName, &lHeadOid, lNewCommits, false);
+        }
+        const qint64 lNewestKnown = mCommits.isEmpty() ? LLONG_MIN : mCommits.last().mCommitTime;
+        const bool lAllNewer = std::all_of(lNewCommits.constBegin(), lNewCommits.constEnd(), [lNewestKnown](const IndexedCommit &pCommit) {
+            return pCommit.mCommitTime >= lNewestKnown;
+        });
+        if (!lAllNewer) {
+            mListedCommits = 0;
+        }
+        mCommits.append(lNewCommits);
+    } else {
+        IndexedCommitList lCommits;
+        if (!loadAllCommits(&lHeadOid, lCommits)) {
+            return false;
+        }
+        if (mHaveLastHead) {
+            // history has been rewritten, probably old backups were purged.
+            dropRemovedSnapshots(lCommits);
+        }
+        mCommits = lCommits;
+        mListedCommits = 0;
+    }
+    std::stable_sort(mCommits.begin(), mCommits.end(), [](const IndexedCommit &pFirst, const IndexedCommit &pSecond) {
+        return pFirst.mCommitTime < pSecond.mCommitTime;
+    });
+    mLastHead = lHeadOid;
+    mHaveLastHead = true;
+    return true;
+}
+
+void Branch::dropRemovedSnapshots(const IndexedCommitList &pCommits)
+{
+    QHash<QString, git_oid> lRemaining;
+    for (const IndexedCommit &lCommit : pCommits) {
+        lRemaining.insert(vfsTimeToString(lCommit.mCommitTime), lCommit.mTreeOid);
+    }
+    auto lIter = mSnapshots.begin();
+    while (lIter != mSnapshots.end()) {
+        Snapshot *lSnapshot = lIter.value();
+        auto lRemainingIter = lRemaining.constFind(lIter.key());
+        if (lRemainingIter != lRemaining.constEnd() && git_oid_equal(&lRemainingIter.value(), lSnapshot->oid())) {
+            ++lIter;
+            continue;
+        }
+        mSubNodes.removeOne(lSnapshot);
+        mListedSnapshots.remove(lSnapshot);
+        mArena->destroyTree(lSnapshot);
+        lIter = mSnapshots.erase(lIter);
+    }
+}
+
+bool Branch::loadAllCommits(const git_oid *pHead, IndexedCommitList &pCommits)
+{
+    git_oid lIndexedHead;
+    bool lHaveIndexed = mIndex != nullptr && mIndex->commits(mRefName, lIndexedHead, pCommits);
+    if (lHaveIndexed && !git_oid_equal(&lIndexedHead, pHead) && 1 != git_graph_descendant_of(mRepository, pHead, &lIndexedHead)) {
+        // index was built from a history that has since been rewritten. Start over.
+        lHaveIndexed = false;
+        pCommits.clear();
+    }
+    if (lHaveIndexed && git_oid_equal(&lIndexedHead, pHead)) {
+        return true;
+    }
+    IndexedCommitList lNewCommits;
+    if (!walkCommits(pHead, lHaveIndexed ? &lIndexedHead : nullptr, lNewCommits)) {
+        return false;
+    }
+    if (mIndex != nullptr) {
+        mIndex->addCommits(mRefName, pHead, lNewCommits, !lHaveIndexed);
+    }
+    pCommits.append(lNewCommits);
+    return true;
+}
+
+bool Branch::walkCommits(const git_oid *pHead, const git_oid *pHide, IndexedCommitList &pCommits)
+{
+    CommitGraph lGraph;
+    if (lGraph.open(mRepository)) {
+        IndexedCommitList lCommits;
+        auto lAddCommit = [&lCommits](const git_oid *pCommit, const git_oid *pTree, qint64 pCommitTime) {
+            lCommits.append(IndexedCommit{*pCommit, *pTree, pCommitTime});
+        };
+        if (walkCommitGraph(mRepository, lGraph, pHead, pHide, lAddCommit)) {
+            pCommits.append(lCommits);
+            return true;
+        }
+    }
+
+    git_revwalk_reset(mRevisionWalker);
+    if (0 != git_revwalk_push(mRevisionWalker, pHead)) {
+        return false;
+    }
+    if (pHide != nullptr && 0 != git_revwalk_hide(mRevisionWalker, pHide)) {
+        git_revwalk_reset(mRevisionWalker);
+        return false;
+    }
     git_oid lOid;
     while (0 == git_revwalk_next(&lOid, mRevisionWalker)) {
         git_commit *lCommit;
         if (0 != git_commit_lookup(&lCommit, mRepository, &lOid)) {
             continue;
         }
-        QString lCommitTimeLocal = vfsTimeToString(git_commit_time(lCommit));
-        if (!mSubNodes->contains(lCommitTimeLocal)) {
-            Directory *lDirectory = new ArchivedDirectory(this, git_commit_tree_id(lCommit), lCommitTimeLocal, DEFAULT_MODE_DIRECTORY);
-            lDirectory->mMtime = git_commit_time(lCommit);
-            mSubNodes->insert(lCommitTimeLocal, lDirectory);
-        }
+        IndexedCommit lIndexedCommit{lOid, *git_commit_tree_id(lCommit), git_commit_time(lCommit)};
+        pCommits.append(lIndexedCommit);
         git_commit_free(lCommit);
     }
+    return true;
 }
 
-Repository::Repository(QObject *pParent, const QString &pRepositoryPath)
-    : Directory(pParent, pRepositoryPath, DEFAULT_MODE_DIRECTORY)
+Repository::Repository(Node *pParent, const QString &pRepositoryPath)
+    : Directory(pParent, QString(), DEFAULT_MODE_DIRECTORY)
+    , mOwnRepository(nullptr)
+    , mOwnRevisionWalker(nullptr)
+    , mOwnIndex(nullptr)
+    , mOwnArena(new NodeArena())
+    , mOwnPrefetcher(new DirectoryPrefetcher())
 {
-    if (!objectName().endsWith(QLatin1Char('/'))) {
-        setObjectName(objectName() + QLatin1Char('/'));
+    // the name must live in this repository's arena, not the one current when created.
+    QString lName = pRepositoryPath;
+    if (!lName.endsWith(QLatin1Char('/'))) {
+        lName.append(QLatin1Char('/'));
     }
-    if (0 != git_repository_open(&mRepository, pRepositoryPath.toLocal8Bit())) {
+    mName = mOwnArena->intern(lName);
+    if (0 != openBupRepository(&mOwnRepository, pRepositoryPath)) {
         qCWarning(KUPKIO) << "could not open repository " << pRepositoryPath;
-        mRepository = nullptr;
+        mOwnRepository = nullptr;
+        makeCurrent();
         return;
     }
     git_strarray lBranchNames;
-    git_reference_list(&lBranchNames, mRepository);
+    git_reference_list(&lBranchNames, mOwnRepository);
     for (uint i = 0; i < lBranchNames.count; ++i) {
         QString lRefName = QString::fromLocal8Bit(lBranchNames.strings[i]);
         if (lRefName.startsWith(QStringLiteral("refs/heads/"))) {
@@ -491,21 +1005,57 @@ Repository::Repository(QObject *pParent, const QString &pRepositoryPath)
     }
     git_strarray_free(&lBranchNames);
 
-    if (0 != git_revwalk_new(&mRevisionWalker, mRepository)) {
+    if (0 != git_revwalk_new(&mOwnRevisionWalker, mOwnRepository)) {
         qCWarning(KUPKIO) << "could not create a revision walker in repository " << pRepositoryPath;
-        mRevisionWalker = nullptr;
+        mOwnRevisionWalker = nullptr;
+        makeCurrent();
         return;
     }
+    mOwnIndex = new VfsIndex(objectName());
+    makeCurrent();
 }
 
 Repository::~Repository()
 {
-    if (mRepository != nullptr) {
-        git_repository_free(mRepository);
+    if (mArena == mOwnArena) {
+        mRepository = nullptr;
+        mRevisionWalker = nullptr;
+        mIndex = nullptr;
+        mArena = nullptr;
+        mPrefetcher = nullptr;
+    }
+    delete mOwnPrefetcher;
+    // nodes may hold libgit2 objects, free them while the repository is still open.
+    delete mOwnArena;
+    delete mOwnIndex;
+    if (mOwnRevisionWalker != nullptr) {
+        git_revwalk_free(mOwnRevisionWalker);
     }
-    if (mRevisionWalker != nullptr) {
-        git_revwalk_free(mRevisionWalker);
+    if (mOwnRepository != nullptr) {
+        git_repository_free(mOwnRepository);
+    }
+}
+
+void Repository::makeCurrent()
+{
+    mRepository = mOwnRepository;
+    mRevisionWalker = mOwnRevisionWalker;
+    mIndex = mOwnIndex;
+    mArena = mOwnArena;
+    mPrefetcher = mOwnPrefetcher;
+}
+
+quint64 Repository::memoryUsage() const
+{
+    return mOwnArena->bytesUsed();
+}
+
+void Repository::flushIndex()
+{
+    if (mOwnIndex != nullptr) {
+        mOwnIndex->flush();
     }
+    qCDebug(KUPKIO) << "nodes in memory:" << mOwnArena->nodeCount() << "using about" << mOwnArena->bytesUsed() << "bytes";
 }
 
 void Repository::generateSubNodes()
@@ -515,8 +1065,7 @@ void Repository::generateSubNodes()
     for (uint i = 0; i < lBranchNames.count; ++i) {
         auto lRefName = QString::fromLocal8Bit(lBranchNames.strings[i]);
         if (lRefName.startsWith(QStringLiteral("refs/heads/"))) {
-            auto lBranch = new Branch(this, lBranchNames.strings[i]);
-            mSubNodes->insert(lBranch->objectName(), lBranch);
+            mSubNodes.append(mArena->create<Branch>(this, lBranchNames.strings[i]));
         }
     }
     git_strarray_free(&lBranchNames);
@@ -5,63 +5,126 @@
 #ifndef BUPVFS_H
 #define BUPVFS_H
 
-#include <QHash>
-#include <QObject>
+#include <QSet>
+#include <QVector>
 #include <kio/global.h>
 #include <sys/types.h>
 
 #include "vfshelpers.h"
+#include "vfsindex.h"
 
-class Node : public QObject, public Metadata
+class ChunkReadAhead;
+class DirectoryPrefetcher;
+class GitWorkerPool;
+class NodeArena;
+
+// Repository access needed to fill in details of a node, done without touching the
+// node itself so that it can run on a thread with its own repository handle.
+struct NodeLookup {
+    enum Type { BlobSize, ChunkFileSize, DirectoryMetadata };
+    Type mType = BlobSize;
+    git_oid mOid{};
+    quint64 mSize = 0;
+    Metadata mMetadata;
+    bool mSuccess = false;
+};
+void performNodeLookup(git_repository *pRepository, NodeLookup &pLookup);
+
+// Nodes are allocated in the NodeArena of the repository and live until it is closed
+// or their snapshot is removed from the branch, never delete them directly. There can be millions of them, so
+// they only keep the metadata fields that are shown and point to an interned name.
+class Node
 {
-    Q_OBJECT
 public:
-    Node(QObject *pParent, const QString &pName, qint64 pMode);
-    ~Node() override
+    Node(Node *pParent, const QString &pName, qint64 pMode);
+    virtual ~Node()
+    {
+    }
+    Node *parent() const
+    {
+        return mParent;
+    }
+    const QString &objectName() const
+    {
+        return *mName;
+    }
+    virtual void setMetadata(const Metadata &pMetadata);
+    // Some nodes only fill in their metadata when asked to, call before using it.
+    virtual void loadMetadata()
+    {
+    }
+    // Returns false if nothing needs to be looked up, otherwise fills in pLookup. Pass
+    // it to applyLookup() after performNodeLookup() has been called on it.
+    virtual bool prepareLookup(NodeLookup &pLookup)
+    {
+        Q_UNUSED(pLookup)
+        return false;
+    }
+    virtual void applyLookup(const NodeLookup &pLookup)
     {
+        Q_UNUSED(pLookup)
     }
-    virtual int readMetadata(VintStream &pMetadataStream);
+    // empty unless this is a symlink
+    virtual QString symlinkTarget() const
+    {
+        return QString();
+    }
+    // Guessed from the name unless File::detectMimeTypeFromContent() has been called.
+    QString mimeType() const;
     Node *resolve(const QString &pPath, bool pFollowLinks = false);
     Node *resolve(const QStringList &pPathList, bool pFollowLinks = false);
     QString completePath();
     Node *parentCommit();
     //	Node *parentRepository();
-    QString mMimeType;
+
+    qint64 mAtime;
+    qint64 mMtime;
+    qint64 mSize; // negative if invalid
+    quint32 mMode;
+    quint32 mUid;
+    quint32 mGid;
 
 protected:
+    friend class NodeArena;
+    void storeMetadata(const Metadata &pMetadata);
+    quint32 mArenaSlot; // position in the arena's node list, fills the padding after mGid
+    Node *mParent;
+    const QString *mName; // interned in mArena
     static git_revwalk *mRevisionWalker;
     static git_repository *mRepository;
+    static VfsIndex *mIndex;
+    static NodeArena *mArena;
+    static DirectoryPrefetcher *mPrefetcher;
 };
 
-typedef QHash<QString, Node *> NodeMap;
-typedef QHashIterator<QString, Node *> NodeMapIterator;
+// Sorted by name, see Directory::subNode()
+typedef QVector<Node *> NodeList;
 
 class Directory : public Node
 {
-    Q_OBJECT
 public:
-    Directory(QObject *pParent, const QString &pName, qint64 pMode);
-    ~Directory() override
-    {
-        delete mSubNodes;
-    }
-    virtual NodeMap subNodes();
+    Directory(Node *pParent, const QString &pName, qint64 pMode);
+    const NodeList &subNodes();
+    virtual Node *subNode(const QString &pName);
     virtual void reload()
     {
     }
 
 protected:
+    // appends to mSubNodes, sortSubNodes() is called afterwards.
     virtual void generateSubNodes()
     {
     }
-    NodeMap *mSubNodes;
+    void sortSubNodes();
+    friend class NodeArena; // walks mSubNodes in destroyTree()
+    NodeList mSubNodes;
+    bool mSubNodesGenerated;
 };
 
 class File : public Node
 {
-    Q_OBJECT
 public:
-    File(QObject *pParent, const QString &pName, qint64 pMode)
+    File(Node *pParent, const QString &pName, qint64 pMode)
         : Node(pParent, pName, pMode)
     {
         mOffset = 0;
@@ -83,21 +146,31 @@ public:
         return 0; // success
     }
     virtual int read(QByteArray &pChunk, qint64 pReadSize = -1) = 0;
-    int readMetadata(VintStream &pMetadataStream) override;
+    // Frees what was kept from the repository for reading, it is looked up again if
+    // the file is read later. Call when done with a file that may be large.
+    virtual void releaseContent()
+    {
+    }
+    // Only the file name is used to guess a MIME type when listing directories, call this
+    // to have it refined from the file content. Result is kept in the arena.
+    void detectMimeTypeFromContent();
+    void applyLookup(const NodeLookup &pLookup) override;
 
 protected:
     virtual quint64 calculateSize() = 0;
+    bool prepareSizeLookup(NodeLookup &pLookup, const git_oid *pOid, NodeLookup::Type pType);
     quint64 mOffset;
     quint64 mCachedSize;
 };
 
 class BlobFile : public File
 {
-    Q_OBJECT
 public:
     BlobFile(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode);
     ~BlobFile() override;
     int read(QByteArray &pChunk, qint64 pReadSize = -1) override;
+    void releaseContent() override;
+    bool prepareLookup(NodeLookup &pLookup) override;
 
 protected:
     git_blob *cachedBlob();
@@ -108,30 +181,41 @@ protected:
 
 class Symlink : public BlobFile
 {
-    Q_OBJECT
 public:
+    // target is filled in from the decoded directory listing, see readDirectoryEntries()
     Symlink(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode)
         : BlobFile(pParent, pOid, pName, pMode)
     {
-        QByteArray lArray;
-        if (0 == read(lArray)) {
-            mSymlinkTarget = QString::fromUtf8(lArray.data(), lArray.size());
-            Symlink::seek(0);
-        }
     }
+    void setMetadata(const Metadata &pMetadata) override;
+    QString symlinkTarget() const override
+    {
+        return mTarget;
+    }
+
+protected:
+    QString mTarget;
 };
 
 class ChunkFile : public File
 {
-    Q_OBJECT
 public:
     ChunkFile(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode);
     ~ChunkFile() override;
     int seek(quint64 pOffset) override;
     int read(QByteArray &pChunk, qint64 pReadSize = -1) override;
+    void releaseContent() override;
+    bool prepareLookup(NodeLookup &pLookup) override;
+    // Returns a reader starting from the current position that fetches chunks in
+    // the background, or null if the chunk tree could not be read. Uses the chunk
+    // table if there already is one, otherwise the tree is walked while reading.
+    ChunkReadAhead *readAhead(GitWorkerPool *pPool, int pDepth);
 
 protected:
     quint64 calculateSize() override;
+    bool ensureChunkTable();
+    int chunkIndexAt(quint64 pOffset);
+    int readFromChunkTable(QByteArray &pChunk, qint64 pReadSize);
 
     git_oid mOid;
     git_blob *mCurrentBlob;
@@ -145,47 +229,106 @@ protected:
 
     QList<TreePosition *> mPositionStack;
     bool mValidSeekPosition;
+
+    // Flat list of all leaf chunks, built on first seek. Walking the tree with
+    // mPositionStack is only used until then, or if the table can't be built.
+    enum ChunkTableState { ChunkTableNotBuilt, ChunkTableBuilt, ChunkTableFailed };
+    ChunkTableState mChunkTableState;
+    ChunkTable mChunks;
+    int mChunkIndex;
+    quint64 mChunkSkipSize;
 };
 
 class ArchivedDirectory : public Directory
 {
-    Q_OBJECT
 public:
+    // Nothing is read from the repository until metadata or sub nodes are needed.
     ArchivedDirectory(Node *pParent, const git_oid *pOid, const QString &pName, qint64 pMode);
+    void setMetadata(const Metadata &pMetadata) override;
+    void loadMetadata() override;
+    bool prepareLookup(NodeLookup &pLookup) override;
+    void applyLookup(const NodeLookup &pLookup) override;
+    const git_oid *oid() const
+    {
+        return &mOid;
+    }
+    // true if listing this directory would have to decode its tree
+    bool needsDecoding() const;
+    // Destroys all nodes below this one, they are generated again when asked for.
+    // Pointers to any of them are no longer valid after this.
+    void dropSubNodes();
 
 protected:
     void generateSubNodes() override;
     git_oid mOid{};
-    git_blob *mMetadataBlob{};
-    git_tree *mTree;
-    VintStream *mMetadataStream;
+    bool mMetadataLoaded;
+};
+
+// Root directory of one backup, named and timestamped after the commit.
+class Snapshot : public ArchivedDirectory
+{
+public:
+    Snapshot(Node *pParent, const git_oid *pTreeOid, const QString &pName, qint64 pCommitTime);
+    void setMetadata(const Metadata &pMetadata) override;
 };
 
 class Branch : public Directory
 {
-    Q_OBJECT
 public:
     Branch(Node *pParent, const char *pName);
     void reload() override;
+    // Besides the snapshot names, accepts "latest" and "@<ISO date and time>". These
+    // are resolved without creating nodes for all the other snapshots.
+    Node *subNode(const QString &pName) override;
 
 protected:
     void generateSubNodes() override;
+    Node *findSnapshot(const QString &pName);
+    Snapshot *snapshotNode(const IndexedCommit &pCommit);
+    // appends pSnapshot to mSubNodes unless it is there already
+    void listSnapshot(Snapshot *pSnapshot);
+    // Brings mCommits up to date with the branch head, walking only new commits.
+    bool updateCommits();
+    // Frees the nodes of snapshots that are not among pCommits anymore.
+    void dropRemovedSnapshots(const IndexedCommitList &pCommits);
+    bool loadAllCommits(const git_oid *pHead, IndexedCommitList &pCommits);
+    // commits reachable from pHead but not from pHide, pHide can be null.
+    bool walkCommits(const git_oid *pHead, const git_oid *pHide, IndexedCommitList &pCommits);
     QByteArray mRefName;
+    git_oid mLastHead{}; // head at the time of the last walk
+    bool mHaveLastHead;
+    IndexedCommitList mCommits; // sorted by commit time, oldest first
+    int mListedCommits; // how many of mCommits are in mSubNodes, zero means all must be listed again
+    QHash<QString, Snapshot *> mSnapshots;
+    QSet<const Node *> mListedSnapshots; // the ones in mSubNodes
 };
 
 class Repository : public Directory
 {
-    Q_OBJECT
 public:
-    Repository(QObject *pParent, const QString &pRepositoryPath);
+    Repository(Node *pParent, const QString &pRepositoryPath);
     ~Repository() override;
     bool isValid()
     {
-        return mRepository != nullptr && mRevisionWalker != nullptr;
+        return mOwnRepository != nullptr && mOwnRevisionWalker != nullptr;
+    }
+    // Nodes use the libgit2 handles, index and arena of the current repository. Call
+    // this before resolving paths in this repository when several are open.
+    void makeCurrent();
+    quint64 memoryUsage() const;
+    void flushIndex();
+    DirectoryPrefetcher *prefetcher() const
+    {
+        return mOwnPrefetcher;
     }
 
 protected:
     void generateSubNodes() override;
+    git_repository *mOwnRepository;
+    git_revwalk *mOwnRevisionWalker;
+    VfsIndex *mOwnIndex;
+    NodeArena *mOwnArena;
+    DirectoryPrefetcher *mOwnPrefetcher;
 };
 
 #endif // BUPVFS_H
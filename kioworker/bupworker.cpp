@@ -3,19 +3,38 @@
 // SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
 
 #include "bupvfs.h"
+#include "chunkreadahead.h"
+#include "directoryprefetcher.h"
+#include "gitworkerpool.h"
+#include "kupkio_debug.h"
+#include "tarstreamer.h"
 
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QSharedPointer>
 #include <QUrl>
+#include <QUrlQuery>
 #include <QVarLengthArray>
+#include <QWaitCondition>
 
 #include <KIO/WorkerBase>
 using namespace KIO;
 #include <KLocalizedString>
 #include <KProcess>
 
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Pseudo plugin class to embed meta data
 class KIOPluginForMetaData : public QObject
@@ -30,6 +49,7 @@ public:
     BupWorker(const QByteArray &pPoolSocket, const QByteArray &pAppSocket);
     ~BupWorker() override;
     KIO::WorkerResult close() override;
+    KIO::WorkerResult copy(const QUrl &pSource, const QUrl &pDest, int pPermissions, KIO::JobFlags pFlags) override;
     KIO::WorkerResult get(const QUrl &pUrl) override;
     KIO::WorkerResult listDir(const QUrl &pUrl) override;
     KIO::WorkerResult open(const QUrl &pUrl, QIODevice::OpenMode pMode) override;
@@ -40,14 +60,33 @@ public:
 
 private:
     bool checkCorrectRepository(const QUrl &pUrl, QStringList &pPathInRepository);
+    KIO::WorkerResult getArchive(Directory *pDirectory);
+    bool isRepositoryPath(const QString &pPath);
+    void addOpenRepository(Repository *pRepository);
     QString getUserName(uid_t pUid);
     QString getGroupName(gid_t pGid);
-    void createUDSEntry(Node *pNode, KIO::UDSEntry &pUDSEntry, int pDetails);
+    void createUDSEntry(Node *pNode, KIO::UDSEntry &pUDSEntry, int pDetails, bool pLoadMetadata = true);
+    void listNodes(const NodeList &pNodes, int pDetails, bool pLoadMetadata);
+    void prefetchSubDirectories(Directory *pDirectory);
+    void cancelPrefetch();
+    GitWorkerPool *workerPool();
+    ChunkReadAhead *createReadAhead(File *pFile);
+    void setObjectCacheLimits();
+    void startDataBuffering();
+    void bufferData(const QByteArray &pData);
+    void flushData();
 
     QHash<uid_t, QString> mUsercache;
     QHash<gid_t, QString> mGroupcache;
     Repository *mRepository;
+    // most recently used first, includes mRepository
+    QList<Repository *> mOpenRepositories;
+    QHash<QString, bool> mRepositoryPaths;
     File *mOpenFile;
+    GitWorkerPool *mWorkerPool;
+    // bup chunks are small, gather them into bigger messages to the client
+    QByteArray mDataBuffer;
+    int mDataMessageSize;
 };
 
 BupWorker::BupWorker(const QByteArray &pPoolSocket, const QByteArray &pAppSocket)
@@ -55,12 +94,15 @@ BupWorker::BupWorker(const QByteArray &pPoolSocket, const QByteArray &pAppSocket
 {
     mRepository = nullptr;
     mOpenFile = nullptr;
+    mWorkerPool = nullptr;
+    mDataMessageSize = 0;
     git_libgit2_init();
 }
 
 BupWorker::~BupWorker()
 {
-    delete mRepository;
+    delete mWorkerPool;
+    qDeleteAll(mOpenRepositories);
     git_libgit2_shutdown();
 }
 
@@ -70,6 +112,163 @@ KIO::WorkerResult BupWorker::close()
     return KIO::WorkerResult::pass();
 }
 
+static bool writeAll(int pFd, const char *pData, size_t pSize, off_t pOffset)
+{
+    while (pSize > 0) {
+        ssize_t lWritten = pwrite(pFd, pData, pSize, pOffset);
+        if (lWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pData += lWritten;
+        pSize -= static_cast<size_t>(lWritten);
+        pOffset += lWritten;
+    }
+    return true;
+}
+
+static bool isAllZeros(const QByteArray &pData)
+{
+    return !pData.isEmpty() && pData.at(0) == '\0' && 0 == memcmp(pData.constData(), pData.constData() + 1, static_cast<size_t>(pData.size() - 1));
+}
+
+KIO::WorkerResult BupWorker::copy(const QUrl &pSource, const QUrl &pDest, int pPermissions, KIO::JobFlags pFlags)
+{
+    // only called for copying to local files, see "copyToFile" in bup.json
+    if (!pDest.isLocalFile()) {
+        return KIO::WorkerResult::fail(KIO::ERR_UNSUPPORTED_ACTION, pDest.toDisplayString());
+    }
+    QStringList lPathInRepo;
+    if (!checkCorrectRepository(pSource, lPathInRepo)) {
+        return KIO::WorkerResult::fail(KIO::ERR_WORKER_DEFINED, i18n("No bup repository found.\n%1", pSource.toDisplayString()));
+    }
+    Node *lNode = mRepository->resolve(lPathInRepo, true);
+    if (lNode == nullptr) {
+        return KIO::WorkerResult::fail(KIO::ERR_DOES_NOT_EXIST, lPathInRepo.join(QStringLiteral("/")));
+    }
+    File *lFile = dynamic_cast<File *>(lNode);
+    if (lFile == nullptr) {
+        return KIO::WorkerResult::fail(KIO::ERR_IS_DIRECTORY, lPathInRepo.join(QStringLiteral("/")));
+    }
+
+    const QString lDestPath = pDest.toLocalFile();
+    const QByteArray lDestPathEncoded = QFile::encodeName(lDestPath);
+    struct stat lDestStat;
+    if (0 == ::stat(lDestPathEncoded.constData(), &lDestStat)) {
+        if (S_ISDIR(lDestStat.st_mode)) {
+            return KIO::WorkerResult::fail(KIO::ERR_DIR_ALREADY_EXIST, lDestPath);
+        }
+        if (!(pFlags & KIO::Overwrite)) {
+            return KIO::WorkerResult::fail(KIO::ERR_FILE_ALREADY_EXIST, lDestPath);
+        }
+    }
+    // Write to a temporary file next to the destination and only replace an existing
+    // file with it once the copy is complete.
+    const QFileInfo lDestInfo(lDestPath);
+    QByteArray lTempPath = QFile::encodeName(lDestInfo.absolutePath() + QStringLiteral("/.") + lDestInfo.fileName() + QStringLiteral(".XXXXXX"));
+    int lFd = ::mkstemp(lTempPath.data());
+    if (lFd < 0) {
+        return KIO::WorkerResult::fail(errno == EACCES ? KIO::ERR_WRITE_ACCESS_DENIED : KIO::ERR_CANNOT_OPEN_FOR_WRITING, lDestPath);
+    }
+    ::fcntl(lFd, F_SETFD, FD_CLOEXEC);
+    auto lFail = [&](int pError) {
+        lFile->releaseContent();
+        ::close(lFd);
+        ::unlink(lTempPath.constData());
+        return KIO::WorkerResult::fail(pError, lDestPath);
+    };
+
+    const quint64 lSize = lFile->size();
+    totalSize(lSize);
+#ifdef Q_OS_LINUX
+    // reserve all space up front, gives less fragmentation and fails early if the disk is full.
+    if (lSize > 0 && 0 != fallocate(lFd, 0, 0, static_cast<off_t>(lSize)) && errno == ENOSPC) {
+        return lFail(KIO::ERR_DISK_FULL);
+    }
+#endif
+
+    if (0 != lFile->seek(0) && lSize > 0) {
+        return lFail(KIO::ERR_CANNOT_READ);
+    }
+    QScopedPointer<ChunkReadAhead> lReadAhead(createReadAhead(lFile));
+    const int lBufferSize = qMax(64 * 1024, configValue(QStringLiteral("CopyBufferSize"), 4 * 1024 * 1024));
+    QByteArray lBuffer;
+    lBuffer.reserve(lBufferSize);
+    quint64 lBufferOffset = 0; // file offset of the first byte in lBuffer
+    quint64 lProcessedSize = 0;
+    QElapsedTimer lProgressTimer;
+    lProgressTimer.start();
+
+    QByteArray lData;
+    int lRetVal;
+    while (0 == (lRetVal = lReadAhead ? lReadAhead->read(lData) : lFile->read(lData))) {
+        if (lData.size() >= 4096 && isAllZeros(lData)) {
+            // leave a hole instead of writing zeros.
+            if (!writeAll(lFd, lBuffer.constData(), static_cast<size_t>(lBuffer.size()), static_cast<off_t>(lBufferOffset))) {
+                return lFail(errno == ENOSPC ? KIO::ERR_DISK_FULL : KIO::ERR_CANNOT_WRITE);
+            }
+            lBuffer.resize(0);
+#ifdef Q_OS_LINUX
+            // the range was preallocated, give it back. Failing is harmless, it reads as zeros anyway.
+            fallocate(lFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(lProcessedSize), static_cast<off_t>(lData.size()));
+#endif
+            lProcessedSize += static_cast<quint64>(lData.size());
+            lBufferOffset = lProcessedSize;
+        } else {
+            lBuffer.append(lData);
+            lProcessedSize += static_cast<quint64>(lData.size());
+            if (lBuffer.size() >= lBufferSize) {
+                if (!writeAll(lFd, lBuffer.constData(), static_cast<size_t>(lBuffer.size()), static_cast<off_t>(lBufferOffset))) {
+                    return lFail(errno == ENOSPC ? KIO::ERR_DISK_FULL : KIO::ERR_CANNOT_WRITE);
+                }
+                lBuffer.resize(0);
+                lBufferOffset = lProcessedSize;
+            }
+        }
+        if (lProgressTimer.hasExpired(100)) {
+            processedSize(lProcessedSize);
+            lProgressTimer.start();
+        }
+    }
+    lFile->releaseContent();
+    if (lRetVal != KIO::ERR_NO_CONTENT) {
+        return lFail(lRetVal);
+    }
+    if (!writeAll(lFd, lBuffer.constData(), static_cast<size_t>(lBuffer.size()), static_cast<off_t>(lBufferOffset))) {
+        return lFail(errno == ENOSPC ? KIO::ERR_DISK_FULL : KIO::ERR_CANNOT_WRITE);
+    }
+    // needed if the file ends with a hole
+    if (0 != ftruncate(lFd, static_cast<off_t>(lSize))) {
+        return lFail(KIO::ERR_CANNOT_WRITE);
+    }
+
+    const mode_t lMode = pPermissions != -1 ? static_cast<mode_t>(pPermissions) : static_cast<mode_t>(lFile->mMode & 07777);
+    if (0 != fchmod(lFd, lMode)) {
+        qCWarning(KUPKIO) << "could not set permissions of" << lDestPath;
+    }
+    struct timespec lTimes[2];
+    lTimes[0].tv_sec = static_cast<time_t>(lFile->mAtime);
+    lTimes[0].tv_nsec = 0;
+    lTimes[1].tv_sec = static_cast<time_t>(lFile->mMtime);
+    lTimes[1].tv_nsec = 0;
+    if (0 != futimens(lFd, lTimes)) {
+        qCWarning(KUPKIO) << "could not set modification time of" << lDestPath;
+    }
+    if (0 != ::close(lFd)) {
+        ::unlink(lTempPath.constData());
+        return KIO::WorkerResult::fail(KIO::ERR_CANNOT_WRITE, lDestPath);
+    }
+    if (0 != ::rename(lTempPath.constData(), lDestPathEncoded.constData())) {
+        const int lError = errno == EACCES ? KIO::ERR_WRITE_ACCESS_DENIED : KIO::ERR_CANNOT_WRITE;
+        ::unlink(lTempPath.constData());
+        return KIO::WorkerResult::fail(lError, lDestPath);
+    }
+    processedSize(lProcessedSize);
+    return KIO::WorkerResult::pass();
+}
+
 KIO::WorkerResult BupWorker::get(const QUrl &pUrl)
 {
     QStringList lPathInRepo;
@@ -85,12 +284,18 @@ KIO::WorkerResult BupWorker::get(const QUrl &pUrl)
     if (lNode == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_DOES_NOT_EXIST, lPathInRepo.join(QStringLiteral("/")));
     }
-    File *lFile = qobject_cast<File *>(lNode);
+    File *lFile = dynamic_cast<File *>(lNode);
     if (lFile == nullptr) {
+        // bup:///path/to/repo/branch/snapshot/folder?format=tar gives the whole folder as one tar stream.
+        auto lDir = dynamic_cast<Directory *>(lNode);
+        if (lDir != nullptr && QUrlQuery(pUrl).queryItemValue(QStringLiteral("format")) == QStringLiteral("tar")) {
+            return getArchive(lDir);
+        }
         return KIO::WorkerResult::fail(KIO::ERR_IS_DIRECTORY, lPathInRepo.join(QStringLiteral("/")));
     }
 
-    mimeType(lFile->mMimeType);
+    lFile->detectMimeTypeFromContent();
+    mimeType(lFile->mimeType());
     // Emit total size AFTER mimetype
     totalSize(lFile->size());
 
@@ -109,14 +314,34 @@ KIO::WorkerResult BupWorker::get(const QUrl &pUrl)
         }
     }
 
+    // Chunked files are read through a pipeline where the next chunks are looked up
+    // and inflated by other threads while this one is sending data.
+    QScopedPointer<ChunkReadAhead> lReadAhead(createReadAhead(lFile));
+    QElapsedTimer lSpeedTimer, lProgressTimer;
+    lSpeedTimer.start();
+    lProgressTimer.start();
+    startDataBuffering();
+
     QByteArray lResultArray;
     int lRetVal;
-    while (0 == (lRetVal = lFile->read(lResultArray))) {
-        data(lResultArray);
+    while (0 == (lRetVal = lReadAhead ? lReadAhead->read(lResultArray) : lFile->read(lResultArray))) {
+        bufferData(lResultArray);
         lProcessedSize += static_cast<quint64>(lResultArray.length());
-        processedSize(lProcessedSize);
+        if (lProgressTimer.hasExpired(100)) {
+            processedSize(lProcessedSize);
+            lProgressTimer.start();
+        }
+        if (lReadAhead && lSpeedTimer.hasExpired(1000)) {
+            speed(static_cast<unsigned long>(lReadAhead->bytesPerSecond()));
+            lSpeedTimer.start();
+        }
+    }
+    lFile->releaseContent(); // a blob would otherwise stay in memory as long as the node
+    if (lReadAhead) {
+        qCDebug(KUPKIO) << "read" << lReadAhead->bytesRead() << "bytes with read-ahead at" << lReadAhead->bytesPerSecond() / 1024 << "KiB/s";
     }
     if (lRetVal == KIO::ERR_NO_CONTENT) {
+        flushData();
         data(QByteArray());
         processedSize(lProcessedSize);
         return KIO::WorkerResult::pass();
@@ -125,6 +350,32 @@ KIO::WorkerResult BupWorker::get(const QUrl &pUrl)
     }
 }
 
+KIO::WorkerResult BupWorker::getArchive(Directory *pDirectory)
+{
+    mimeType(QStringLiteral("application/x-tar"));
+    startDataBuffering();
+    QElapsedTimer lProgressTimer;
+    lProgressTimer.start();
+    quint64 lProcessedSize = 0;
+    TarStreamer lStreamer(workerPool(), configValue(QStringLiteral("ReadAheadDepth"), 16), [&](const QByteArray &pData) {
+        bufferData(pData);
+        lProcessedSize += static_cast<quint64>(pData.size());
+        if (lProgressTimer.hasExpired(100)) {
+            processedSize(lProcessedSize);
+            lProgressTimer.start();
+        }
+    });
+    int lRetVal = lStreamer.write(pDirectory);
+    mRepository->flushIndex();
+    if (lRetVal != 0) {
+        return KIO::WorkerResult::fail(lRetVal, pDirectory->completePath());
+    }
+    flushData();
+    data(QByteArray());
+    processedSize(lProcessedSize);
+    return KIO::WorkerResult::pass();
+}
+
 KIO::WorkerResult BupWorker::listDir(const QUrl &pUrl)
 {
     QStringList lPathInRepo;
@@ -135,7 +386,7 @@ KIO::WorkerResult BupWorker::listDir(const QUrl &pUrl)
     if (lNode == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_DOES_NOT_EXIST, lPathInRepo.join(QStringLiteral("/")));
     }
-    auto lDir = qobject_cast<Directory *>(lNode);
+    auto lDir = dynamic_cast<Directory *>(lNode);
     if (lDir == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_IS_FILE, lPathInRepo.join(QStringLiteral("/")));
     }
@@ -146,13 +397,116 @@ KIO::WorkerResult BupWorker::listDir(const QUrl &pUrl)
     const QString sDetails = metaData(QStringLiteral("details"));
     const int lDetails = sDetails.isEmpty() ? 2 : sDetails.toInt();
 
-    NodeMapIterator i(lDir->subNodes());
+    // Listing a branch should not have to read the root tree of every snapshot,
+    // the commit time is enough until one of them is entered or stat'ed.
+    const bool lLoadMetadata = dynamic_cast<Branch *>(lDir) == nullptr;
+    listNodes(lDir->subNodes(), lDetails, lLoadMetadata);
+    mRepository->flushIndex();
+    prefetchSubDirectories(lDir);
+    return KIO::WorkerResult::pass();
+}
+
+void BupWorker::prefetchSubDirectories(Directory *pDirectory)
+{
+    const int lMaxCount = configValue(QStringLiteral("PrefetchDirectories"), 8);
+    if (lMaxCount <= 0) {
+        return;
+    }
+    // newest snapshots are the likely ones to be opened in a branch, otherwise
+    // just go from the top.
+    const NodeList &lSubNodes = pDirectory->subNodes();
+    const bool lFromEnd = dynamic_cast<Branch *>(pDirectory) != nullptr;
+    QVector<git_oid> lOids;
+    for (int i = 0; i < lSubNodes.count() && lOids.count() < lMaxCount; ++i) {
+        auto lDir = dynamic_cast<ArchivedDirectory *>(lSubNodes.at(lFromEnd ? lSubNodes.count() - 1 - i : i));
+        if (lDir != nullptr && lDir->needsDecoding()) {
+            lOids.append(*lDir->oid());
+        }
+    }
+    DirectoryPrefetcher *lPrefetcher = mRepository->prefetcher();
+    qCDebug(KUPKIO) << "prefetch hits:" << lPrefetcher->hits() << "misses:" << lPrefetcher->misses() << "given up:" << lPrefetcher->cancelled();
+    if (!lOids.isEmpty()) {
+        lPrefetcher->prefetch(workerPool(),
+                              lOids,
+                              configValue(QStringLiteral("PrefetchTimeBudget"), 2000),
+                              static_cast<quint64>(configValue(QStringLiteral("PrefetchMemoryBudget"), 16)) * 1024 * 1024);
+    }
+}
+
+void BupWorker::cancelPrefetch()
+{
+    for (Repository *lRepository : std::as_const(mOpenRepositories)) {
+        lRepository->prefetcher()->cancel();
+    }
+}
+
+void BupWorker::listNodes(const NodeList &pNodes, int pDetails, bool pLoadMetadata)
+{
+    // Entries are sent in batches. Sizes of files and metadata of subdirectories that
+    // are not in the index yet get looked up for all batches in parallel by the worker
+    // pool, while this thread waits for one batch at a time and sends it.
+    static const int cBatchSize = 200;
+    struct ListingState {
+        QMutex mMutex;
+        QWaitCondition mBatchDone;
+        QVector<QVector<NodeLookup>> mLookups;
+        QVector<bool> mDone;
+    };
+    const int lBatchCount = (pNodes.count() + cBatchSize - 1) / cBatchSize;
+    auto lState = QSharedPointer<ListingState>::create();
+    lState->mLookups.resize(lBatchCount);
+    lState->mDone.fill(false, lBatchCount);
+    QVector<QVector<int>> lLookupNodes(lBatchCount);
+    for (int i = 0; i < pNodes.count(); ++i) {
+        Node *lNode = pNodes.at(i);
+        const bool lIsFile = dynamic_cast<File *>(lNode) != nullptr;
+        if ((lIsFile && pDetails == 0) || (!lIsFile && !pLoadMetadata)) {
+            continue;
+        }
+        NodeLookup lLookup;
+        if (lNode->prepareLookup(lLookup)) {
+            lState->mLookups[i / cBatchSize].append(lLookup);
+            lLookupNodes[i / cBatchSize].append(i);
+        }
+    }
+    for (int lBatch = 0; lBatch < lBatchCount; ++lBatch) {
+        if (lState->mLookups.at(lBatch).isEmpty()) {
+            lState->mDone[lBatch] = true;
+            continue;
+        }
+        NodeLookup *lLookups = lState->mLookups[lBatch].data();
+        const int lCount = lState->mLookups.at(lBatch).count();
+        workerPool()->run([lState, lLookups, lCount, lBatch](git_repository *pRepository) {
+            for (int i = 0; i < lCount; ++i) {
+                performNodeLookup(pRepository, lLookups[i]);
+            }
+            QMutexLocker lLocker(&lState->mMutex);
+            lState->mDone[lBatch] = true;
+            lState->mBatchDone.wakeAll();
+        });
+    }
+
+    UDSEntryList lEntries;
     UDSEntry lEntry;
-    while (i.hasNext()) {
-        createUDSEntry(i.next().value(), lEntry, lDetails);
-        listEntry(lEntry);
+    for (int lBatch = 0; lBatch < lBatchCount; ++lBatch) {
+        {
+            QMutexLocker lLocker(&lState->mMutex);
+            while (!lState->mDone.at(lBatch)) {
+                lState->mBatchDone.wait(&lState->mMutex);
+            }
+        }
+        const QVector<NodeLookup> &lLookups = lState->mLookups.at(lBatch);
+        for (int i = 0; i < lLookups.count(); ++i) {
+            pNodes.at(lLookupNodes.at(lBatch).at(i))->applyLookup(lLookups.at(i));
+        }
+        const int lEnd = qMin(pNodes.count(), (lBatch + 1) * cBatchSize);
+        for (int i = lBatch * cBatchSize; i < lEnd; ++i) {
+            createUDSEntry(pNodes.at(i), lEntry, pDetails, pLoadMetadata);
+            lEntries.append(lEntry);
+        }
+        listEntries(lEntries);
+        lEntries.clear();
     }
-    return KIO::WorkerResult::pass();
 }
 
 KIO::WorkerResult BupWorker::open(const QUrl &pUrl, QIODevice::OpenMode pMode)
@@ -171,7 +525,7 @@ KIO::WorkerResult BupWorker::open(const QUrl &pUrl, QIODevice::OpenMode pMode)
         return KIO::WorkerResult::fail(KIO::ERR_DOES_NOT_EXIST, lPathInRepo.join(QStringLiteral("/")));
     }
 
-    File *lFile = qobject_cast<File *>(lNode);
+    File *lFile = dynamic_cast<File *>(lNode);
     if (lFile == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_IS_DIRECTORY, lPathInRepo.join(QStringLiteral("/")));
     }
@@ -181,7 +535,8 @@ KIO::WorkerResult BupWorker::open(const QUrl &pUrl, QIODevice::OpenMode pMode)
     }
 
     mOpenFile = lFile;
-    mimeType(lFile->mMimeType);
+    lFile->detectMimeTypeFromContent();
+    mimeType(lFile->mimeType());
     totalSize(lFile->size());
     position(0);
     return KIO::WorkerResult::pass();
@@ -189,16 +544,20 @@ KIO::WorkerResult BupWorker::open(const QUrl &pUrl, QIODevice::OpenMode pMode)
 
 KIO::WorkerResult BupWorker::read(filesize_t pSize)
 {
+    cancelPrefetch();
     if (mOpenFile == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_CANNOT_READ, QString());
     }
+    startDataBuffering();
     QByteArray lResultArray;
     int lRetVal = 0;
-    while (pSize > 0 && 0 == (lRetVal = mOpenFile->read(lResultArray, static_cast<int>(pSize)))) {
+    while (pSize > 0 && 0 == (lRetVal = mOpenFile->read(lResultArray, static_cast<qint64>(qMin(pSize, static_cast<filesize_t>(INT_MAX)))))) {
         pSize -= static_cast<quint64>(lResultArray.size());
-        data(lResultArray);
+        bufferData(lResultArray);
     }
-    if (lRetVal == 0) {
+    // reaching the end of the file is not an error, send what was read.
+    if (lRetVal == 0 || lRetVal == KIO::ERR_NO_CONTENT) {
+        flushData();
         data(QByteArray());
         return KIO::WorkerResult::pass();
     } else {
@@ -208,6 +567,7 @@ KIO::WorkerResult BupWorker::read(filesize_t pSize)
 
 KIO::WorkerResult BupWorker::seek(filesize_t pOffset)
 {
+    cancelPrefetch();
     if (mOpenFile == nullptr) {
         return KIO::WorkerResult::fail(KIO::ERR_CANNOT_SEEK, QString());
     }
@@ -252,12 +612,19 @@ KIO::WorkerResult BupWorker::mimetype(const QUrl &pUrl)
         return KIO::WorkerResult::fail(KIO::ERR_DOES_NOT_EXIST, lPathInRepo.join(QStringLiteral("/")));
     }
 
-    mimeType(lNode->mMimeType);
+    File *lFile = dynamic_cast<File *>(lNode);
+    if (lFile != nullptr) {
+        lFile->detectMimeTypeFromContent();
+    }
+    mimeType(lNode->mimeType());
     return KIO::WorkerResult::pass();
 }
 
 bool BupWorker::checkCorrectRepository(const QUrl &pUrl, QStringList &pPathInRepository)
 {
+    // every command working on a URL passes here, background work from the previous
+    // command should not compete with this one.
+    cancelPrefetch();
     // make this worker accept most URLs.. even incorrect ones. (no slash (wrong),
     // one slash (correct), two slashes (wrong), three slashes (correct))
     QString lPath;
@@ -270,14 +637,16 @@ bool BupWorker::checkCorrectRepository(const QUrl &pUrl, QStringList &pPathInRep
         }
     }
 
-    if (mRepository && mRepository->isValid()) {
-        if (lPath.startsWith(mRepository->objectName())) {
-            lPath.remove(0, mRepository->objectName().length());
+    for (int i = 0; i < mOpenRepositories.count(); ++i) {
+        Repository *lRepository = mOpenRepositories.at(i);
+        if (lPath.startsWith(lRepository->objectName())) {
+            lPath.remove(0, lRepository->objectName().length());
             pPathInRepository = lPath.split(QLatin1Char('/'), Qt::SkipEmptyParts);
+            mOpenRepositories.move(i, 0);
+            mRepository = lRepository;
+            mRepository->makeCurrent();
             return true;
         }
-        delete mRepository;
-        mRepository = nullptr;
     }
 
     pPathInRepository = lPath.split(QLatin1Char('/'), Qt::SkipEmptyParts);
@@ -286,15 +655,127 @@ bool BupWorker::checkCorrectRepository(const QUrl &pUrl, QStringList &pPathInRep
         // make sure the repo path will end with a slash
         lRepoPath += pPathInRepository.takeFirst();
         lRepoPath += QStringLiteral("/");
-        if ((QFile::exists(lRepoPath + QStringLiteral("objects")) && QFile::exists(lRepoPath + QStringLiteral("refs")))
-            || (QFile::exists(lRepoPath + QStringLiteral(".git/objects")) && QFile::exists(lRepoPath + QStringLiteral(".git/refs")))) {
-            mRepository = new Repository(nullptr, lRepoPath);
-            return mRepository->isValid();
+        if (isRepositoryPath(lRepoPath)) {
+            setObjectCacheLimits();
+            auto lRepository = new Repository(nullptr, lRepoPath);
+            if (!lRepository->isValid()) {
+                delete lRepository;
+                mRepository = nullptr;
+                if (!mOpenRepositories.isEmpty()) {
+                    mOpenRepositories.first()->makeCurrent();
+                }
+                return false;
+            }
+            addOpenRepository(lRepository);
+            return true;
+        }
+    }
+    // forget the misses, one of these folders could become a repository later.
+    QMutableHashIterator<QString, bool> lIter(mRepositoryPaths);
+    while (lIter.hasNext()) {
+        if (!lIter.next().value()) {
+            lIter.remove();
         }
     }
     return false;
 }
 
+bool BupWorker::isRepositoryPath(const QString &pPath)
+{
+    auto lIter = mRepositoryPaths.constFind(pPath);
+    if (lIter != mRepositoryPaths.constEnd()) {
+        return lIter.value();
+    }
+    bool lResult = (QFile::exists(pPath + QStringLiteral("objects")) && QFile::exists(pPath + QStringLiteral("refs")))
+        || (QFile::exists(pPath + QStringLiteral(".git/objects")) && QFile::exists(pPath + QStringLiteral(".git/refs")));
+    mRepositoryPaths.insert(pPath, lResult);
+    return lResult;
+}
+
+void BupWorker::addOpenRepository(Repository *pRepository)
+{
+    mOpenRepositories.prepend(pRepository);
+    mRepository = pRepository;
+
+    // Keep a few recently used repositories open, switching between them is common
+    // when there are several backup plans. Never close the one just opened.
+    const int lMaxCount = qMax(1, configValue(QStringLiteral("MaxOpenRepositories"), 4));
+    const quint64 lMaxMemory = static_cast<quint64>(configValue(QStringLiteral("OpenRepositoriesMemory"), 256)) * 1024 * 1024;
+    quint64 lTotalMemory = 0;
+    for (Repository *lRepository : std::as_const(mOpenRepositories)) {
+        lTotalMemory += lRepository->memoryUsage();
+    }
+    while (mOpenRepositories.count() > 1 && (mOpenRepositories.count() > lMaxCount || lTotalMemory > lMaxMemory)) {
+        Repository *lRepository = mOpenRepositories.takeLast();
+        lTotalMemory -= lRepository->memoryUsage();
+        qCDebug(KUPKIO) << "closing repository" << lRepository->objectName();
+        delete lRepository;
+        // an open file is only read between open() and close() without any other
+        // commands in between, but don't risk leaving a dangling pointer.
+        mOpenFile = nullptr;
+    }
+    mRepository->makeCurrent();
+}
+
+void BupWorker::startDataBuffering()
+{
+    mDataMessageSize = qMax(1, configValue(QStringLiteral("DataMessageSize"), 1024 * 1024));
+    mDataBuffer.clear();
+    mDataBuffer.reserve(mDataMessageSize);
+}
+
+void BupWorker::bufferData(const QByteArray &pData)
+{
+    if (mDataBuffer.isEmpty() && pData.size() >= mDataMessageSize) {
+        data(pData);
+        return;
+    }
+    mDataBuffer.append(pData);
+    if (mDataBuffer.size() >= mDataMessageSize) {
+        flushData();
+    }
+}
+
+void BupWorker::flushData()
+{
+    if (!mDataBuffer.isEmpty()) {
+        data(mDataBuffer);
+        mDataBuffer.resize(0); // keeps the reserved capacity
+    }
+}
+
+ChunkReadAhead *BupWorker::createReadAhead(File *pFile)
+{
+    auto lChunkFile = dynamic_cast<ChunkFile *>(pFile);
+    if (lChunkFile == nullptr) {
+        return nullptr;
+    }
+    return lChunkFile->readAhead(workerPool(), configValue(QStringLiteral("ReadAheadDepth"), 16));
+}
+
+GitWorkerPool *BupWorker::workerPool()
+{
+    if (mWorkerPool != nullptr && mWorkerPool->repositoryPath() != mRepository->objectName()) {
+        delete mWorkerPool;
+        mWorkerPool = nullptr;
+    }
+    if (mWorkerPool == nullptr) {
+        mWorkerPool = new GitWorkerPool(mRepository->objectName(), configValue(QStringLiteral("ReadAheadThreads"), 2));
+    }
+    return mWorkerPool;
+}
+
+void BupWorker::setObjectCacheLimits()
+{
+    // Directories release their trees and metadata blobs right after decoding them,
+    // libgit2's object cache decides what stays in memory. By default it doesn't keep
+    // blobs at all and only small trees, let it keep .bupm files and big trees too.
+    const auto lCacheSize = static_cast<ssize_t>(configValue(QStringLiteral("ObjectCacheSize"), 64)) * 1024 * 1024;
+    git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, lCacheSize);
+    git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_TREE, static_cast<size_t>(1024 * 1024));
+    git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_BLOB, static_cast<size_t>(64 * 1024));
+}
+
 QString BupWorker::getUserName(uid_t pUid)
 {
     if (!mUsercache.contains(pUid)) {
@@ -321,14 +802,18 @@ QString BupWorker::getGroupName(gid_t pGid)
     return mGroupcache.value(pGid);
 }
 
-void BupWorker::createUDSEntry(Node *pNode, UDSEntry &pUDSEntry, int pDetails)
+void BupWorker::createUDSEntry(Node *pNode, UDSEntry &pUDSEntry, int pDetails, bool pLoadMetadata)
 {
+    if (pLoadMetadata) {
+        pNode->loadMetadata();
+    }
     pUDSEntry.clear();
     pUDSEntry.fastInsert(KIO::UDSEntry::UDS_NAME, pNode->objectName());
-    if (!pNode->mSymlinkTarget.isEmpty()) {
-        pUDSEntry.fastInsert(KIO::UDSEntry::UDS_LINK_DEST, pNode->mSymlinkTarget);
+    const QString lSymlinkTarget = pNode->symlinkTarget();
+    if (!lSymlinkTarget.isEmpty()) {
+        pUDSEntry.fastInsert(KIO::UDSEntry::UDS_LINK_DEST, lSymlinkTarget);
         if (pDetails > 1) {
-            Node *lNode = qobject_cast<Node *>(pNode->parent())->resolve(pNode->mSymlinkTarget, true);
+            Node *lNode = pNode->parent()->resolve(lSymlinkTarget, true);
             if (lNode != nullptr) { // follow symlink only if details > 1 and it leads to something
                 pNode = lNode;
             }
@@ -338,12 +823,15 @@ void BupWorker::createUDSEntry(Node *pNode, UDSEntry &pUDSEntry, int pDetails)
     pUDSEntry.fastInsert(KIO::UDSEntry::UDS_ACCESS, pNode->mMode & 07777);
     if (pDetails > 0) {
         quint64 lSize = 0;
-        File *lFile = qobject_cast<File *>(pNode);
+        File *lFile = dynamic_cast<File *>(pNode);
         if (lFile != nullptr) {
             lSize = lFile->size();
         }
         pUDSEntry.fastInsert(KIO::UDSEntry::UDS_SIZE, static_cast<qint64>(lSize));
-        pUDSEntry.fastInsert(KIO::UDSEntry::UDS_MIME_TYPE, pNode->mMimeType);
+        if (pDetails > 1) {
+            // guessed from file name only while listing, see File::detectMimeTypeFromContent()
+            pUDSEntry.fastInsert(KIO::UDSEntry::UDS_MIME_TYPE, pNode->mimeType());
+        }
         pUDSEntry.fastInsert(KIO::UDSEntry::UDS_ACCESS_TIME, pNode->mAtime);
         pUDSEntry.fastInsert(KIO::UDSEntry::UDS_MODIFICATION_TIME, pNode->mMtime);
         pUDSEntry.fastInsert(KIO::UDSEntry::UDS_USER, getUserName(static_cast<uint>(pNode->mUid)));
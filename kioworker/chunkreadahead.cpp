@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "chunkreadahead.h"
+#include "gitworkerpool.h"
+
+#include <KIO/Global>
+
+#include <utility>
+
+ChunkReadAhead::ChunkReadAhead(GitWorkerPool *pPool, ChunkTable pChunks, int pFirstChunk, quint64 pSkipSize, int pDepth)
+    : mPool(pPool)
+    , mChunks(std::move(pChunks))
+    , mChunkCount(mChunks.count())
+    , mState(new SharedState)
+    , mNextChunk(pFirstChunk)
+    , mNextToSchedule(pFirstChunk)
+    , mDepth(qMax(1, pDepth))
+    , mSkipSize(pSkipSize)
+    , mBytesRead(0)
+{
+    mTimer.start();
+    scheduleMore();
+}
+
+ChunkReadAhead::ChunkReadAhead(GitWorkerPool *pPool, ChunkTreeWalker *pWalker, quint64 pSkipSize, int pDepth)
+    : mPool(pPool)
+    , mWalker(pWalker)
+    , mChunkCount(-1)
+    , mState(new SharedState)
+    , mNextChunk(0)
+    , mNextToSchedule(0)
+    , mDepth(qMax(1, pDepth))
+    , mSkipSize(pSkipSize)
+    , mBytesRead(0)
+{
+    mTimer.start();
+    scheduleMore();
+}
+
+ChunkReadAhead::~ChunkReadAhead()
+{
+    QMutexLocker lLocker(&mState->mMutex);
+    mState->mCancelled = true;
+    mState->mLoaded.clear();
+}
+
+int ChunkReadAhead::read(QByteArray &pChunk)
+{
+    if (mChunkCount >= 0 && mNextChunk >= mChunkCount) {
+        return mWalker && mWalker->failed() ? KIO::ERR_CANNOT_READ : KIO::ERR_NO_CONTENT;
+    }
+    {
+        QMutexLocker lLocker(&mState->mMutex);
+        while (!mState->mLoaded.contains(mNextChunk) && !mState->mFailed.contains(mNextChunk)) {
+            mState->mChunkReady.wait(&mState->mMutex);
+        }
+        if (mState->mFailed.contains(mNextChunk)) {
+            return KIO::ERR_CANNOT_READ;
+        }
+        pChunk = mState->mLoaded.take(mNextChunk);
+    }
+    if (mSkipSize > 0) {
+        pChunk.remove(0, static_cast<int>(qMin(mSkipSize, static_cast<quint64>(pChunk.size()))));
+        mSkipSize = 0;
+    }
+    ++mNextChunk;
+    mBytesRead += static_cast<quint64>(pChunk.size());
+    scheduleMore();
+    return 0; // success
+}
+
+quint64 ChunkReadAhead::bytesPerSecond() const
+{
+    const qint64 lElapsed = mTimer.elapsed();
+    if (lElapsed <= 0) {
+        return 0;
+    }
+    return mBytesRead * 1000 / static_cast<quint64>(lElapsed);
+}
+
+void ChunkReadAhead::scheduleMore()
+{
+    git_oid lOid;
+    while (mNextToSchedule < mNextChunk + mDepth && nextChunkOid(lOid)) {
+        const int lIndex = mNextToSchedule++;
+        QSharedPointer<SharedState> lState = mState;
+        mPool->run([lState, lIndex, lOid](git_repository *pRepository) {
+            {
+                QMutexLocker lLocker(&lState->mMutex);
+                if (lState->mCancelled) {
+                    return;
+                }
+            }
+            git_blob *lBlob;
+            bool lSuccess = pRepository != nullptr && 0 == git_blob_lookup(&lBlob, pRepository, &lOid);
+            QByteArray lData;
+            if (lSuccess) {
+                lData = QByteArray(static_cast<const char *>(git_blob_rawcontent(lBlob)), static_cast<int>(git_blob_rawsize(lBlob)));
+                git_blob_free(lBlob);
+            }
+            QMutexLocker lLocker(&lState->mMutex);
+            if (lState->mCancelled) {
+                return;
+            }
+            if (lSuccess) {
+                lState->mLoaded.insert(lIndex, lData);
+            } else {
+                lState->mFailed.insert(lIndex);
+            }
+            lState->mChunkReady.wakeAll();
+        });
+    }
+}
+
+bool ChunkReadAhead::nextChunkOid(git_oid &pOid)
+{
+    if (mChunkCount >= 0 && mNextToSchedule >= mChunkCount) {
+        return false;
+    }
+    if (!mWalker) {
+        pOid = mChunks.at(mNextToSchedule).mOid;
+        return true;
+    }
+    ChunkRecord lChunk;
+    if (!mWalker->next(lChunk)) {
+        mChunkCount = mNextToSchedule;
+        return false;
+    }
+    pOid = lChunk.mOid;
+    return true;
+}
@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef CHUNKREADAHEAD_H
+#define CHUNKREADAHEAD_H
+
+#include "vfshelpers.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QSet>
+#include <QSharedPointer>
+#include <QWaitCondition>
+
+class GitWorkerPool;
+
+// Reads the chunks of a chunked file in order while up to pDepth of the following
+// chunks are looked up and inflated by the threads of a GitWorkerPool. The chunks
+// come either from a complete chunk table or from a ChunkTreeWalker, which then only
+// needs to stay pDepth chunks ahead of the reader.
+class ChunkReadAhead
+{
+public:
+    ChunkReadAhead(GitWorkerPool *pPool, ChunkTable pChunks, int pFirstChunk, quint64 pSkipSize, int pDepth);
+    // Takes ownership of pWalker, which must already be positioned.
+    ChunkReadAhead(GitWorkerPool *pPool, ChunkTreeWalker *pWalker, quint64 pSkipSize, int pDepth);
+    ~ChunkReadAhead();
+    // Same return values as File::read()
+    int read(QByteArray &pChunk);
+    quint64 bytesRead() const
+    {
+        return mBytesRead;
+    }
+    quint64 bytesPerSecond() const;
+
+protected:
+    void scheduleMore();
+    bool nextChunkOid(git_oid &pOid);
+
+    struct SharedState {
+        QMutex mMutex;
+        QWaitCondition mChunkReady;
+        QHash<int, QByteArray> mLoaded;
+        QSet<int> mFailed;
+        bool mCancelled = false;
+    };
+
+    GitWorkerPool *mPool;
+    ChunkTable mChunks;
+    QScopedPointer<ChunkTreeWalker> mWalker;
+    int mChunkCount; // -1 until the walker has reached the end
+    QSharedPointer<SharedState> mState; // also held by queued tasks, they may outlive this object
+    int mNextChunk;
+    int mNextToSchedule;
+    int mDepth;
+    quint64 mSkipSize;
+    quint64 mBytesRead;
+    QElapsedTimer mTimer;
+};
+
+#endif // CHUNKREADAHEAD_H
@@ -0,0 +1,200 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "commitgraph.h"
+
+#include <QByteArray>
+#include <QSet>
+#include <QVector>
+#include <QtEndian>
+
+#include <git2/commit.h>
+
+#include <cstring>
+
+static const int cHeaderSize = 8;
+static const int cChunkEntrySize = 12;
+static const int cFanoutSize = 256 * 4;
+static const int cCommitDataSize = GIT_OID_RAWSZ + 16;
+static const quint32 cChunkFanout = 0x4f494446; // "OIDF"
+static const quint32 cChunkOids = 0x4f49444c; // "OIDL"
+static const quint32 cChunkCommitData = 0x43444154; // "CDAT"
+static const quint32 cParentNone = 0x70000000;
+static const quint32 cParentExtraEdges = 0x80000000;
+
+static quint32 readUint32(const uchar *pData)
+{
+    return qFromBigEndian<quint32>(pData);
+}
+
+CommitGraph::CommitGraph()
+    : mFanout(nullptr)
+    , mOids(nullptr)
+    , mCommitData(nullptr)
+    , mCount(0)
+{
+}
+
+bool CommitGraph::open(git_repository *pRepository)
+{
+    mFile.setFileName(QString::fromLocal8Bit(git_repository_path(pRepository)) + QStringLiteral("objects/info/commit-graph"));
+    if (!mFile.open(QIODevice::ReadOnly) || mFile.size() < cHeaderSize) {
+        return false;
+    }
+    const qint64 lSize = mFile.size();
+    const uchar *lMap = mFile.map(0, lSize);
+    // version 1, SHA-1 ids, no base graphs
+    if (lMap == nullptr || 0 != memcmp(lMap, "CGPH", 4) || lMap[4] != 1 || lMap[5] != 1 || lMap[7] != 0) {
+        return false;
+    }
+    const int lChunkCount = lMap[6];
+    if (cHeaderSize + qint64(lChunkCount + 1) * cChunkEntrySize > lSize) {
+        return false;
+    }
+    qint64 lFanoutSize = 0, lOidsSize = 0, lCommitDataSize = 0;
+    for (int i = 0; i < lChunkCount; ++i) {
+        const uchar *lEntry = lMap + cHeaderSize + i * cChunkEntrySize;
+        const quint64 lOffset = qFromBigEndian<quint64>(lEntry + 4);
+        const quint64 lNextOffset = qFromBigEndian<quint64>(lEntry + cChunkEntrySize + 4);
+        if (lOffset > lNextOffset || lNextOffset > quint64(lSize)) {
+            return false;
+        }
+        const qint64 lChunkSize = qint64(lNextOffset - lOffset);
+        switch (readUint32(lEntry)) {
+        case cChunkFanout:
+            mFanout = lMap + lOffset;
+            lFanoutSize = lChunkSize;
+            break;
+        case cChunkOids:
+            mOids = lMap + lOffset;
+            lOidsSize = lChunkSize;
+            break;
+        case cChunkCommitData:
+            mCommitData = lMap + lOffset;
+            lCommitDataSize = lChunkSize;
+            break;
+        default:
+            break;
+        }
+    }
+    if (mFanout == nullptr || mOids == nullptr || mCommitData == nullptr || lFanoutSize != cFanoutSize) {
+        return false;
+    }
+    mCount = readUint32(mFanout + 255 * 4);
+    if (lOidsSize != qint64(mCount) * GIT_OID_RAWSZ || lCommitDataSize != qint64(mCount) * cCommitDataSize) {
+        mCount = 0;
+        return false;
+    }
+    return true;
+}
+
+bool CommitGraph::find(const git_oid *pOid, quint32 &pPosition) const
+{
+    if (mCount == 0) {
+        return false;
+    }
+    const uchar lFirstByte = pOid->id[0];
+    quint32 lStart = lFirstByte == 0 ? 0 : readUint32(mFanout + (lFirstByte - 1) * 4);
+    quint32 lEnd = qMin(readUint32(mFanout + lFirstByte * 4), mCount);
+    while (lStart < lEnd) {
+        const quint32 lMiddle = lStart + (lEnd - lStart) / 2;
+        const int lCompare = memcmp(mOids + qint64(lMiddle) * GIT_OID_RAWSZ, pOid->id, GIT_OID_RAWSZ);
+        if (lCompare == 0) {
+            pPosition = lMiddle;
+            return true;
+        }
+        if (lCompare < 0) {
+            lStart = lMiddle + 1;
+        } else {
+            lEnd = lMiddle;
+        }
+    }
+    return false;
+}
+
+const git_oid *CommitGraph::commitOid(quint32 pPosition) const
+{
+    return reinterpret_cast<const git_oid *>(mOids + qint64(pPosition) * GIT_OID_RAWSZ);
+}
+
+const git_oid *CommitGraph::treeOid(quint32 pPosition) const
+{
+    return reinterpret_cast<const git_oid *>(mCommitData + qint64(pPosition) * cCommitDataSize);
+}
+
+qint64 CommitGraph::commitTime(quint32 pPosition) const
+{
+    // 30 bits generation number and 34 bits commit time
+    const uchar *lData = mCommitData + qint64(pPosition) * cCommitDataSize + GIT_OID_RAWSZ + 8;
+    return (qint64(readUint32(lData) & 0x3) << 32) | readUint32(lData + 4);
+}
+
+int CommitGraph::parents(quint32 pPosition, quint32 pParents[2]) const
+{
+    const uchar *lData = mCommitData + qint64(pPosition) * cCommitDataSize + GIT_OID_RAWSZ;
+    int lCount = 0;
+    for (int i = 0; i < 2; ++i) {
+        const quint32 lParent = readUint32(lData + i * 4);
+        if (lParent == cParentNone) {
+            break;
+        }
+        if ((lParent & cParentExtraEdges) != 0 || lParent >= mCount) {
+            return -1;
+        }
+        pParents[lCount++] = lParent;
+    }
+    return lCount;
+}
+
+bool walkCommitGraph(git_repository *pRepository, const CommitGraph &pGraph, const git_oid *pHead, const git_oid *pHide, const CommitCallback &pCallback)
+{
+    QVector<bool> lSeen(int(pGraph.count()), false);
+    QSet<QByteArray> lSeenOutside;
+    QVector<git_oid> lPending;
+    lPending.append(*pHead);
+    while (!lPending.isEmpty()) {
+        const git_oid lOid = lPending.takeLast();
+        if (pHide != nullptr && git_oid_equal(&lOid, pHide)) {
+            continue;
+        }
+        quint32 lPosition;
+        if (pGraph.find(&lOid, lPosition)) {
+            if (lSeen.at(int(lPosition))) {
+                continue;
+            }
+            lSeen[int(lPosition)] = true;
+            quint32 lParents[2];
+            const int lParentCount = pGraph.parents(lPosition, lParents);
+            if (lParentCount < 0 || (pHide != nullptr && lParentCount > 1)) {
+                return false;
+            }
+            pCallback(&lOid, pGraph.treeOid(lPosition), pGraph.commitTime(lPosition));
+            for (int i = 0; i < lParentCount; ++i) {
+                lPending.append(*pGraph.commitOid(lParents[i]));
+            }
+            continue;
+        }
+
+        const QByteArray lKey(reinterpret_cast<const char *>(lOid.id), GIT_OID_RAWSZ);
+        if (lSeenOutside.contains(lKey)) {
+            continue;
+        }
+        lSeenOutside.insert(lKey);
+        git_commit *lCommit;
+        if (0 != git_commit_lookup(&lCommit, pRepository, &lOid)) {
+            return false;
+        }
+        const unsigned int lParentCount = git_commit_parentcount(lCommit);
+        if (pHide != nullptr && lParentCount > 1) {
+            git_commit_free(lCommit);
+            return false;
+        }
+        pCallback(&lOid, git_commit_tree_id(lCommit), git_commit_time(lCommit));
+        for (unsigned int i = 0; i < lParentCount; ++i) {
+            lPending.append(*git_commit_parent_id(lCommit, i));
+        }
+        git_commit_free(lCommit);
+    }
+    return true;
+}
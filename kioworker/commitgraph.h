@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef COMMITGRAPH_H
+#define COMMITGRAPH_H
+
+#include <QFile>
+
+#include <git2.h>
+#include <functional>
+
+// Reader for git's commit-graph file, objects/info/commit-graph. The daemon writes it
+// after each backup. It has the tree id, parents and time of every commit, so walking
+// a branch doesn't need to inflate commit objects. Split graph chains are not used.
+class CommitGraph
+{
+public:
+    CommitGraph();
+    bool open(git_repository *pRepository);
+
+    bool find(const git_oid *pOid, quint32 &pPosition) const;
+    const git_oid *commitOid(quint32 pPosition) const;
+    const git_oid *treeOid(quint32 pPosition) const;
+    qint64 commitTime(quint32 pPosition) const;
+    // Number of parents written to pParents, -1 for octopus merges which are not supported.
+    int parents(quint32 pPosition, quint32 pParents[2]) const;
+    quint32 count() const
+    {
+        return mCount;
+    }
+
+protected:
+    QFile mFile;
+    const uchar *mFanout;
+    const uchar *mOids;
+    const uchar *mCommitData;
+    quint32 mCount;
+};
+
+typedef std::function<void(const git_oid *pCommit, const git_oid *pTree, qint64 pCommitTime)> CommitCallback;
+
+// Calls pCallback for each commit reachable from pHead but not from pHide, which can be
+// null. Commits missing from the graph, made after it was written, are read from the
+// object database instead. With pHide set only linear history is handled. Returns false
+// if the walk could not be completed, pCallback may have been called for some commits.
+bool walkCommitGraph(git_repository *pRepository, const CommitGraph &pGraph, const git_oid *pHead, const git_oid *pHide, const CommitCallback &pCallback);
+
+#endif // COMMITGRAPH_H
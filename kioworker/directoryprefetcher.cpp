@@ -0,0 +1,101 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "directoryprefetcher.h"
+#include "gitworkerpool.h"
+
+static QByteArray treeKey(const git_oid *pOid)
+{
+    return QByteArray(reinterpret_cast<const char *>(pOid->id), GIT_OID_RAWSZ);
+}
+
+static quint64 estimateSize(const IndexedDirectory &pDirectory)
+{
+    quint64 lSize = sizeof(IndexedDirectory);
+    for (const IndexedEntry &lEntry : pDirectory.mEntries) {
+        lSize += sizeof(IndexedEntry) + static_cast<quint64>(lEntry.mName.size() + lEntry.mMetadata.mSymlinkTarget.size()) * sizeof(QChar);
+    }
+    return lSize;
+}
+
+DirectoryPrefetcher::DirectoryPrefetcher()
+    : mState(QSharedPointer<SharedState>::create())
+    , mHits(0)
+    , mMisses(0)
+{
+    mState->mClock.start();
+}
+
+DirectoryPrefetcher::~DirectoryPrefetcher()
+{
+    cancel();
+}
+
+void DirectoryPrefetcher::prefetch(GitWorkerPool *pPool, const QVector<git_oid> &pTreeOids, int pTimeBudget, quint64 pMemoryBudget)
+{
+    const int lGeneration = mState->mGeneration.fetchAndAddOrdered(1) + 1;
+    {
+        QMutexLocker lLocker(&mState->mMutex);
+        mState->mDeadline = mState->mClock.elapsed() + pTimeBudget;
+        mState->mMemoryBudget = pMemoryBudget;
+    }
+    QSharedPointer<SharedState> lState = mState;
+    for (const git_oid &lOid : pTreeOids) {
+        pPool->run([lState, lOid, lGeneration](git_repository *pRepository) {
+            const QByteArray lKey = treeKey(&lOid);
+            {
+                QMutexLocker lLocker(&lState->mMutex);
+                if (lState->mGeneration.loadAcquire() != lGeneration || lState->mClock.elapsed() > lState->mDeadline
+                    || lState->mBytes >= lState->mMemoryBudget) {
+                    ++lState->mCancelled;
+                    return;
+                }
+                if (lState->mResults.contains(lKey)) {
+                    return;
+                }
+            }
+            IndexedDirectory lDirectory;
+            if (pRepository == nullptr || !decodeArchivedDirectory(pRepository, &lOid, lDirectory)) {
+                return;
+            }
+            const quint64 lSize = estimateSize(lDirectory);
+            QMutexLocker lLocker(&lState->mMutex);
+            if (lState->mBytes + lSize > lState->mMemoryBudget) {
+                ++lState->mCancelled;
+                return;
+            }
+            lState->mResults.insert(lKey, lDirectory);
+            lState->mResultSizes.insert(lKey, lSize);
+            lState->mBytes += lSize;
+        });
+    }
+}
+
+void DirectoryPrefetcher::cancel()
+{
+    // queued tasks notice the new generation and return without doing anything.
+    mState->mGeneration.fetchAndAddOrdered(1);
+}
+
+bool DirectoryPrefetcher::take(const git_oid *pTreeOid, IndexedDirectory &pDirectory)
+{
+    const QByteArray lKey = treeKey(pTreeOid);
+    QMutexLocker lLocker(&mState->mMutex);
+    auto lIter = mState->mResults.find(lKey);
+    if (lIter == mState->mResults.end()) {
+        ++mMisses;
+        return false;
+    }
+    pDirectory = lIter.value();
+    mState->mResults.erase(lIter);
+    mState->mBytes -= mState->mResultSizes.take(lKey);
+    ++mHits;
+    return true;
+}
+
+quint64 DirectoryPrefetcher::cancelled() const
+{
+    QMutexLocker lLocker(&mState->mMutex);
+    return mState->mCancelled;
+}
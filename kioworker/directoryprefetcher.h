@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef DIRECTORYPREFETCHER_H
+#define DIRECTORYPREFETCHER_H
+
+#include "vfsindex.h"
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QVector>
+
+class GitWorkerPool;
+
+// Decodes directories in the background that are likely to be listed next, typically
+// subdirectories of the one just listed. Work is given up when cancel() is called, when
+// the time budget since prefetch() runs out or when results that have not been taken
+// yet use more than the memory budget.
+class DirectoryPrefetcher
+{
+public:
+    DirectoryPrefetcher();
+    ~DirectoryPrefetcher();
+    void prefetch(GitWorkerPool *pPool, const QVector<git_oid> &pTreeOids, int pTimeBudget, quint64 pMemoryBudget);
+    void cancel();
+    // Removes and returns a prefetched directory. Counts as a hit if found, a miss otherwise.
+    bool take(const git_oid *pTreeOid, IndexedDirectory &pDirectory);
+    quint64 hits() const
+    {
+        return mHits;
+    }
+    quint64 misses() const
+    {
+        return mMisses;
+    }
+    quint64 cancelled() const;
+
+protected:
+    struct SharedState {
+        QMutex mMutex;
+        QHash<QByteArray, IndexedDirectory> mResults;
+        QHash<QByteArray, quint64> mResultSizes;
+        quint64 mBytes = 0;
+        quint64 mMemoryBudget = 0;
+        qint64 mDeadline = 0;
+        QElapsedTimer mClock;
+        QAtomicInt mGeneration;
+        quint64 mCancelled = 0; // tasks that were skipped, for tuning the budgets
+    };
+    QSharedPointer<SharedState> mState;
+    quint64 mHits;
+    quint64 mMisses;
+};
+
+#endif // DIRECTORYPREFETCHER_H
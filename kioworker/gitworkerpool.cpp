@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "gitworkerpool.h"
+#include "bupodb.h"
+#include "kupkio_debug.h"
+
+#include <QThread>
+
+#include <utility>
+
+GitWorkerPool::GitWorkerPool(QString pRepositoryPath, int pThreadCount)
+    : mRepositoryPath(std::move(pRepositoryPath))
+    , mStopping(false)
+{
+    for (int i = 0; i < qMax(1, pThreadCount); ++i) {
+        QThread *lThread = QThread::create([this] {
+            workerLoop();
+        });
+        mThreads.append(lThread);
+        lThread->start();
+    }
+}
+
+GitWorkerPool::~GitWorkerPool()
+{
+    mMutex.lock();
+    mStopping = true;
+    mTasks.clear();
+    mTaskAvailable.wakeAll();
+    mMutex.unlock();
+    for (QThread *lThread : std::as_const(mThreads)) {
+        lThread->wait();
+        delete lThread;
+    }
+}
+
+void GitWorkerPool::run(const Task &pTask)
+{
+    QMutexLocker lLocker(&mMutex);
+    mTasks.enqueue(pTask);
+    mTaskAvailable.wakeOne();
+}
+
+void GitWorkerPool::workerLoop()
+{
+    git_repository *lRepository;
+    if (0 != openBupRepository(&lRepository, mRepositoryPath)) {
+        qCWarning(KUPKIO) << "worker thread could not open repository " << mRepositoryPath;
+        lRepository = nullptr;
+    }
+    while (true) {
+        Task lTask;
+        {
+            QMutexLocker lLocker(&mMutex);
+            while (mTasks.isEmpty() && !mStopping) {
+                mTaskAvailable.wait(&mMutex);
+            }
+            if (mStopping) {
+                break;
+            }
+            lTask = mTasks.dequeue();
+        }
+        lTask(lRepository);
+    }
+    if (lRepository != nullptr) {
+        git_repository_free(lRepository);
+    }
+}
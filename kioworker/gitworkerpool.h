@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef GITWORKERPOOL_H
+#define GITWORKERPOOL_H
+
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QWaitCondition>
+
+#include <git2.h>
+#include <functional>
+
+class QThread;
+
+// Small pool of threads for doing libgit2 work in the background. libgit2 objects
+// can't be shared between threads so each thread opens its own handle to the
+// repository, tasks get that handle as argument. It will be null if the repository
+// could not be opened.
+class GitWorkerPool
+{
+public:
+    typedef std::function<void(git_repository *)> Task;
+
+    GitWorkerPool(QString pRepositoryPath, int pThreadCount);
+    ~GitWorkerPool();
+    const QString &repositoryPath() const
+    {
+        return mRepositoryPath;
+    }
+    void run(const Task &pTask);
+
+protected:
+    void workerLoop();
+
+    QString mRepositoryPath;
+    QMutex mMutex;
+    QWaitCondition mTaskAvailable;
+    QQueue<Task> mTasks;
+    QList<QThread *> mThreads;
+    bool mStopping;
+};
+
+#endif // GITWORKERPOOL_H
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "nodearena.h"
+#include "bupvfs.h"
+
+#include <QMimeDatabase>
+
+#include <cstddef>
+#include <cstdlib>
+
+static const size_t cBlockSize = 256 * 1024;
+static const size_t cAlignment = alignof(std::max_align_t);
+
+NodeArena::NodeArena()
+    : mBlockUsed(cBlockSize)
+    , mLargeAllocations(0)
+    , mFreeBytes(0)
+    , mDroppedNodes(0)
+    , mStringBytes(0)
+{
+}
+
+NodeArena::~NodeArena()
+{
+    clear();
+}
+
+void NodeArena::destroyTree(Node *pRoot)
+{
+    // parents come before their children in lSubtree, like in mNodes.
+    QVector<Node *> lSubtree;
+    lSubtree.append(pRoot);
+    for (int i = 0; i < lSubtree.count(); ++i) {
+        auto lDirectory = dynamic_cast<Directory *>(lSubtree.at(i));
+        if (lDirectory != nullptr) {
+            lSubtree.append(lDirectory->mSubNodes);
+        }
+    }
+    for (int i = lSubtree.count() - 1; i >= 0; --i) {
+        Node *lNode = lSubtree.at(i);
+        const quint32 lSlot = lNode->mArenaSlot;
+        const quint32 lSize = mNodeSizes.at(static_cast<int>(lSlot));
+        lNode->~Node();
+        mNodes[static_cast<int>(lSlot)] = nullptr;
+        mDetectedMimeTypes.remove(lNode);
+        mFreeSlots[lSize].append(lNode);
+        mFreeBytes += lSize;
+    }
+    mDroppedNodes += lSubtree.count();
+    if (mDroppedNodes > mNodes.count() / 2) {
+        compactNodes();
+    }
+}
+
+void NodeArena::compactNodes()
+{
+    int lKept = 0;
+    for (int i = 0; i < mNodes.count(); ++i) {
+        Node *lNode = mNodes.at(i);
+        if (lNode != nullptr) {
+            lNode->mArenaSlot = static_cast<quint32>(lKept);
+            mNodes[lKept] = lNode;
+            mNodeSizes[lKept] = mNodeSizes.at(i);
+            ++lKept;
+        }
+    }
+    mNodes.resize(lKept);
+    mNodeSizes.resize(lKept);
+    mDroppedNodes = 0;
+}
+
+const QString *NodeArena::intern(const QString &pString)
+{
+    auto lIter = mStrings.constFind(pString);
+    if (lIter != mStrings.constEnd()) {
+        return lIter.value();
+    }
+    // the key shares its data with the string in the block.
+    auto lString = new (allocate(slotSize(sizeof(QString)))) QString(pString);
+    mStrings.insert(*lString, lString);
+    mStringBytes += static_cast<quint64>(pString.size()) * sizeof(QChar) + 32;
+    return lString;
+}
+
+const QString &NodeArena::mimeTypeForName(const QString *pName)
+{
+    const QString *&lMimeType = mNameMimeTypes[pName];
+    if (lMimeType == nullptr) {
+        QMimeDatabase db;
+        lMimeType = intern(db.mimeTypeForFile(*pName, QMimeDatabase::MatchExtension).name());
+    }
+    return *lMimeType;
+}
+
+const QString *NodeArena::detectedMimeType(const Node *pNode) const
+{
+    return mDetectedMimeTypes.value(pNode, nullptr);
+}
+
+void NodeArena::setDetectedMimeType(const Node *pNode, const QString &pMimeType)
+{
+    mDetectedMimeTypes.insert(pNode, intern(pMimeType));
+}
+
+void NodeArena::clear()
+{
+    // children are always created after their parent, destroy in reverse order so
+    // that a node never outlives the nodes it points to.
+    for (int i = mNodes.count() - 1; i >= 0; --i) {
+        if (mNodes.at(i) != nullptr) {
+            mNodes.at(i)->~Node();
+        }
+    }
+    mNodes.clear();
+    mNodeSizes.clear();
+    mDroppedNodes = 0;
+    mDetectedMimeTypes.clear();
+    mNameMimeTypes.clear();
+    for (const QString *lString : std::as_const(mStrings)) {
+        lString->~QString();
+    }
+    mStrings.clear();
+    mStringBytes = 0;
+    for (char *lBlock : std::as_const(mBlocks)) {
+        free(lBlock);
+    }
+    mBlocks.clear();
+    for (char *lBlock : std::as_const(mLargeBlocks)) {
+        free(lBlock);
+    }
+    mLargeBlocks.clear();
+    mBlockUsed = cBlockSize;
+    mLargeAllocations = 0;
+    mFreeSlots.clear();
+    mFreeBytes = 0;
+}
+
+quint64 NodeArena::bytesUsed() const
+{
+    return static_cast<quint64>(mBlocks.count()) * cBlockSize + mLargeAllocations - mFreeBytes
+        + static_cast<quint64>(mNodes.capacity()) * (sizeof(Node *) + sizeof(quint32)) + mStringBytes;
+}
+
+size_t NodeArena::slotSize(size_t pSize)
+{
+    return (pSize + cAlignment - 1) & ~(cAlignment - 1);
+}
+
+void *NodeArena::allocate(size_t pSize)
+{
+    auto lFree = mFreeSlots.find(pSize);
+    if (lFree != mFreeSlots.end() && !lFree->isEmpty()) {
+        mFreeBytes -= pSize;
+        return lFree->takeLast();
+    }
+    if (pSize > cBlockSize / 4) {
+        // not expected for any node type, keep it out of the blocks anyway.
+        auto lMemory = static_cast<char *>(malloc(pSize));
+        Q_CHECK_PTR(lMemory);
+        mLargeBlocks.append(lMemory);
+        mLargeAllocations += pSize;
+        return lMemory;
+    }
+    if (mBlockUsed + pSize > cBlockSize) {
+        auto lBlock = static_cast<char *>(malloc(cBlockSize));
+        Q_CHECK_PTR(lBlock);
+        mBlocks.append(lBlock);
+        mBlockUsed = 0;
+    }
+    void *lMemory = mBlocks.last() + mBlockUsed;
+    mBlockUsed += pSize;
+    return lMemory;
+}
@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+#include <new>
+#include <utility>
+
+class Node;
+
+// Storage for the nodes of one repository. Nodes are placed next to each other in
+// large blocks instead of being allocated one by one. Names are interned, the same
+// file names show up in every snapshot of a branch and can share one string. MIME
+// types are not stored in the nodes, they are looked up here when asked for.
+class NodeArena
+{
+public:
+    NodeArena();
+    ~NodeArena();
+
+    template<typename T, typename... Args>
+    T *create(Args &&...pArgs)
+    {
+        const size_t lSize = slotSize(sizeof(T));
+        T *lNode = new (allocate(lSize)) T(std::forward<Args>(pArgs)...);
+        lNode->mArenaSlot = static_cast<quint32>(mNodes.count());
+        mNodes.append(lNode);
+        mNodeSizes.append(static_cast<quint32>(lSize));
+        return lNode;
+    }
+
+    // Destroys pRoot and all nodes below it, their memory is reused for new nodes.
+    // Pointers to any of them are no longer valid after this. The subtree is found
+    // through the sub node lists of directories, so every node below pRoot must be
+    // listed by its parent, as is the case for snapshots.
+    void destroyTree(Node *pRoot);
+    // The returned string lives as long as the arena, or until clear() is called.
+    const QString *intern(const QString &pString);
+    // Guessed from the file name only, cached per interned name.
+    const QString &mimeTypeForName(const QString *pName);
+    // Refined from the file content, only a few nodes ever get one so they are kept
+    // here rather than in every node. Null if none was set.
+    const QString *detectedMimeType(const Node *pNode) const;
+    void setDetectedMimeType(const Node *pNode, const QString &pMimeType);
+    // destroys all nodes, pointers handed out before are no longer valid after this.
+    void clear();
+    int nodeCount() const
+    {
+        return mNodes.count() - mDroppedNodes;
+    }
+    // approximate number of bytes held by live nodes and interned strings
+    quint64 bytesUsed() const;
+
+protected:
+    static size_t slotSize(size_t pSize);
+    void *allocate(size_t pSize);
+    // removes the null entries left in mNodes by destroyTree()
+    void compactNodes();
+
+    QList<char *> mBlocks;
+    QList<char *> mLargeBlocks;
+    size_t mBlockUsed;
+    quint64 mLargeAllocations;
+    QHash<size_t, QVector<void *>> mFreeSlots; // by slot size, from destroyTree()
+    quint64 mFreeBytes;
+    QVector<Node *> mNodes; // in order of creation, parents before their children
+    QVector<quint32> mNodeSizes;
+    int mDroppedNodes; // null entries in mNodes
+    QHash<QString, const QString *> mStrings;
+    quint64 mStringBytes;
+    QHash<const QString *, const QString *> mNameMimeTypes;
+    QHash<const Node *, const QString *> mDetectedMimeTypes;
+};
+
+#endif // NODEARENA_H
@@ -0,0 +1,227 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "tarstreamer.h"
+#include "bupvfs.h"
+#include "chunkreadahead.h"
+#include "kupkio_debug.h"
+
+#include <QScopedPointer>
+
+#include <cstring>
+#include <sys/stat.h>
+
+static const int cBlockSize = 512;
+static const int cNameSize = 100;
+static const quint64 cMaxOctalSize = 077777777777ULL; // 11 octal digits
+static const quint64 cMaxOctalId = 07777777; // 7 octal digits
+
+// header field offsets, see POSIX ustar format
+static const int cModeOffset = 100;
+static const int cUidOffset = 108;
+static const int cGidOffset = 116;
+static const int cSizeOffset = 124;
+static const int cMtimeOffset = 136;
+static const int cChecksumOffset = 148;
+static const int cTypeOffset = 156;
+static const int cLinkNameOffset = 157;
+static const int cMagicOffset = 257;
+static const QByteArray cMagic("ustar\0" "00", 8);
+
+static void setField(QByteArray &pHeader, int pOffset, const QByteArray &pValue, int pMaxSize)
+{
+    memcpy(pHeader.data() + pOffset, pValue.constData(), static_cast<size_t>(qMin(pValue.size(), pMaxSize)));
+}
+
+// Octal number padded with zeros, terminated by a NUL. Values that don't fit are
+// stored as zero, callers put the real value in a pax header.
+static void setOctal(QByteArray &pHeader, int pOffset, int pFieldSize, quint64 pValue)
+{
+    QByteArray lValue = QByteArray::number(pValue, 8);
+    if (lValue.size() > pFieldSize - 1) {
+        lValue = "0";
+    }
+    lValue = lValue.rightJustified(pFieldSize - 1, '0');
+    setField(pHeader, pOffset, lValue, pFieldSize - 1);
+}
+
+static void setChecksum(QByteArray &pHeader)
+{
+    // calculated with the checksum field itself filled with spaces, stored as six
+    // octal digits followed by a NUL and a space.
+    memset(pHeader.data() + cChecksumOffset, ' ', 8);
+    quint32 lChecksum = 0;
+    for (int i = 0; i < cBlockSize; ++i) {
+        lChecksum += static_cast<uchar>(pHeader.at(i));
+    }
+    setOctal(pHeader, cChecksumOffset, 7, lChecksum);
+    pHeader[cChecksumOffset + 6] = '\0';
+}
+
+static QByteArray paxRecord(const char *pKey, const QByteArray &pValue)
+{
+    // "<length> <key>=<value>\n" where length counts the whole record, including itself.
+    const int lBaseLength = static_cast<int>(strlen(pKey)) + pValue.size() + 3;
+    int lLength = lBaseLength + 1;
+    while (lLength != lBaseLength + QByteArray::number(lLength).size()) {
+        lLength = lBaseLength + QByteArray::number(lLength).size();
+    }
+    return QByteArray::number(lLength) + ' ' + pKey + '=' + pValue + '\n';
+}
+
+TarStreamer::TarStreamer(GitWorkerPool *pPool, int pReadAheadDepth, Sink pSink)
+    : mPool(pPool)
+    , mReadAheadDepth(pReadAheadDepth)
+    , mSink(std::move(pSink))
+    , mBytesWritten(0)
+{
+}
+
+int TarStreamer::write(Directory *pDirectory)
+{
+    int lResult = writeNode(pDirectory, pDirectory->objectName().toUtf8());
+    if (lResult != 0) {
+        return lResult;
+    }
+    // end of archive is marked by two empty blocks
+    writeBlock(QByteArray(2 * cBlockSize, '\0'));
+    return 0;
+}
+
+int TarStreamer::writeNode(Node *pNode, const QByteArray &pPath)
+{
+    pNode->loadMetadata();
+    auto lDirectory = dynamic_cast<Directory *>(pNode);
+    if (lDirectory != nullptr) {
+        writeHeader(pNode, pPath + '/', '5', 0, QByteArray());
+        int lResult = 0;
+        for (Node *lSubNode : lDirectory->subNodes()) {
+            lResult = writeNode(lSubNode, pPath + '/' + lSubNode->objectName().toUtf8());
+            if (lResult != 0) {
+                break;
+            }
+        }
+        // Nothing below is needed again, memory would otherwise grow with the size of
+        // the exported tree.
+        auto lArchived = dynamic_cast<ArchivedDirectory *>(lDirectory);
+        if (lArchived != nullptr) {
+            lArchived->dropSubNodes();
+        }
+        return lResult;
+    }
+    const QString lSymlinkTarget = pNode->symlinkTarget();
+    if (!lSymlinkTarget.isEmpty()) {
+        writeHeader(pNode, pPath, '2', 0, lSymlinkTarget.toUtf8());
+        return 0;
+    }
+    auto lFile = dynamic_cast<File *>(pNode);
+    if (lFile == nullptr || !S_ISREG(pNode->mMode)) {
+        // devices, fifos and sockets have no content in a bup archive, nothing useful to extract.
+        qCDebug(KUPKIO) << "not adding special file to archive:" << pPath;
+        return 0;
+    }
+    const quint64 lSize = lFile->size();
+    writeHeader(pNode, pPath, '0', lSize, QByteArray());
+    const int lResult = writeFileData(lFile, lSize);
+    lFile->releaseContent();
+    return lResult;
+}
+
+int TarStreamer::writeFileData(File *pFile, quint64 pSize)
+{
+    if (pSize == 0) {
+        return 0;
+    }
+    if (0 != pFile->seek(0)) {
+        return KIO::ERR_CANNOT_READ;
+    }
+    QScopedPointer<ChunkReadAhead> lReadAhead;
+    auto lChunkFile = dynamic_cast<ChunkFile *>(pFile);
+    if (lChunkFile != nullptr && mPool != nullptr) {
+        lReadAhead.reset(lChunkFile->readAhead(mPool, mReadAheadDepth));
+    }
+    quint64 lWritten = 0;
+    QByteArray lData;
+    int lResult;
+    while (0 == (lResult = lReadAhead ? lReadAhead->read(lData) : pFile->read(lData))) {
+        lWritten += static_cast<quint64>(lData.size());
+        if (lWritten > pSize) { // size in header can't change anymore
+            return KIO::ERR_CANNOT_READ;
+        }
+        writeBlock(lData);
+    }
+    if (lResult != KIO::ERR_NO_CONTENT || lWritten != pSize) {
+        return KIO::ERR_CANNOT_READ;
+    }
+    writePadding(pSize);
+    return 0;
+}
+
+void TarStreamer::writeHeader(Node *pNode, const QByteArray &pPath, char pType, quint64 pSize, const QByteArray &pLinkTarget)
+{
+    QByteArray lPaxRecords;
+    if (pPath.size() > cNameSize) {
+        lPaxRecords.append(paxRecord("path", pPath));
+    }
+    if (pLinkTarget.size() > cNameSize) {
+        lPaxRecords.append(paxRecord("linkpath", pLinkTarget));
+    }
+    if (pSize > cMaxOctalSize) {
+        lPaxRecords.append(paxRecord("size", QByteArray::number(pSize)));
+    }
+    if (pNode->mUid > cMaxOctalId) {
+        lPaxRecords.append(paxRecord("uid", QByteArray::number(pNode->mUid)));
+    }
+    if (pNode->mGid > cMaxOctalId) {
+        lPaxRecords.append(paxRecord("gid", QByteArray::number(pNode->mGid)));
+    }
+    if (!lPaxRecords.isEmpty()) {
+        writePaxHeader(pPath, lPaxRecords);
+    }
+
+    QByteArray lHeader(cBlockSize, '\0');
+    setField(lHeader, 0, pPath, cNameSize);
+    setOctal(lHeader, cModeOffset, 8, static_cast<quint64>(pNode->mMode & 07777));
+    setOctal(lHeader, cUidOffset, 8, pNode->mUid);
+    setOctal(lHeader, cGidOffset, 8, pNode->mGid);
+    setOctal(lHeader, cSizeOffset, 12, pSize);
+    setOctal(lHeader, cMtimeOffset, 12, static_cast<quint64>(qMax<qint64>(0, pNode->mMtime)));
+    lHeader[cTypeOffset] = pType;
+    setField(lHeader, cLinkNameOffset, pLinkTarget, cNameSize);
+    setField(lHeader, cMagicOffset, cMagic, 8);
+    setChecksum(lHeader);
+    writeBlock(lHeader);
+}
+
+void TarStreamer::writePaxHeader(const QByteArray &pPath, const QByteArray &pRecords)
+{
+    QByteArray lName = "PaxHeaders/" + pPath.right(cNameSize - 11);
+    QByteArray lHeader(cBlockSize, '\0');
+    setField(lHeader, 0, lName, cNameSize);
+    setOctal(lHeader, cModeOffset, 8, 0644);
+    setOctal(lHeader, cUidOffset, 8, 0);
+    setOctal(lHeader, cGidOffset, 8, 0);
+    setOctal(lHeader, cSizeOffset, 12, static_cast<quint64>(pRecords.size()));
+    setOctal(lHeader, cMtimeOffset, 12, 0);
+    lHeader[cTypeOffset] = 'x';
+    setField(lHeader, cMagicOffset, cMagic, 8);
+    setChecksum(lHeader);
+    writeBlock(lHeader);
+    writeBlock(pRecords);
+    writePadding(static_cast<quint64>(pRecords.size()));
+}
+
+void TarStreamer::writeBlock(const QByteArray &pData)
+{
+    mSink(pData);
+    mBytesWritten += static_cast<quint64>(pData.size());
+}
+
+void TarStreamer::writePadding(quint64 pSize)
+{
+    const int lRemainder = static_cast<int>(pSize % cBlockSize);
+    if (lRemainder != 0) {
+        writeBlock(QByteArray(cBlockSize - lRemainder, '\0'));
+    }
+}
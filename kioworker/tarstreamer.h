@@ -0,0 +1,48 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef TARSTREAMER_H
+#define TARSTREAMER_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <functional>
+
+class Directory;
+class File;
+class GitWorkerPool;
+class Node;
+
+// Writes a directory tree from the bup VFS as a POSIX tar stream, generated on the fly.
+// Plain ustar headers are used when possible, pax extended headers otherwise (long
+// paths and link targets, files of 8 GiB and more).
+class TarStreamer
+{
+public:
+    typedef std::function<void(const QByteArray &)> Sink;
+
+    TarStreamer(GitWorkerPool *pPool, int pReadAheadDepth, Sink pSink);
+    // Returns 0 on success or a KIO error code. The stream is unusable after an error.
+    int write(Directory *pDirectory);
+    quint64 bytesWritten() const
+    {
+        return mBytesWritten;
+    }
+
+protected:
+    int writeNode(Node *pNode, const QByteArray &pPath);
+    int writeFileData(File *pFile, quint64 pSize);
+    void writeHeader(Node *pNode, const QByteArray &pPath, char pType, quint64 pSize, const QByteArray &pLinkTarget);
+    void writePaxHeader(const QByteArray &pPath, const QByteArray &pRecords);
+    void writeBlock(const QByteArray &pData);
+    void writePadding(quint64 pSize);
+
+    GitWorkerPool *mPool;
+    int mReadAheadDepth;
+    Sink mSink;
+    quint64 mBytesWritten;
+};
+
+#endif // TARSTREAMER_H
@@ -4,13 +4,14 @@
 
 #include "vfshelpers.h"
 
-#include <QBuffer>
 #include <QByteArray>
 #include <QDateTime>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <utility>
+
 static const int cRecordEnd = 0;
 // static const int cRecordPath = 1;
 static const int cRecordCommonV1 = 2; // times, user, group, type, perms, etc. (legacy version 1)
@@ -23,68 +24,89 @@ static const int cRecordSymlinkTarget = 3;
 static const int cRecordCommonV2 = 9; // times, user, group, type, perms, etc.
 static const int cRecordCommonV3 = 10; // times, user, group, type, perms, etc.
 
-VintStream::VintStream(const void *pData, int pSize, QObject *pParent)
-    : QObject(pParent)
-    , mByteArray(QByteArray::fromRawData(static_cast<const char *>(pData), pSize))
-    , mBuffer(new QBuffer(&mByteArray, this))
+VintStream::VintStream(const void *pData, int pSize)
+    : mPosition(static_cast<const uchar *>(pData))
+    , mEnd(static_cast<const uchar *>(pData) + qMax(0, pSize))
 {
-    mBuffer->open(QIODevice::ReadOnly);
 }
 
-VintStream &VintStream::operator>>(qint64 &pInt)
+bool VintStream::readInt(qint64 &pInt)
 {
-    char c;
-    if (!mBuffer->getChar(&c)) {
-        throw 1;
+    if (mPosition >= mEnd) {
+        return false;
     }
-    int lOffset = 6;
-    bool lNegative = (c & 0x40);
-    pInt = c & 0x3F;
+    uchar c = *mPosition++;
+    const bool lNegative = c & 0x40;
+    quint64 lValue = c & 0x3F;
+    int lShift = 6;
     while (c & 0x80) {
-        if (!mBuffer->getChar(&c)) {
-            throw 1;
+        if (mPosition >= mEnd || lShift > 63) {
+            return false;
         }
-        pInt |= (c & 0x7F) << lOffset;
-        lOffset += 7;
-    }
-    if (lNegative) {
-        pInt = -pInt;
+        c = *mPosition++;
+        lValue |= static_cast<quint64>(c & 0x7F) << lShift;
+        lShift += 7;
     }
-    return *this;
+    pInt = lNegative ? -static_cast<qint64>(lValue) : static_cast<qint64>(lValue);
+    return true;
 }
 
-VintStream &VintStream::operator>>(quint64 &pUint)
+bool VintStream::readUint(quint64 &pUint)
 {
-    char c;
-    int lOffset = 0;
-    pUint = 0;
+    quint64 lValue = 0;
+    int lShift = 0;
+    uchar c;
     do {
-        if (!mBuffer->getChar(&c)) {
-            throw 1;
+        if (mPosition >= mEnd || lShift > 63) {
+            return false;
         }
-        pUint |= static_cast<quint64>((c & 0x7F) << lOffset);
-        lOffset += 7;
+        c = *mPosition++;
+        lValue |= static_cast<quint64>(c & 0x7F) << lShift;
+        lShift += 7;
     } while (c & 0x80);
-    return *this;
+    pUint = lValue;
+    return true;
 }
 
-VintStream &VintStream::operator>>(QString &pString)
+bool VintStream::readBytes(const char *&pData, int &pSize)
 {
-    QByteArray lBytes;
-    *this >> lBytes;
-    pString = QString::fromUtf8(lBytes);
-    return *this;
+    quint64 lSize;
+    if (!readUint(lSize) || lSize > static_cast<quint64>(mEnd - mPosition)) {
+        return false;
+    }
+    pData = reinterpret_cast<const char *>(mPosition);
+    pSize = static_cast<int>(lSize);
+    mPosition += lSize;
+    return true;
 }
 
-VintStream &VintStream::operator>>(QByteArray &pByteArray)
+bool VintStream::readString(QString &pString)
 {
-    quint64 lByteCount;
-    *this >> lByteCount;
-    pByteArray.resize(static_cast<int>(lByteCount));
-    if (mBuffer->read(pByteArray.data(), pByteArray.length()) < pByteArray.length()) {
-        throw 1;
+    const char *lData;
+    int lSize;
+    if (!readBytes(lData, lSize)) {
+        return false;
     }
-    return *this;
+    pString = QString::fromUtf8(lData, lSize);
+    return true;
+}
+
+bool VintStream::skipInt()
+{
+    // signed and unsigned vints both end at the first byte without the high bit set
+    while (mPosition < mEnd) {
+        if (!(*mPosition++ & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VintStream::skipBytes()
+{
+    const char *lData;
+    int lSize;
+    return readBytes(lData, lSize);
 }
 
 qint64 Metadata::mDefaultUid;
@@ -106,73 +128,67 @@ Metadata::Metadata(qint64 pMode)
     mSize = -1;
 }
 
+// Reads the fields of a common record, user and group names and sub-second parts of
+// timestamps are skipped. V1 stores mode, uid, gid and device number unsigned.
+static bool readCommonRecord(VintStream &pRecord, quint64 pTag, Metadata &pMetadata)
+{
+    if (pTag == cRecordCommonV1) {
+        quint64 lMode, lUid, lGid;
+        if (!pRecord.readUint(lMode) || !pRecord.readUint(lUid) || !pRecord.skipBytes() || !pRecord.readUint(lGid) || !pRecord.skipBytes()) {
+            return false;
+        }
+        pMetadata.mMode = static_cast<qint64>(lMode);
+        pMetadata.mUid = static_cast<qint64>(lUid);
+        pMetadata.mGid = static_cast<qint64>(lGid);
+    } else if (!pRecord.readInt(pMetadata.mMode) || !pRecord.readInt(pMetadata.mUid) || !pRecord.skipBytes() || !pRecord.readInt(pMetadata.mGid)
+               || !pRecord.skipBytes()) {
+        return false;
+    }
+    if (!pRecord.skipInt() // device number
+        || !pRecord.readInt(pMetadata.mAtime) || !pRecord.skipInt() // nanoseconds
+        || !pRecord.readInt(pMetadata.mMtime) || !pRecord.skipInt()) { // nanoseconds
+        return false;
+    }
+    if (pTag == cRecordCommonV3) {
+        return pRecord.skipInt() && pRecord.skipInt() // status change time
+            && pRecord.readInt(pMetadata.mSize);
+    }
+    return true;
+}
+
 int readMetadata(VintStream &pMetadataStream, Metadata &pMetadata)
 {
-    try {
+    while (true) {
         quint64 lTag;
-        do {
-            pMetadataStream >> lTag;
-            switch (lTag) {
-            case cRecordCommonV1: {
-                qint64 lNotUsedInt;
-                quint64 lNotUsedUint, lTempUint;
-                QString lNotUsedString;
-                pMetadataStream >> lNotUsedUint >> lTempUint;
-                pMetadata.mMode = static_cast<qint64>(lTempUint);
-                pMetadataStream >> lTempUint >> lNotUsedString; // user name
-                pMetadata.mUid = static_cast<qint64>(lTempUint);
-                pMetadataStream >> lTempUint >> lNotUsedString; // group name
-                pMetadata.mGid = static_cast<qint64>(lTempUint);
-                pMetadataStream >> lNotUsedUint; // device number
-                pMetadataStream >> pMetadata.mAtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> pMetadata.mMtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> lNotUsedInt >> lNotUsedUint; // status change time
-                break;
-            }
-            case cRecordCommonV2: {
-                qint64 lNotUsedInt;
-                quint64 lNotUsedUint;
-                QString lNotUsedString;
-                pMetadataStream >> lNotUsedUint >> pMetadata.mMode;
-                pMetadataStream >> pMetadata.mUid >> lNotUsedString; // user name
-                pMetadataStream >> pMetadata.mGid >> lNotUsedString; // group name
-                pMetadataStream >> lNotUsedInt; // device number
-                pMetadataStream >> pMetadata.mAtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> pMetadata.mMtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> lNotUsedInt >> lNotUsedUint; // status change time
-                break;
-            }
-            case cRecordCommonV3: {
-                qint64 lNotUsedInt;
-                quint64 lNotUsedUint;
-                QString lNotUsedString;
-                pMetadataStream >> lNotUsedUint >> pMetadata.mMode;
-                pMetadataStream >> pMetadata.mUid >> lNotUsedString; // user name
-                pMetadataStream >> pMetadata.mGid >> lNotUsedString; // group name
-                pMetadataStream >> lNotUsedInt; // device number
-                pMetadataStream >> pMetadata.mAtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> pMetadata.mMtime >> lNotUsedUint; // nanoseconds
-                pMetadataStream >> lNotUsedInt >> lNotUsedUint; // status change time
-                pMetadataStream >> pMetadata.mSize;
-                break;
-            }
-            case cRecordSymlinkTarget: {
-                pMetadataStream >> pMetadata.mSymlinkTarget;
-                break;
-            }
-            default: {
-                if (lTag != cRecordEnd) {
-                    QByteArray lNotUsed;
-                    pMetadataStream >> lNotUsed;
-                }
-                break;
-            }
+        if (!pMetadataStream.readUint(lTag)) {
+            return 1;
+        }
+        if (lTag == cRecordEnd) {
+            return 0; // success
+        }
+        // every record is stored as a byte string, also the ones we don't know about.
+        const char *lData;
+        int lSize;
+        if (!pMetadataStream.readBytes(lData, lSize)) {
+            return 1;
+        }
+        switch (lTag) {
+        case cRecordCommonV1:
+        case cRecordCommonV2:
+        case cRecordCommonV3: {
+            VintStream lRecord(lData, lSize);
+            if (!readCommonRecord(lRecord, lTag, pMetadata)) {
+                return 1;
             }
-        } while (lTag != cRecordEnd);
-    } catch (int) {
-        return 1;
+            break;
+        }
+        case cRecordSymlinkTarget:
+            pMetadata.mSymlinkTarget = QString::fromUtf8(lData, lSize);
+            break;
+        default:
+            break;
+        }
     }
-    return 0; // success
 }
 
 quint64 calculateChunkFileSize(const git_oid *pOid, git_repository *pRepository)
@@ -198,15 +214,173 @@ quint64 calculateChunkFileSize(const git_oid *pOid, git_repository *pRepository)
         git_tree_free(lTree);
     } while (S_ISDIR(lMode));
 
-    git_blob *lBlob;
-    if (0 != git_blob_lookup(&lBlob, pRepository, pOid)) {
+    if (!readBlobSize(pOid, pRepository, lLastChunkSize)) {
         return 0;
     }
-    lLastChunkSize = static_cast<quint64>(git_blob_rawsize(lBlob));
-    git_blob_free(lBlob);
     return lLastChunkOffset + lLastChunkSize;
 }
 
+bool readBlobSize(const git_oid *pOid, git_repository *pRepository, quint64 &pSize)
+{
+    git_odb *lOdb;
+    if (0 != git_repository_odb(&lOdb, pRepository)) {
+        return false;
+    }
+    size_t lSize;
+    git_object_t lType;
+    const bool lSuccess = 0 == git_odb_read_header(&lSize, &lType, lOdb, pOid);
+    git_odb_free(lOdb);
+    if (lSuccess) {
+        pSize = static_cast<quint64>(lSize);
+    }
+    return lSuccess;
+}
+
+static bool appendChunks(const git_oid *pTreeOid, quint64 pBaseOffset, git_repository *pRepository, ChunkTable &pChunks)
+{
+    git_tree *lTree;
+    if (0 != git_tree_lookup(&lTree, pRepository, pTreeOid)) {
+        return false;
+    }
+    bool lSuccess = true;
+    ulong lEntryCount = git_tree_entrycount(lTree);
+    for (ulong i = 0; i < lEntryCount && lSuccess; ++i) {
+        const git_tree_entry *lEntry = git_tree_entry_byindex(lTree, i);
+        quint64 lOffset;
+        if (!offsetFromName(lEntry, lOffset)) {
+            lSuccess = false;
+            break;
+        }
+        // offsets in a subtree are relative to where that subtree starts
+        lOffset += pBaseOffset;
+        if (S_ISDIR(git_tree_entry_filemode(lEntry))) {
+            lSuccess = appendChunks(git_tree_entry_id(lEntry), lOffset, pRepository, pChunks);
+        } else {
+            ChunkRecord lChunk;
+            lChunk.mOffset = lOffset;
+            lChunk.mOid = *git_tree_entry_id(lEntry);
+            pChunks.append(lChunk);
+        }
+    }
+    git_tree_free(lTree);
+    return lSuccess;
+}
+
+bool buildChunkTable(const git_oid *pOid, git_repository *pRepository, ChunkTable &pChunks)
+{
+    pChunks.clear();
+    if (!appendChunks(pOid, 0, pRepository, pChunks)) {
+        pChunks.clear();
+        return false;
+    }
+    return true;
+}
+
+ChunkTreeWalker::ChunkTreeWalker(git_repository *pRepository)
+    : mRepository(pRepository)
+    , mFailed(false)
+{
+}
+
+ChunkTreeWalker::~ChunkTreeWalker()
+{
+    clear();
+}
+
+void ChunkTreeWalker::clear()
+{
+    for (const Level &lLevel : std::as_const(mLevels)) {
+        git_tree_free(lLevel.mTree);
+    }
+    mLevels.clear();
+}
+
+bool ChunkTreeWalker::push(const git_oid *pTreeOid, quint64 pBaseOffset)
+{
+    git_tree *lTree;
+    if (0 != git_tree_lookup(&lTree, mRepository, pTreeOid)) {
+        mFailed = true;
+        return false;
+    }
+    mLevels.append(Level{lTree, 0, pBaseOffset});
+    return true;
+}
+
+bool ChunkTreeWalker::seek(const git_oid *pOid, quint64 pOffset, quint64 &pSkipSize)
+{
+    clear();
+    mFailed = false;
+    if (!push(pOid, 0)) {
+        return false;
+    }
+    while (true) {
+        Level &lLevel = mLevels.last();
+        const quint64 lLocalOffset = pOffset - lLevel.mBaseOffset;
+        size_t lLower = 0;
+        quint64 lLowerOffset = 0;
+        size_t lUpper = git_tree_entrycount(lLevel.mTree);
+        if (lUpper == 0) {
+            mFailed = true;
+            return false;
+        }
+        while (lUpper - lLower > 1) {
+            const size_t lToCheck = lLower + (lUpper - lLower) / 2;
+            quint64 lCheckOffset;
+            if (!offsetFromName(git_tree_entry_byindex(lLevel.mTree, lToCheck), lCheckOffset)) {
+                mFailed = true;
+                return false;
+            }
+            if (lCheckOffset > lLocalOffset) {
+                lUpper = lToCheck;
+            } else {
+                lLower = lToCheck;
+                lLowerOffset = lCheckOffset;
+            }
+        }
+        lLevel.mIndex = lLower;
+        const git_tree_entry *lEntry = git_tree_entry_byindex(lLevel.mTree, lLower);
+        if (!S_ISDIR(git_tree_entry_filemode(lEntry))) {
+            pSkipSize = lLocalOffset - lLowerOffset;
+            return true;
+        }
+        // leaves the parent index on the subtree, next() moves past it when the subtree ends.
+        if (!push(git_tree_entry_id(lEntry), lLevel.mBaseOffset + lLowerOffset)) {
+            return false;
+        }
+    }
+}
+
+bool ChunkTreeWalker::next(ChunkRecord &pChunk)
+{
+    while (!mLevels.isEmpty() && !mFailed) {
+        Level &lLevel = mLevels.last();
+        if (lLevel.mIndex >= git_tree_entrycount(lLevel.mTree)) {
+            git_tree_free(lLevel.mTree);
+            mLevels.removeLast();
+            if (!mLevels.isEmpty()) {
+                mLevels.last().mIndex++;
+            }
+            continue;
+        }
+        const git_tree_entry *lEntry = git_tree_entry_byindex(lLevel.mTree, lLevel.mIndex);
+        quint64 lOffset;
+        if (!offsetFromName(lEntry, lOffset)) {
+            mFailed = true;
+            break;
+        }
+        lOffset += lLevel.mBaseOffset;
+        if (S_ISDIR(git_tree_entry_filemode(lEntry))) {
+            push(git_tree_entry_id(lEntry), lOffset);
+            continue;
+        }
+        pChunk.mOffset = lOffset;
+        pChunk.mOid = *git_tree_entry_id(lEntry);
+        lLevel.mIndex++;
+        return true;
+    }
+    return false;
+}
+
 bool offsetFromName(const git_tree_entry *pEntry, quint64 &pUint)
 {
     bool lParsedOk;
@@ -235,3 +409,22 @@ QString vfsTimeToString(git_time_t pTime)
     lDateTime.setSecsSinceEpoch(pTime);
     return lDateTime.toLocalTime().toString(QStringLiteral("yyyy-MM-dd hh:mm"));
 }
+
+bool vfsTimeFromString(const QString &pString, qint64 &pTime)
+{
+    // QDateTime would take a plain date as midnight, so that form has to be checked first.
+    if (!pString.contains(QLatin1Char('T'))) {
+        const QDate lDate = QDate::fromString(pString, Qt::ISODate);
+        if (!lDate.isValid()) {
+            return false;
+        }
+        pTime = lDate.endOfDay().toSecsSinceEpoch();
+        return true;
+    }
+    const QDateTime lTime = QDateTime::fromString(pString, Qt::ISODate);
+    if (!lTime.isValid()) {
+        return false;
+    }
+    pTime = lTime.toSecsSinceEpoch();
+    return true;
+}
@@ -5,30 +5,37 @@
 #ifndef VFSHELPERS_H
 #define VFSHELPERS_H
 
-#include <QObject>
 #include <QString>
-class QBuffer;
+#include <QVector>
 
 #include <git2.h>
 
 #define DEFAULT_MODE_DIRECTORY 0040755
 #define DEFAULT_MODE_FILE 0100644
 
-class VintStream : public QObject
+// Reads the variable length integers and byte strings used in bup's .bupm files,
+// directly from the blob content. Nothing is copied, every read returns false if
+// the data ends too early or is corrupt.
+class VintStream
 {
-    Q_OBJECT
-
 public:
-    VintStream(const void *pData, int pSize, QObject *pParent);
+    VintStream(const void *pData, int pSize);
 
-    VintStream &operator>>(qint64 &pInt);
-    VintStream &operator>>(quint64 &pUint);
-    VintStream &operator>>(QString &pString);
-    VintStream &operator>>(QByteArray &pByteArray);
+    bool readInt(qint64 &pInt);
+    bool readUint(quint64 &pUint);
+    // pData points into the stream, valid as long as the underlying blob.
+    bool readBytes(const char *&pData, int &pSize);
+    bool readString(QString &pString);
+    bool skipInt(); // works for both signed and unsigned
+    bool skipBytes();
+    bool atEnd() const
+    {
+        return mPosition >= mEnd;
+    }
 
 protected:
-    QByteArray mByteArray;
-    QBuffer *mBuffer;
+    const uchar *mPosition;
+    const uchar *mEnd;
 };
 
 struct Metadata {
@@ -49,10 +56,54 @@ struct Metadata {
     static bool mDefaultsResolved;
 };
 
+// One leaf blob of a chunked file, mOffset is the absolute offset in the file.
+struct ChunkRecord {
+    quint64 mOffset;
+    git_oid mOid;
+};
+typedef QVector<ChunkRecord> ChunkTable;
+
+// Walks the leaf chunks of a chunked file in order without building the whole
+// chunk table, only the trees on the path to the current chunk are kept open.
+class ChunkTreeWalker
+{
+public:
+    explicit ChunkTreeWalker(git_repository *pRepository);
+    ~ChunkTreeWalker();
+    // Positions the walker so that the next chunk is the one holding pOffset,
+    // pSkipSize is set to where pOffset is in that chunk.
+    bool seek(const git_oid *pOid, quint64 pOffset, quint64 &pSkipSize);
+    // False at the end of the file and on errors, failed() tells them apart.
+    bool next(ChunkRecord &pChunk);
+    bool failed() const
+    {
+        return mFailed;
+    }
+
+protected:
+    bool push(const git_oid *pTreeOid, quint64 pBaseOffset);
+    void clear();
+
+    struct Level {
+        git_tree *mTree;
+        size_t mIndex;
+        quint64 mBaseOffset;
+    };
+    git_repository *mRepository;
+    QVector<Level> mLevels;
+    bool mFailed;
+};
+
 int readMetadata(VintStream &pMetadataStream, Metadata &pMetadata);
 quint64 calculateChunkFileSize(const git_oid *pOid, git_repository *pRepository);
+// Reads only the object header, the blob is not inflated.
+bool readBlobSize(const git_oid *pOid, git_repository *pRepository, quint64 &pSize);
+bool buildChunkTable(const git_oid *pOid, git_repository *pRepository, ChunkTable &pChunks);
 bool offsetFromName(const git_tree_entry *pEntry, quint64 &pUint);
 void getEntryAttributes(const git_tree_entry *pTreeEntry, uint &pMode, bool &pChunked, const git_oid *&pOid, QString &pName);
 QString vfsTimeToString(git_time_t pTime);
+// Parses the local time in "@2024-05-01T12:00" style snapshot names, without the '@'.
+// A date without a time means the end of that day.
+bool vfsTimeFromString(const QString &pString, qint64 &pTime);
 
 #endif // VFSHELPERS_H
@@ -0,0 +1,831 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#include "vfsindex.h"
+#include "kupkio_debug.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QMap>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtEndian>
+
+#include <git2/blob.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <utility>
+
+static const char cIndexMagic[8] = {'K', 'U', 'P', 'I', 'N', 'D', 'E', 'X'};
+static const quint32 cIndexVersion = 2;
+static const quint32 cBlockDirectory = 1;
+static const quint32 cBlockCommits = 2;
+static const quint32 cBlockFileSizes = 3;
+static const quint32 cBlockChunkTable = 4;
+static const quint32 cBlockRecordTable = 5; // sorted keys of the directory and chunk table blocks
+static const quint32 cBlockFileSizeTable = 6; // sorted file sizes
+static const quint32 cEntryChunked = 1;
+static const quint32 cCommitsReplace = 1;
+static const qint64 cMaxIndexSize = Q_INT64_C(1) << 30; // start over if the index grows beyond 1 GiB
+static const int cMaxIndexedChunks = 1 << 16; // bigger chunk tables are rebuilt when needed instead of stored
+static const int cChunkRecordSize = sizeof(quint64) + GIT_OID_RAWSZ; // offset and oid, without padding
+static const qint64 cMaxUnindexedSize = 4 << 20; // rewrite the file with fresh tables when the unsorted part grows beyond 4 MiB
+static const int cTableKeySize = GIT_OID_RAWSZ + sizeof(quint32); // oid and big endian block type, sorts like the key bytes
+static const int cRecordTableEntrySize = cTableKeySize + sizeof(quint64); // key and file offset of the block payload
+static const int cFileSizeTableEntrySize = GIT_OID_RAWSZ + sizeof(quint64);
+static const int cLockTimeout = 2000; // ms
+
+struct IndexHeader {
+    char mMagic[8];
+    quint32 mVersion;
+    quint32 mReserved;
+};
+
+struct BlockHeader {
+    quint32 mType;
+    quint32 mSize;
+};
+
+struct EntryRecord {
+    git_oid mOid;
+    quint32 mTreeMode;
+    qint64 mMode;
+    qint64 mUid;
+    qint64 mGid;
+    qint64 mAtime;
+    qint64 mMtime;
+    qint64 mSize;
+    quint32 mFlags;
+    quint32 mNameSize;
+    quint32 mLinkSize;
+};
+
+struct CommitRecord {
+    git_oid mCommitOid;
+    git_oid mTreeOid;
+    qint64 mCommitTime;
+};
+
+struct FileSizeRecord {
+    git_oid mOid;
+    quint64 mSize;
+};
+
+static IndexHeader indexHeader()
+{
+    IndexHeader lHeader;
+    memset(&lHeader, 0, sizeof(lHeader));
+    memcpy(lHeader.mMagic, cIndexMagic, sizeof(cIndexMagic));
+    lHeader.mVersion = cIndexVersion;
+    return lHeader;
+}
+
+static QByteArray oidKey(const git_oid *pOid)
+{
+    return QByteArray(reinterpret_cast<const char *>(pOid->id), GIT_OID_RAWSZ);
+}
+
+static QByteArray recordKey(quint32 pType, const git_oid *pOid)
+{
+    QByteArray lKey = oidKey(pOid);
+    const quint32 lType = qToBigEndian(pType);
+    lKey.append(reinterpret_cast<const char *>(&lType), sizeof(lType));
+    return lKey;
+}
+
+// Binary search in a sorted table of fixed size entries which start with the key bytes.
+static const char *findTableEntry(const char *pTable, quint32 pCount, int pEntrySize, const QByteArray &pKey)
+{
+    quint32 lLower = 0;
+    quint32 lUpper = pCount;
+    while (lLower < lUpper) {
+        const quint32 lMiddle = lLower + (lUpper - lLower) / 2;
+        const char *lEntry = pTable + static_cast<qptrdiff>(lMiddle) * pEntrySize;
+        const int lOrder = memcmp(lEntry, pKey.constData(), static_cast<size_t>(pKey.size()));
+        if (lOrder == 0) {
+            return lEntry;
+        }
+        if (lOrder < 0) {
+            lLower = lMiddle + 1;
+        } else {
+            lUpper = lMiddle;
+        }
+    }
+    return nullptr;
+}
+
+template<typename T>
+static void appendRecord(QByteArray &pBuffer, const T &pRecord)
+{
+    pBuffer.append(reinterpret_cast<const char *>(&pRecord), static_cast<int>(sizeof(T)));
+}
+
+template<typename T>
+static bool takeRecord(const char *&pData, const char *pEnd, T &pRecord)
+{
+    if (pEnd - pData < static_cast<qptrdiff>(sizeof(T))) {
+        return false;
+    }
+    memcpy(&pRecord, pData, sizeof(T));
+    pData += sizeof(T);
+    return true;
+}
+
+static QByteArray commitsPayload(const QByteArray &pRefName, const git_oid *pHead, const IndexedCommitList &pCommits, bool pReplace)
+{
+    QByteArray lPayload;
+    appendRecord(lPayload, pReplace ? cCommitsReplace : 0u);
+    appendRecord(lPayload, static_cast<quint32>(pRefName.size()));
+    lPayload.append(pRefName);
+    appendRecord(lPayload, *pHead);
+    appendRecord(lPayload, static_cast<quint32>(pCommits.count()));
+    for (const IndexedCommit &lCommit : pCommits) {
+        CommitRecord lRecord;
+        memset(&lRecord, 0, sizeof(lRecord));
+        lRecord.mCommitOid = lCommit.mCommitOid;
+        lRecord.mTreeOid = lCommit.mTreeOid;
+        lRecord.mCommitTime = lCommit.mCommitTime;
+        appendRecord(lPayload, lRecord);
+    }
+    return lPayload;
+}
+
+static bool takeString(const char *&pData, const char *pEnd, quint32 pSize, QString &pString)
+{
+    if (pEnd - pData < static_cast<qptrdiff>(pSize)) {
+        return false;
+    }
+    pString = QString::fromUtf8(pData, static_cast<int>(pSize));
+    pData += pSize;
+    return true;
+}
+
+static void appendEntry(QByteArray &pBuffer, const git_oid *pOid, uint pTreeMode, bool pChunked, const Metadata &pMetadata, const QString &pName)
+{
+    const QByteArray lName = pName.toUtf8();
+    const QByteArray lLink = pMetadata.mSymlinkTarget.toUtf8();
+    EntryRecord lRecord;
+    memset(&lRecord, 0, sizeof(lRecord));
+    lRecord.mOid = *pOid;
+    lRecord.mTreeMode = pTreeMode;
+    lRecord.mMode = pMetadata.mMode;
+    lRecord.mUid = pMetadata.mUid;
+    lRecord.mGid = pMetadata.mGid;
+    lRecord.mAtime = pMetadata.mAtime;
+    lRecord.mMtime = pMetadata.mMtime;
+    lRecord.mSize = pMetadata.mSize;
+    lRecord.mFlags = pChunked ? cEntryChunked : 0;
+    lRecord.mNameSize = static_cast<quint32>(lName.size());
+    lRecord.mLinkSize = static_cast<quint32>(lLink.size());
+    appendRecord(pBuffer, lRecord);
+    pBuffer.append(lName);
+    pBuffer.append(lLink);
+}
+
+static bool takeEntry(const char *&pData, const char *pEnd, IndexedEntry &pEntry)
+{
+    EntryRecord lRecord;
+    if (!takeRecord(pData, pEnd, lRecord)) {
+        return false;
+    }
+    pEntry.mOid = lRecord.mOid;
+    pEntry.mMode = lRecord.mTreeMode;
+    pEntry.mChunked = lRecord.mFlags & cEntryChunked;
+    pEntry.mMetadata.mMode = lRecord.mMode;
+    pEntry.mMetadata.mUid = lRecord.mUid;
+    pEntry.mMetadata.mGid = lRecord.mGid;
+    pEntry.mMetadata.mAtime = lRecord.mAtime;
+    pEntry.mMetadata.mMtime = lRecord.mMtime;
+    pEntry.mMetadata.mSize = lRecord.mSize;
+    return takeString(pData, pEnd, lRecord.mNameSize, pEntry.mName) && takeString(pData, pEnd, lRecord.mLinkSize, pEntry.mMetadata.mSymlinkTarget);
+}
+
+void readDirectoryEntries(git_repository *pRepository, git_tree *pTree, VintStream *pMetadataStream, QList<IndexedEntry> &pEntries)
+{
+    ulong lEntryCount = git_tree_entrycount(pTree);
+    for (uint i = 0; i < lEntryCount; ++i) {
+        uint lMode;
+        const git_oid *lOid;
+        QString lName;
+        bool lChunked;
+        const git_tree_entry *lTreeEntry = git_tree_entry_byindex(pTree, i);
+        getEntryAttributes(lTreeEntry, lMode, lChunked, lOid, lName);
+        if (lName == QStringLiteral(".bupm")) {
+            continue;
+        }
+        IndexedEntry lEntry(lMode);
+        lEntry.mName = lName;
+        lEntry.mOid = *lOid;
+        lEntry.mChunked = lChunked;
+        if (!S_ISDIR(lMode) && pMetadataStream != nullptr) {
+            readMetadata(*pMetadataStream, lEntry.mMetadata);
+        }
+        if (S_ISLNK(lMode) && lEntry.mMetadata.mSymlinkTarget.isEmpty()) {
+            git_blob *lBlob;
+            if (0 == git_blob_lookup(&lBlob, pRepository, lOid)) {
+                lEntry.mMetadata.mSymlinkTarget =
+                    QString::fromUtf8(static_cast<const char *>(git_blob_rawcontent(lBlob)), static_cast<int>(git_blob_rawsize(lBlob)));
+                git_blob_free(lBlob);
+            }
+        }
+        pEntries.append(lEntry);
+    }
+}
+
+bool readDirectoryMetadata(git_repository *pRepository, const git_oid *pTreeOid, Metadata &pMetadata)
+{
+    git_tree *lTree;
+    if (0 != git_tree_lookup(&lTree, pRepository, pTreeOid)) {
+        return false;
+    }
+    bool lResult = false;
+    git_blob *lMetadataBlob = nullptr;
+    const git_tree_entry *lTreeEntry = git_tree_entry_byname(lTree, ".bupm");
+    if (lTreeEntry != nullptr && 0 == git_blob_lookup(&lMetadataBlob, pRepository, git_tree_entry_id(lTreeEntry))) {
+        VintStream lMetadataStream(git_blob_rawcontent(lMetadataBlob), static_cast<int>(git_blob_rawsize(lMetadataBlob)));
+        lResult = 0 == readMetadata(lMetadataStream, pMetadata);
+        git_blob_free(lMetadataBlob);
+    }
+    git_tree_free(lTree);
+    return lResult;
+}
+
+bool decodeArchivedDirectory(git_repository *pRepository, const git_oid *pTreeOid, IndexedDirectory &pDirectory)
+{
+    git_tree *lTree;
+    if (0 != git_tree_lookup(&lTree, pRepository, pTreeOid)) {
+        return false;
+    }
+    git_blob *lMetadataBlob = nullptr;
+    VintStream *lMetadataStream = nullptr;
+    const git_tree_entry *lTreeEntry = git_tree_entry_byname(lTree, ".bupm");
+    if (lTreeEntry != nullptr && 0 == git_blob_lookup(&lMetadataBlob, pRepository, git_tree_entry_id(lTreeEntry))) {
+        lMetadataStream = new VintStream(git_blob_rawcontent(lMetadataBlob), static_cast<int>(git_blob_rawsize(lMetadataBlob)));
+        readMetadata(*lMetadataStream, pDirectory.mMetadata); // the first entry is metadata for the directory itself
+    }
+    readDirectoryEntries(pRepository, lTree, lMetadataStream, pDirectory.mEntries);
+    delete lMetadataStream;
+    git_blob_free(lMetadataBlob);
+    git_tree_free(lTree);
+    return true;
+}
+
+VfsIndex::VfsIndex(const QString &pRepositoryPath)
+    : mMapped(nullptr)
+    , mMappedSize(0)
+    , mMappedInode(0)
+    , mKnownFileSize(0)
+    , mValidSize(0)
+    , mIndexedSize(0)
+    , mRecordTable(nullptr)
+    , mRecordCount(0)
+    , mFileSizeTable(nullptr)
+    , mFileSizeCount(0)
+    , mDiscardExisting(false)
+    , mFlushedSize(0)
+{
+    const QByteArray lRepoHash = QCryptographicHash::hash(QDir(pRepositoryPath).canonicalPath().toUtf8(), QCryptographicHash::Sha1).toHex();
+    mPath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QStringLiteral("/kup/") + QString::fromLatin1(lRepoHash)
+        + QStringLiteral(".index");
+    load();
+}
+
+VfsIndex::~VfsIndex()
+{
+    flush();
+    if (mMapped != nullptr) {
+        mFile.unmap(mMapped);
+    }
+}
+
+void VfsIndex::load()
+{
+    // A block that is still being appended by another process would look like the
+    // leftovers of an interrupted write without the lock.
+    QLockFile lLock(mPath + QStringLiteral(".lock"));
+    readFile(lLock.tryLock(cLockTimeout));
+}
+
+void VfsIndex::readFile(bool pLocked)
+{
+    mFile.setFileName(mPath);
+    if (!mFile.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    struct stat lStat;
+    if (0 == fstat(mFile.handle(), &lStat)) {
+        mMappedInode = static_cast<quint64>(lStat.st_ino);
+    }
+    mKnownFileSize = mFile.size();
+    if (mFile.size() > cMaxIndexSize) {
+        mFile.close();
+        mDiscardExisting = true;
+        return;
+    }
+    mMappedSize = mFile.size();
+    mMapped = mFile.map(0, mMappedSize);
+    if (mMapped == nullptr) {
+        return;
+    }
+    const char *lStart = reinterpret_cast<const char *>(mMapped);
+    const char *lData = lStart;
+    const char *lEnd = lData + mMappedSize;
+    IndexHeader lHeader;
+    if (!takeRecord(lData, lEnd, lHeader) || 0 != memcmp(lHeader.mMagic, cIndexMagic, sizeof(cIndexMagic)) || lHeader.mVersion != cIndexVersion) {
+        qCDebug(KUPKIO) << "discarding incompatible index file" << mPath;
+        mDiscardExisting = true;
+        return;
+    }
+    // Blocks covered by the sorted tables are looked up there, only the blocks
+    // appended after the last rewrite need to be parsed.
+    mIndexedSize = lData - lStart;
+    if (readTables(lData, lEnd)) {
+        lData = lStart + mIndexedSize;
+    }
+    BlockHeader lBlock;
+    while (takeRecord(lData, lEnd, lBlock)) {
+        if (lEnd - lData < static_cast<qptrdiff>(lBlock.mSize)) {
+            lData -= sizeof(BlockHeader);
+            break;
+        }
+        parseBlock(lBlock.mType, lData, lBlock.mSize, true);
+        lData += lBlock.mSize;
+    }
+    mValidSize = lData - lStart;
+    if (mValidSize != mMappedSize && pLocked) {
+        // a writer got interrupted, rewrite the file without the incomplete block on next flush.
+        mDiscardExisting = true;
+    }
+}
+
+bool VfsIndex::readTables(const char *pData, const char *pEnd)
+{
+    BlockHeader lBlock;
+    quint64 lIndexedEnd;
+    quint32 lRecordCount, lFileSizeCount;
+    if (!takeRecord(pData, pEnd, lBlock) || lBlock.mType != cBlockRecordTable || pEnd - pData < static_cast<qptrdiff>(lBlock.mSize)) {
+        return false;
+    }
+    const char *lBlockEnd = pData + lBlock.mSize;
+    if (!takeRecord(pData, lBlockEnd, lIndexedEnd) || !takeRecord(pData, lBlockEnd, lRecordCount)
+        || lBlockEnd - pData < static_cast<qptrdiff>(lRecordCount) * cRecordTableEntrySize) {
+        return false;
+    }
+    const char *lRecordTable = pData;
+    pData = lBlockEnd;
+    if (!takeRecord(pData, pEnd, lBlock) || lBlock.mType != cBlockFileSizeTable || pEnd - pData < static_cast<qptrdiff>(lBlock.mSize)) {
+        return false;
+    }
+    lBlockEnd = pData + lBlock.mSize;
+    if (!takeRecord(pData, lBlockEnd, lFileSizeCount) || lBlockEnd - pData < static_cast<qptrdiff>(lFileSizeCount) * cFileSizeTableEntrySize) {
+        return false;
+    }
+    const char *lStart = reinterpret_cast<const char *>(mMapped);
+    if (lIndexedEnd < static_cast<quint64>(lBlockEnd - lStart) || lIndexedEnd > static_cast<quint64>(mMappedSize)) {
+        return false;
+    }
+    mRecordTable = lRecordTable;
+    mRecordCount = lRecordCount;
+    mFileSizeTable = pData;
+    mFileSizeCount = lFileSizeCount;
+    mIndexedSize = static_cast<qint64>(lIndexedEnd);
+    return true;
+}
+
+void VfsIndex::unload()
+{
+    if (mMapped != nullptr) {
+        mFile.unmap(mMapped);
+        mMapped = nullptr;
+    }
+    mFile.close();
+    mMappedSize = 0;
+    mMappedInode = 0;
+    mKnownFileSize = 0;
+    mValidSize = 0;
+    mIndexedSize = 0;
+    mRecordTable = nullptr;
+    mRecordCount = 0;
+    mFileSizeTable = nullptr;
+    mFileSizeCount = 0;
+    mDiscardExisting = false;
+    mMappedRecords.clear();
+    mLocalRecords.clear();
+    mFileSizes.clear();
+    mBranches.clear();
+}
+
+void VfsIndex::reload()
+{
+    unload();
+    readFile(true);
+    // Blocks already written are in the file now, or were dropped together with it.
+    // The rest goes on top of the file contents again, the same way it was added.
+    mLocalBlocks.remove(0, mFlushedSize);
+    mFlushedSize = 0;
+    const char *lData = mLocalBlocks.constData();
+    const char *lEnd = lData + mLocalBlocks.size();
+    BlockHeader lBlock;
+    while (takeRecord(lData, lEnd, lBlock)) {
+        parseBlock(lBlock.mType, lData, lBlock.mSize, false);
+        lData += lBlock.mSize;
+    }
+}
+
+const char *VfsIndex::tableRecord(const char *pEntry) const
+{
+    quint64 lOffset;
+    memcpy(&lOffset, pEntry + cTableKeySize, sizeof(lOffset));
+    if (lOffset < sizeof(IndexHeader) + sizeof(BlockHeader) || lOffset > static_cast<quint64>(mIndexedSize)) {
+        return nullptr;
+    }
+    const char *lData = reinterpret_cast<const char *>(mMapped) + lOffset;
+    BlockHeader lBlock;
+    memcpy(&lBlock, lData - sizeof(BlockHeader), sizeof(BlockHeader));
+    if (lOffset + lBlock.mSize > static_cast<quint64>(mIndexedSize) || lBlock.mSize < sizeof(git_oid)) {
+        return nullptr;
+    }
+    return lData;
+}
+
+bool VfsIndex::fileChanged() const
+{
+    struct stat lStat;
+    if (0 != stat(QFile::encodeName(mPath).constData(), &lStat)) {
+        return mKnownFileSize > 0;
+    }
+    return static_cast<quint64>(lStat.st_ino) != mMappedInode || lStat.st_size != mKnownFileSize;
+}
+
+void VfsIndex::parseBlock(quint32 pType, const char *pData, quint32 pSize, bool pMapped)
+{
+    const char *lEnd = pData + pSize;
+    switch (pType) {
+    case cBlockDirectory:
+    case cBlockChunkTable: {
+        git_oid lTreeOid;
+        const char *lStart = pData;
+        if (!takeRecord(pData, lEnd, lTreeOid)) {
+            return;
+        }
+        if (pMapped) {
+            mMappedRecords.insert(recordKey(pType, &lTreeOid), lStart);
+        } else {
+            mLocalRecords.insert(recordKey(pType, &lTreeOid), static_cast<int>(lStart - mLocalBlocks.constData()));
+        }
+        break;
+    }
+    case cBlockCommits: {
+        quint32 lFlags, lNameSize, lCount;
+        git_oid lHead;
+        if (!takeRecord(pData, lEnd, lFlags) || !takeRecord(pData, lEnd, lNameSize) || lEnd - pData < static_cast<qptrdiff>(lNameSize)) {
+            return;
+        }
+        const QByteArray lRefName(pData, static_cast<int>(lNameSize));
+        pData += lNameSize;
+        if (!takeRecord(pData, lEnd, lHead) || !takeRecord(pData, lEnd, lCount)) {
+            return;
+        }
+        IndexedCommitList lCommits;
+        CommitRecord lRecord;
+        while (lCount-- > 0 && takeRecord(pData, lEnd, lRecord)) {
+            IndexedCommit lCommit{lRecord.mCommitOid, lRecord.mTreeOid, lRecord.mCommitTime};
+            lCommits.append(lCommit);
+        }
+        applyCommits(lRefName, &lHead, lCommits, lFlags & cCommitsReplace);
+        break;
+    }
+    case cBlockFileSizes: {
+        FileSizeRecord lRecord;
+        while (takeRecord(pData, lEnd, lRecord)) {
+            mFileSizes.insert(oidKey(&lRecord.mOid), lRecord.mSize);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void VfsIndex::appendBlock(quint32 pType, const QByteArray &pPayload)
+{
+    BlockHeader lBlock;
+    lBlock.mType = pType;
+    lBlock.mSize = static_cast<quint32>(pPayload.size());
+    appendRecord(mLocalBlocks, lBlock);
+    const int lOffset = mLocalBlocks.size();
+    mLocalBlocks.append(pPayload);
+    parseBlock(pType, mLocalBlocks.constData() + lOffset, lBlock.mSize, false);
+}
+
+void VfsIndex::applyCommits(const QByteArray &pRefName, const git_oid *pHead, const IndexedCommitList &pCommits, bool pReplace)
+{
+    BranchRecord &lBranch = mBranches[pRefName];
+    if (pReplace) {
+        lBranch.mCommits.clear();
+    }
+    lBranch.mHead = *pHead;
+    lBranch.mCommits.append(pCommits);
+    std::stable_sort(lBranch.mCommits.begin(), lBranch.mCommits.end(), [](const IndexedCommit &a, const IndexedCommit &b) {
+        return a.mCommitTime < b.mCommitTime;
+    });
+}
+
+const char *VfsIndex::recordData(quint32 pType, const git_oid *pOid, const char *&pEnd) const
+{
+    const QByteArray lKey = recordKey(pType, pOid);
+    const char *lEntry = findTableEntry(mRecordTable, mRecordCount, cRecordTableEntrySize, lKey);
+    const char *lData = lEntry != nullptr ? tableRecord(lEntry) : nullptr;
+    if (lData == nullptr) {
+        lData = mMappedRecords.value(lKey, nullptr);
+    }
+    if (lData == nullptr) {
+        auto lIter = mLocalRecords.constFind(lKey);
+        if (lIter == mLocalRecords.constEnd()) {
+            return nullptr;
+        }
+        lData = mLocalBlocks.constData() + lIter.value();
+    }
+    BlockHeader lBlock;
+    memcpy(&lBlock, lData - sizeof(BlockHeader), sizeof(BlockHeader));
+    pEnd = lData + lBlock.mSize;
+    return lData + sizeof(git_oid);
+}
+
+bool VfsIndex::directory(const git_oid *pTreeOid, IndexedDirectory &pDirectory) const
+{
+    const char *lEnd;
+    const char *lData = recordData(cBlockDirectory, pTreeOid, lEnd);
+    quint32 lCount;
+    if (lData == nullptr || !takeRecord(lData, lEnd, lCount)) {
+        return false;
+    }
+    IndexedEntry lSelf(DEFAULT_MODE_DIRECTORY);
+    if (!takeEntry(lData, lEnd, lSelf)) {
+        return false;
+    }
+    pDirectory.mMetadata = lSelf.mMetadata;
+    pDirectory.mEntries.clear();
+    pDirectory.mEntries.reserve(static_cast<int>(lCount));
+    for (quint32 i = 0; i < lCount; ++i) {
+        IndexedEntry lEntry;
+        if (!takeEntry(lData, lEnd, lEntry)) {
+            return false;
+        }
+        pDirectory.mEntries.append(lEntry);
+    }
+    return true;
+}
+
+bool VfsIndex::containsDirectory(const git_oid *pTreeOid) const
+{
+    const char *lEnd;
+    return recordData(cBlockDirectory, pTreeOid, lEnd) != nullptr;
+}
+
+bool VfsIndex::directoryMetadata(const git_oid *pTreeOid, Metadata &pMetadata) const
+{
+    const char *lEnd;
+    const char *lData = recordData(cBlockDirectory, pTreeOid, lEnd);
+    quint32 lCount;
+    IndexedEntry lSelf(DEFAULT_MODE_DIRECTORY);
+    if (lData == nullptr || !takeRecord(lData, lEnd, lCount) || !takeEntry(lData, lEnd, lSelf)) {
+        return false;
+    }
+    pMetadata = lSelf.mMetadata;
+    return true;
+}
+
+void VfsIndex::addDirectory(const git_oid *pTreeOid, const IndexedDirectory &pDirectory)
+{
+    QByteArray lPayload;
+    appendRecord(lPayload, *pTreeOid);
+    appendRecord(lPayload, static_cast<quint32>(pDirectory.mEntries.count()));
+    appendEntry(lPayload, pTreeOid, DEFAULT_MODE_DIRECTORY, false, pDirectory.mMetadata, QString());
+    for (const IndexedEntry &lEntry : pDirectory.mEntries) {
+        appendEntry(lPayload, &lEntry.mOid, lEntry.mMode, lEntry.mChunked, lEntry.mMetadata, lEntry.mName);
+    }
+    appendBlock(cBlockDirectory, lPayload);
+}
+
+bool VfsIndex::chunkTable(const git_oid *pTreeOid, ChunkTable &pChunks) const
+{
+    const char *lEnd;
+    const char *lData = recordData(cBlockChunkTable, pTreeOid, lEnd);
+    quint32 lCount;
+    if (lData == nullptr || !takeRecord(lData, lEnd, lCount) || lEnd - lData < static_cast<qptrdiff>(lCount) * cChunkRecordSize) {
+        return false;
+    }
+    pChunks.resize(static_cast<int>(lCount));
+    for (ChunkRecord &lChunk : pChunks) {
+        memcpy(&lChunk.mOffset, lData, sizeof(quint64));
+        memcpy(lChunk.mOid.id, lData + sizeof(quint64), GIT_OID_RAWSZ);
+        lData += cChunkRecordSize;
+    }
+    return true;
+}
+
+void VfsIndex::addChunkTable(const git_oid *pTreeOid, const ChunkTable &pChunks)
+{
+    if (pChunks.count() > cMaxIndexedChunks) {
+        return; // would crowd out everything else in the index
+    }
+    QByteArray lPayload;
+    lPayload.reserve(static_cast<int>(sizeof(git_oid) + sizeof(quint32)) + pChunks.count() * cChunkRecordSize);
+    appendRecord(lPayload, *pTreeOid);
+    appendRecord(lPayload, static_cast<quint32>(pChunks.count()));
+    for (const ChunkRecord &lChunk : pChunks) {
+        appendRecord(lPayload, lChunk.mOffset);
+        lPayload.append(reinterpret_cast<const char *>(lChunk.mOid.id), GIT_OID_RAWSZ);
+    }
+    appendBlock(cBlockChunkTable, lPayload);
+}
+
+bool VfsIndex::fileSize(const git_oid *pOid, quint64 &pSize) const
+{
+    const QByteArray lKey = QByteArray::fromRawData(reinterpret_cast<const char *>(pOid->id), GIT_OID_RAWSZ);
+    const char *lEntry = findTableEntry(mFileSizeTable, mFileSizeCount, cFileSizeTableEntrySize, lKey);
+    if (lEntry != nullptr) {
+        memcpy(&pSize, lEntry + GIT_OID_RAWSZ, sizeof(quint64));
+        return true;
+    }
+    auto lIter = mFileSizes.constFind(lKey);
+    if (lIter == mFileSizes.constEnd()) {
+        lIter = mPendingFileSizes.constFind(lKey);
+        if (lIter == mPendingFileSizes.constEnd()) {
+            return false;
+        }
+    }
+    pSize = lIter.value();
+    return true;
+}
+
+void VfsIndex::addFileSize(const git_oid *pOid, quint64 pSize)
+{
+    mPendingFileSizes.insert(oidKey(pOid), pSize);
+}
+
+bool VfsIndex::commits(const QByteArray &pRefName, git_oid &pHead, IndexedCommitList &pCommits) const
+{
+    auto lIter = mBranches.constFind(pRefName);
+    if (lIter == mBranches.constEnd()) {
+        return false;
+    }
+    pHead = lIter.value().mHead;
+    pCommits = lIter.value().mCommits;
+    return true;
+}
+
+bool VfsIndex::branchHead(const QByteArray &pRefName, git_oid &pHead) const
+{
+    auto lIter = mBranches.constFind(pRefName);
+    if (lIter == mBranches.constEnd()) {
+        return false;
+    }
+    pHead = lIter.value().mHead;
+    return true;
+}
+
+void VfsIndex::addCommits(const QByteArray &pRefName, const git_oid *pHead, const IndexedCommitList &pNewCommits, bool pReplace)
+{
+    appendBlock(cBlockCommits, commitsPayload(pRefName, pHead, pNewCommits, pReplace));
+}
+
+void VfsIndex::flush()
+{
+    if (!mPendingFileSizes.isEmpty()) {
+        QByteArray lPayload;
+        QHashIterator<QByteArray, quint64> i(mPendingFileSizes);
+        while (i.hasNext()) {
+            i.next();
+            FileSizeRecord lRecord;
+            memset(&lRecord, 0, sizeof(lRecord));
+            memcpy(lRecord.mOid.id, i.key().constData(), GIT_OID_RAWSZ);
+            lRecord.mSize = i.value();
+            appendRecord(lPayload, lRecord);
+        }
+        mPendingFileSizes.clear();
+        appendBlock(cBlockFileSizes, lPayload);
+    }
+    if (mLocalBlocks.size() == mFlushedSize) {
+        return;
+    }
+    if (!QDir().mkpath(QFileInfo(mPath).absolutePath())) {
+        return;
+    }
+    QLockFile lLock(mPath + QStringLiteral(".lock"));
+    if (!lLock.tryLock(cLockTimeout)) {
+        qCDebug(KUPKIO) << "index file is locked, will try again later" << mPath;
+        return;
+    }
+    // Look at the file as it is now before deciding how to write to it, another
+    // process may have appended to it or replaced it since it was read.
+    if (mDiscardExisting || mValidSize != mMappedSize || fileChanged()) {
+        reload();
+    }
+    if (mDiscardExisting || mValidSize - mIndexedSize + mLocalBlocks.size() - mFlushedSize > cMaxUnindexedSize) {
+        rewrite();
+        return;
+    }
+    QFile lFile(mPath);
+    if (!lFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return;
+    }
+    if (lFile.size() == 0) {
+        const IndexHeader lHeader = indexHeader();
+        lFile.write(reinterpret_cast<const char *>(&lHeader), sizeof(lHeader));
+    }
+    const qint64 lToWrite = mLocalBlocks.size() - mFlushedSize;
+    if (lFile.write(mLocalBlocks.constData() + mFlushedSize, lToWrite) == lToWrite && lFile.flush()) {
+        mFlushedSize = mLocalBlocks.size();
+    }
+    mKnownFileSize = lFile.size();
+}
+
+void VfsIndex::rewrite()
+{
+    // Everything that is known, from the tables, the unsorted part of the file and
+    // this process. The maps give the order of the new tables.
+    QMap<QByteArray, const char *> lRecords; // block payloads
+    for (quint32 i = 0; i < mRecordCount; ++i) {
+        const char *lEntry = mRecordTable + static_cast<qptrdiff>(i) * cRecordTableEntrySize;
+        const char *lData = tableRecord(lEntry);
+        if (lData != nullptr) {
+            lRecords.insert(QByteArray(lEntry, cTableKeySize), lData);
+        }
+    }
+    for (auto lIter = mMappedRecords.constBegin(); lIter != mMappedRecords.constEnd(); ++lIter) {
+        lRecords.insert(lIter.key(), lIter.value());
+    }
+    for (auto lIter = mLocalRecords.constBegin(); lIter != mLocalRecords.constEnd(); ++lIter) {
+        lRecords.insert(lIter.key(), mLocalBlocks.constData() + lIter.value());
+    }
+    QMap<QByteArray, quint64> lFileSizes;
+    for (quint32 i = 0; i < mFileSizeCount; ++i) {
+        const char *lEntry = mFileSizeTable + static_cast<qptrdiff>(i) * cFileSizeTableEntrySize;
+        quint64 lSize;
+        memcpy(&lSize, lEntry + GIT_OID_RAWSZ, sizeof(lSize));
+        lFileSizes.insert(QByteArray(lEntry, GIT_OID_RAWSZ), lSize);
+    }
+    for (auto lIter = mFileSizes.constBegin(); lIter != mFileSizes.constEnd(); ++lIter) {
+        lFileSizes.insert(lIter.key(), lIter.value());
+    }
+
+    const auto lRecordTableSize = static_cast<quint32>(sizeof(quint64) + sizeof(quint32) + lRecords.count() * cRecordTableEntrySize);
+    const auto lFileSizeTableSize = static_cast<quint32>(sizeof(quint32) + lFileSizes.count() * cFileSizeTableEntrySize);
+    quint64 lOffset = sizeof(IndexHeader) + 2 * sizeof(BlockHeader) + lRecordTableSize + lFileSizeTableSize;
+    quint64 lIndexedEnd = lOffset;
+    for (const char *lData : std::as_const(lRecords)) {
+        BlockHeader lBlock;
+        memcpy(&lBlock, lData - sizeof(BlockHeader), sizeof(BlockHeader));
+        lIndexedEnd += sizeof(BlockHeader) + lBlock.mSize;
+    }
+
+    QByteArray lTables;
+    lTables.reserve(static_cast<int>(2 * sizeof(BlockHeader) + lRecordTableSize + lFileSizeTableSize));
+    appendRecord(lTables, BlockHeader{cBlockRecordTable, lRecordTableSize});
+    appendRecord(lTables, lIndexedEnd);
+    appendRecord(lTables, static_cast<quint32>(lRecords.count()));
+    for (auto lIter = lRecords.constBegin(); lIter != lRecords.constEnd(); ++lIter) {
+        BlockHeader lBlock;
+        memcpy(&lBlock, lIter.value() - sizeof(BlockHeader), sizeof(BlockHeader));
+        lTables.append(lIter.key());
+        appendRecord(lTables, static_cast<quint64>(lOffset + sizeof(BlockHeader)));
+        lOffset += sizeof(BlockHeader) + lBlock.mSize;
+    }
+    appendRecord(lTables, BlockHeader{cBlockFileSizeTable, lFileSizeTableSize});
+    appendRecord(lTables, static_cast<quint32>(lFileSizes.count()));
+    for (auto lIter = lFileSizes.constBegin(); lIter != lFileSizes.constEnd(); ++lIter) {
+        lTables.append(lIter.key());
+        appendRecord(lTables, lIter.value());
+    }
+
+    // Replace the file instead of truncating it, other processes may have it mapped.
+    QSaveFile lFile(mPath);
+    if (!lFile.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    const IndexHeader lHeader = indexHeader();
+    lFile.write(reinterpret_cast<const char *>(&lHeader), sizeof(lHeader));
+    lFile.write(lTables);
+    for (const char *lData : std::as_const(lRecords)) {
+        BlockHeader lBlock;
+        memcpy(&lBlock, lData - sizeof(BlockHeader), sizeof(BlockHeader));
+        lFile.write(lData - sizeof(BlockHeader), static_cast<qint64>(sizeof(BlockHeader) + lBlock.mSize));
+    }
+    for (auto lIter = mBranches.constBegin(); lIter != mBranches.constEnd(); ++lIter) {
+        const QByteArray lPayload = commitsPayload(lIter.key(), &lIter.value().mHead, lIter.value().mCommits, true);
+        const BlockHeader lBlock{cBlockCommits, static_cast<quint32>(lPayload.size())};
+        lFile.write(reinterpret_cast<const char *>(&lBlock), sizeof(lBlock));
+        lFile.write(lPayload);
+    }
+    if (lFile.commit()) {
+        mFlushedSize = mLocalBlocks.size();
+        reload(); // map the new file, nothing of this process is left to write
+    }
+}
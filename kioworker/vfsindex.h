@@ -0,0 +1,129 @@
+// SPDX-FileCopyrightText: 2020 Simon Persson <simon.persson@mykolab.com>
+//
+// SPDX-License-Identifier: GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+#ifndef VFSINDEX_H
+#define VFSINDEX_H
+
+#include "vfshelpers.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+struct IndexedEntry {
+    explicit IndexedEntry(uint pMode = DEFAULT_MODE_FILE)
+        : mMode(pMode)
+        , mChunked(false)
+        , mMetadata(pMode)
+    {
+    }
+    QString mName;
+    git_oid mOid{};
+    uint mMode; // mode from the git tree, decides what kind of node to create
+    bool mChunked;
+    Metadata mMetadata;
+};
+
+struct IndexedDirectory {
+    IndexedDirectory()
+        : mMetadata(DEFAULT_MODE_DIRECTORY)
+    {
+    }
+    Metadata mMetadata; // metadata for the directory itself
+    QList<IndexedEntry> mEntries;
+};
+
+struct IndexedCommit {
+    git_oid mCommitOid;
+    git_oid mTreeOid;
+    qint64 mCommitTime;
+};
+typedef QList<IndexedCommit> IndexedCommitList;
+
+// Decode all entries of a bup tree, pMetadataStream should be positioned after the
+// record describing the directory itself. Can be null if the tree has no .bupm file.
+void readDirectoryEntries(git_repository *pRepository, git_tree *pTree, VintStream *pMetadataStream, QList<IndexedEntry> &pEntries);
+// Reads only the first record of the .bupm file, the metadata of the directory itself.
+bool readDirectoryMetadata(git_repository *pRepository, const git_oid *pTreeOid, Metadata &pMetadata);
+bool decodeArchivedDirectory(git_repository *pRepository, const git_oid *pTreeOid, IndexedDirectory &pDirectory);
+
+// Persistent cache of decoded bup trees, branch histories and file sizes. Everything
+// in a bup repository is content addressed so records never need to be invalidated,
+// new records are appended to the end of the file and the file is memory mapped
+// when read. Shared between all kio_bup processes through a lock file.
+// When the appended part grows big the file is rewritten with sorted tables of all
+// records at the start, lookups binary search those in the mapping and only the
+// blocks appended since then are parsed when loading.
+class VfsIndex
+{
+public:
+    explicit VfsIndex(const QString &pRepositoryPath);
+    ~VfsIndex();
+
+    bool directory(const git_oid *pTreeOid, IndexedDirectory &pDirectory) const;
+    bool directoryMetadata(const git_oid *pTreeOid, Metadata &pMetadata) const;
+    bool containsDirectory(const git_oid *pTreeOid) const;
+    void addDirectory(const git_oid *pTreeOid, const IndexedDirectory &pDirectory);
+
+    bool chunkTable(const git_oid *pTreeOid, ChunkTable &pChunks) const;
+    void addChunkTable(const git_oid *pTreeOid, const ChunkTable &pChunks);
+
+    bool fileSize(const git_oid *pOid, quint64 &pSize) const;
+    void addFileSize(const git_oid *pOid, quint64 pSize);
+
+    // Commits are sorted by commit time, oldest first. pHead is the branch head at the time of indexing.
+    bool commits(const QByteArray &pRefName, git_oid &pHead, IndexedCommitList &pCommits) const;
+    bool branchHead(const QByteArray &pRefName, git_oid &pHead) const;
+    void addCommits(const QByteArray &pRefName, const git_oid *pHead, const IndexedCommitList &pNewCommits, bool pReplace);
+
+    void flush();
+
+protected:
+    struct BranchRecord {
+        git_oid mHead;
+        IndexedCommitList mCommits;
+    };
+
+    void load();
+    void readFile(bool pLocked);
+    bool readTables(const char *pData, const char *pEnd);
+    void unload();
+    // Reads the file again and puts the records of this process not yet written on top, the lock must be held.
+    void reload();
+    bool fileChanged() const;
+    // Payload of the block a record table entry points to, null if the entry is broken.
+    const char *tableRecord(const char *pEntry) const;
+    // Writes everything known to a new file with fresh tables, the lock must be held.
+    void rewrite();
+    void parseBlock(quint32 pType, const char *pData, quint32 pSize, bool pMapped);
+    void appendBlock(quint32 pType, const QByteArray &pPayload);
+    void applyCommits(const QByteArray &pRefName, const git_oid *pHead, const IndexedCommitList &pCommits, bool pReplace);
+    // returns start of the block payload following the oid, or null if not found
+    const char *recordData(quint32 pType, const git_oid *pOid, const char *&pEnd) const;
+
+    QString mPath;
+    QFile mFile;
+    uchar *mMapped;
+    qint64 mMappedSize;
+    quint64 mMappedInode;
+    qint64 mKnownFileSize; // file size after the last read or write by this process
+    qint64 mValidSize; // size of the part of the mapped file that could be parsed
+    qint64 mIndexedSize; // the blocks before this offset are in the sorted tables
+    const char *mRecordTable;
+    quint32 mRecordCount;
+    const char *mFileSizeTable;
+    quint32 mFileSizeCount;
+    bool mDiscardExisting;
+    QByteArray mLocalBlocks; // records created by this process
+    int mFlushedSize;
+    QHash<QByteArray, const char *> mMappedRecords; // directories and chunk tables after the sorted part, keyed by oid and type
+    QHash<QByteArray, int> mLocalRecords;
+    QHash<QByteArray, quint64> mFileSizes;
+    QHash<QByteArray, quint64> mPendingFileSizes;
+    QHash<QByteArray, BranchRecord> mBranches;
+};
+
+#endif // VFSINDEX_H